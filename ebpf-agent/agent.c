@@ -1,303 +1,3696 @@
 // eBPF Agent - Userspace component
 // Collects telemetry from eBPF programs and exports Prometheus metrics
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <time.h>
-#include <sys/resource.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <linux/perf_event.h>
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include "telemetry.h"
 #include "telemetry.skel.h"
+#include "cgroup_cache.h"
+#include "collector.h"
+#include "delta.h"
+#include "hist.h"
+#include "history.h"
+#include "probe.h"
+
+// Limits of the --peers table
+#define MAX_PEER_CIDRS 1024
+#define MAX_PEER_DESTS 256
+#define PEER_DEST_OTHER 0   // peers outside every configured CIDR
+#define PEER_CIDR_MAX 55    // longest address/prefix token of --peers, without the NUL
+
+#define STRINGIFY(x) #x
+#define XSTRINGIFY(x) STRINGIFY(x)
+
+// Cores covered by the /proc/stat sampler
+#define MAX_STAT_CPUS 512
+
+// bpffs directory of the maps and links kept across restarts with --pin
+#define PIN_ROOT "/sys/fs/bpf/ebpf-edge-agent"
+
+// Most pods exported with --cgroup-metrics; the rest share the "other" series
+#define MAX_POD_TOP 64
+
+// Number of drop call sites exported with --drop-locations
+#define DROP_LOCATION_TOPK 10
+
+// Packet drops at one kfree_skb call site
+struct drop_location_count {
+    __u64 addr;
+    __u64 count;
+};
+
+// RTT and retransmissions towards one destination node
+struct peer_rtt_stats {
+    const char *dest;
+    double rtt_p50_ms;
+    double rtt_p99_ms;
+    double retrans_rate;
+};
+
+// Active probe results towards one destination node (--probe-port)
+struct probe_peer_stats {
+    const char *dest;
+    double srtt_ms;         // smoothed RTT; only with replied set
+    double age_s;           // since the last reply
+    __u64 sent;
+    __u64 lost;
+    bool replied;
+};
+
+// One of the heaviest flows of the last interval (--flow-topk)
+struct flow_stats {
+    char src[INET6_ADDRSTRLEN + 8];   // addr:port, [addr]:port for IPv6
+    char dst[INET6_ADDRSTRLEN + 8];
+    __u32 value;                      // retransmit estimate, or srtt in us
+};
+
+// RTT, retransmits and runqueue latency of one pod, or of all the others
+struct pod_stats {
+    char uid[POD_UID_LEN];
+    double rtt_p99_ms;
+    double runqlat_p95_ms;
+    double retrans_rate;    // per second
+};
+
+// Cumulative run count and time of one BPF program
+#define MAX_PROG_STATS 32
+
+struct prog_stat {
+    const char *name;
+    __u64 run_cnt;
+    __u64 run_time_ns;
+};
+
+// Agent-side work, timed like the BPF programs
+enum agent_stage {
+    STAGE_RINGBUF_DRAIN,    // one ring buffer poll that consumed records
+    STAGE_UPDATE_METRICS,   // map reads and metric computation
+    STAGE_EXPORT,           // rendering the exposition snapshot
+    NR_AGENT_STAGES,
+};
+
+struct stage_stat {
+    __u64 runs;
+    __u64 time_ns;
+};
+
+// Health of the event pipeline from the BPF hooks to the aggregator
+struct pipeline_stats {
+    struct event_stats events[MAX_EVENT_TYPES];
+    __u64 queue_dropped;
+    size_t ringbuf_size;
+    size_t ringbuf_pending;       // bytes produced but not consumed yet
+    double consumer_lag_avg_s;
+    double consumer_lag_max_s;
+    double poll_batch_max_s;
+    double sample_probability[MAX_EVENT_TYPES];
+    double events_estimated[MAX_EVENT_TYPES];   // received events scaled by 1/probability
+    struct prog_stat progs[MAX_PROG_STATS];
+    int nr_progs;
+    struct stage_stat stages[NR_AGENT_STAGES];
+};
 
 // Prometheus metrics structure
 struct prometheus_metrics {
     double rtt_p50_ms;
     double rtt_p99_ms;
     double tcp_retrans_rate;
-    double drop_rate;
+    double drop_rate;                // all reasons, per second
+    __u64 drops[MAX_DROP_REASONS];   // by enum skb_drop_reason
+    struct drop_location_count drop_locations[DROP_LOCATION_TOPK];
+    int nr_drop_locations;
+    struct peer_rtt_stats peers[MAX_PEER_DESTS];
+    int nr_peers;
+    struct probe_peer_stats probes[PROBE_MAX_TARGETS];
+    int nr_probes;
+    struct pod_stats pods[MAX_POD_TOP + 1];
+    int nr_pods;
+    struct flow_stats flow_retrans[FLOW_TOPK];
+    int nr_flow_retrans;
+    struct flow_stats flow_rtt[FLOW_TOPK];
+    int nr_flow_rtt;
     double runqlat_p95_ms;
+    double net_p50_ms[NR_NET_HISTS];   // by enum net_hist
+    double net_p99_ms[NR_NET_HISTS];
+    double connect_fail_rate;          // per second
     double cpu_utilization;
+    double cpu_core_utilization[MAX_STAT_CPUS];   // -1 for offline CPUs
+    int nr_cpu_cores;
+    struct pipeline_stats pipeline;
     char node_name[64];
     time_t last_update;
 };
 
-static volatile bool exiting = false;
-static struct telemetry_bpf *skel = NULL;
+// How often maps are read and metrics recomputed, by default
+#define METRICS_INTERVAL_MS 5000
+
+// RTT collection backends, in the order --rtt-backend=auto tries them
+enum rtt_backend {
+    RTT_AUTO = -1,
+    RTT_SOCKOPS,      // sock_ops RTT callback, only on RTT updates
+    RTT_FENTRY,       // fentry/tcp_rcv_established
+    RTT_KPROBE,       // kprobe/tcp_rcv_established, no BTF trampolines needed
+    RTT_TRACEPOINT,   // tracepoint/tcp/tcp_ack
+    NR_RTT_BACKENDS,
+};
+
+static const char *const event_type_names[MAX_EVENT_TYPES] = {
+    [EVENT_RTT] = "rtt",
+    [EVENT_RETRANS] = "retrans",
+    [EVENT_DROP] = "drop",
+    [EVENT_RUNQLAT] = "runqlat",
+};
+
+// Metric name stems and help text of enum net_hist
+static const char *const net_hist_names[NR_NET_HISTS] = {
+    [NET_HIST_CONNECT] = "tcp_connect",
+    [NET_HIST_ACCEPT] = "tcp_accept",
+    [NET_HIST_UDP_SEND] = "udp_send",
+    [NET_HIST_UDP_RECV] = "udp_recv_queue",
+};
+
+static const char *const net_hist_help[NR_NET_HISTS] = {
+    [NET_HIST_CONNECT] = "TCP connect latency (SYN sent to established)",
+    [NET_HIST_ACCEPT] = "TCP accept handshake latency (SYN-ACK sent to final ACK)",
+    [NET_HIST_UDP_SEND] = "UDP send latency (time in udp_sendmsg)",
+    [NET_HIST_UDP_RECV] = "UDP receive queue latency (enqueue to recvmsg)",
+};
+
+static const char *const agent_stage_names[NR_AGENT_STAGES] = {
+    [STAGE_RINGBUF_DRAIN] = "ringbuf_drain",
+    [STAGE_UPDATE_METRICS] = "update_metrics",
+    [STAGE_EXPORT] = "export",
+};
+
+static const char *const rtt_backend_names[NR_RTT_BACKENDS] = {
+    [RTT_SOCKOPS] = "sockops",
+    [RTT_FENTRY] = "fentry",
+    [RTT_KPROBE] = "kprobe",
+    [RTT_TRACEPOINT] = "tracepoint",
+};
+
+// Command line configuration
+static struct env {
+    bool percpu_maps;
+    bool mmap_stats;
+    bool aggregate_only;
+    bool batch_events;
+    bool drop_locations;
+    bool cgroup_metrics;
+    bool flow_topk;
+    bool udp_latency;
+    bool pin;
+    bool prog_stats;
+    __u32 pod_top;
+    bool verbose;
+    bool stdout_export;
+    int port;
+    const char *peers_file;
+    int rtt_backend;
+    const char *cgroup_path;
+    __u32 rtt_sample_rate;
+    __u32 retrans_sample_rate;
+    __u32 drop_sample_rate;
+    __u32 event_budget;
+    __u32 rtt_outlier_ms;
+    __u32 rtt_min_interval_ms;
+    __u32 rtt_min_change_us;
+    __u32 interval_ms;
+    const char *push_addr;
+    const char *history_path;
+    __u32 history_records;
+    int probe_port;
+    __u32 probe_interval_ms;
+    __u32 probe_fanout;
+    struct poll_policy poll;
+    struct thread_policy threads;
+} env = {
+    .percpu_maps = true,
+    .mmap_stats = true,
+    .prog_stats = true,
+    .port = 8080,
+    .rtt_backend = RTT_AUTO,
+    .cgroup_path = "/sys/fs/cgroup",
+    .rtt_sample_rate = 100,
+    .retrans_sample_rate = 1,
+    .drop_sample_rate = 10,
+    .event_budget = 5000,
+    .pod_top = 20,
+    .interval_ms = METRICS_INTERVAL_MS,
+    .rtt_min_interval_ms = 100,
+    .history_records = HISTORY_DEFAULT_RECORDS,
+    .probe_interval_ms = 1000,
+    .probe_fanout = 8,
+    .poll = { .mode = POLL_EPOLL, .timeout_ms = 100, .period_us = 1000, .busy_cpu = -1 },
+};
+
+static atomic_bool exiting = false;
+static struct telemetry_bpf *skel = NULL;
+
+// Per-CPU maps return one value per possible CPU, each padded to 8 bytes
+_Static_assert(sizeof(struct node_metrics) % 8 == 0, "node_metrics must be 8-byte aligned");
+_Static_assert(sizeof(struct hist) % 8 == 0, "hist must be 8-byte aligned");
+
+static int nr_cpus = 1;           // values per map element (1 for shared maps)
+static void *percpu_buf = NULL;   // lookup buffer holding nr_cpus values
+
+// Preallocated buffers for dumping a whole map in a few syscalls
+struct map_dump {
+    struct bpf_map *map;
+    void *keys;
+    void *values;          // max_entries * nr_values values
+    void *prev_key;        // cursor for the key-by-key fallback
+    __u32 key_size;
+    __u32 value_size;      // stride of one (per-CPU) value
+    __u32 max_entries;
+    __u32 count;           // entries returned by the last read
+    int nr_values;         // values per entry: nr_cpus for per-CPU maps, else 1
+    bool no_batch;         // kernel lacks batch ops, iterate keys instead
+};
+
+#ifndef ENOTSUPP
+#define ENOTSUPP 524  // kernel-internal errno returned for unsupported map ops
+#endif
+
+static struct map_dump node_metrics_dump;
+static struct map_dump drop_reason_dump;
+static struct map_dump drop_location_dump;
+static struct map_dump cgroup_dump;
+static struct map_dump peer_dump;
+static struct map_dump event_stats_dump;
+
+// Values of the previous metrics interval, per map key. Rates and
+// percentiles are computed over the interval from the differences.
+struct node_sample {
+    __u64 retrans_count;
+    __u64 connect_failed;
+};
+
+struct peer_sample {
+    __u64 retrans_count;
+    struct hist rtt;
+};
+
+struct cgroup_sample {
+    __u64 retrans_count;
+    __u64 activity;         // rtt, retransmit and runqueue samples
+    struct hist rtt;
+    struct hist runqlat;
+};
+
+static struct delta_set *node_deltas;      // node_metrics_map, node_sample
+static struct delta_set *drop_deltas;      // drop_reason_map, __u64
+static struct delta_set *peer_deltas;      // peer_metrics_map, peer_sample
+static struct delta_set *cgroup_deltas;    // cgroup_metrics_map, cgroup_sample
+
+// Node-wide counters and histograms read from the mapping of
+// node_stats_map (the default where the kernel has BPF_F_MMAPABLE, 5.5+),
+// so collecting them takes no syscalls. Each CPU's slot is compared with
+// its copy from the last interval.
+#define NODE_STATS_RETRIES 16
+
+static struct node_stats *node_stats_mem;
+static size_t node_stats_len;
+static struct node_stats *node_stats_prev;
+static int node_stats_cpus;
+static __u64 node_stats_last_ns;
+
+// --history ring file; update_metrics fills in a record every interval
+static struct history *history;
+static struct history_record history_rec;
+static __u64 history_last_ns;
+
+// Active RTT probes to the nodes of the --peers host entries (--probe-port).
+// Only the aggregator thread touches it.
+static struct prober *prober;
+
+// cgroup id to pod resolution for --cgroup-metrics
+static struct cgroup_cache *cgroups;
+
+// Maps remote addresses to node names (--peers). Entries are kept sorted
+// by descending prefix length so the first match is the longest one.
+
+struct peer_cidr {
+    __u8 addr[16];
+    __u16 family;
+    __u8 prefix_len;
+    int dest;               // index into peer_dests
+};
+
+// Per destination node accumulation across all of its peer addresses
+struct peer_dest {
+    char name[64];
+    struct hist rtt;
+    __u64 retrans_count;    // over the last interval
+    bool active;            // had samples in the last dump
+};
+
+static struct peer_cidr peer_cidrs[MAX_PEER_CIDRS];
+static int nr_peer_cidrs;
+static struct peer_dest peer_dests[MAX_PEER_DESTS] = {
+    [PEER_DEST_OTHER] = { .name = "other" },
+};
+static int nr_peer_dests = 1;
+
+static const char usage[] =
+    "Usage: ebpf-agent [OPTIONS]\n"
+    "Collect network and scheduling telemetry and export Prometheus metrics.\n"
+    "\n"
+    "  -S, --shared-maps         use shared maps with atomic updates instead of per-CPU maps\n"
+    "      --no-mmap-stats       read node counters and histograms with map syscalls, not shared memory\n"
+    "  -a, --aggregate-only      only update maps; send just exceptional events to userspace\n"
+    "      --rtt-sample=N        export at most 1 in N RTT samples (default 100, 0 = none)\n"
+    "      --retrans-sample=N    export at most 1 in N retransmits (default 1, 0 = none)\n"
+    "      --drop-sample=N       export at most 1 in N packet drops (default 10, 0 = none)\n"
+    "      --event-budget=N      lower the sample rates to keep under N events/s (default 5000, 0 = fixed rates)\n"
+    "      --batch-events        send events to userspace in per-CPU batches\n"
+    "      --drop-locations      also count drops per kfree_skb call site (top 10 exported)\n"
+    "      --rtt-outlier-ms=MS   always export RTTs of at least MS (default 0 = off)\n"
+    "      --rtt-interval-ms=MS  record at most one RTT per socket every MS (default 100)\n"
+    "      --rtt-change-us=US    ...or whenever srtt moved by more than US (default 0 = off)\n"
+    "  -r, --rtt-backend=NAME    auto, sockops, fentry, kprobe or tracepoint (default auto)\n"
+    "      --cgroup=PATH         cgroup v2 root for the sockops backend (default /sys/fs/cgroup)\n"
+    "      --cgroup-metrics      also break RTT, retransmits and runqueue latency down by pod\n"
+    "      --pod-top=N           export the N busiest pods, the rest as \"other\" (default 20, max 64)\n"
+    "      --flow-topk           also export the flows with the most retransmits and the worst RTT\n"
+    "      --udp-latency         also measure UDP send and receive queue latency (kprobes)\n"
+    "  -P, --peers=FILE          map remote addresses to node names (\"<cidr> <node>\" per line)\n"
+    "  -p, --port=PORT           serve /metrics, /health and /ready on PORT (default 8080, 0 = off)\n"
+    "      --stdout              also print the metrics to stdout every interval\n"
+    "  -i, --interval-ms=MS      recompute the metrics every MS (default 5000)\n"
+    "      --push=HOST:PORT      also send a node snapshot to the scheduler extender over UDP every interval\n"
+    "      --history=FILE        also append every interval's histograms and counters to a ring file\n"
+    "      --history-records=N   intervals kept in the history file (default 86400)\n"
+    "      --probe-port=PORT     answer RTT probes on UDP PORT and probe the --peers host entries (default 0 = off)\n"
+    "      --probe-interval=MS   start a probe round every MS, jittered by 25% (default 1000)\n"
+    "      --probe-fanout=N      peers probed per round (default 8)\n"
+    "      --poll=MODE           ring buffer consumer: epoll, busy or coalesce (default epoll)\n"
+    "      --poll-period-us=US   drain period of --poll=coalesce (default 1000)\n"
+    "      --busy-cpu=CPU        pin the --poll=busy consumer to CPU\n"
+    "      --cpus=LIST           run the agent threads on these CPUs only (e.g. 0-1,8)\n"
+    "      --sched-idle          run the agent threads under SCHED_IDLE\n"
+    "      --nice=N              nice value of the agent threads\n"
+    "      --pin                 keep maps and programs pinned under " PIN_ROOT " across restarts\n"
+    "      --unpin               remove everything pinned by --pin and exit\n"
+    "      --no-prog-stats       do not enable BPF run time stats for the per-program metrics\n"
+    "  -v, --verbose             print every received event\n"
+    "  -h, --help                show this help\n";
+
+enum {
+    OPT_RTT_SAMPLE = 0x100,
+    OPT_RETRANS_SAMPLE,
+    OPT_DROP_SAMPLE,
+    OPT_EVENT_BUDGET,
+    OPT_BATCH_EVENTS,
+    OPT_DROP_LOCATIONS,
+    OPT_RTT_OUTLIER,
+    OPT_RTT_MIN_INTERVAL,
+    OPT_RTT_MIN_CHANGE,
+    OPT_STDOUT,
+    OPT_CGROUP,
+    OPT_CGROUP_METRICS,
+    OPT_POD_TOP,
+    OPT_FLOW_TOPK,
+    OPT_UDP_LATENCY,
+    OPT_PUSH,
+    OPT_HISTORY,
+    OPT_HISTORY_RECORDS,
+    OPT_PROBE_PORT,
+    OPT_PROBE_INTERVAL,
+    OPT_PROBE_FANOUT,
+    OPT_POLL,
+    OPT_POLL_PERIOD,
+    OPT_BUSY_CPU,
+    OPT_CPUS,
+    OPT_SCHED_IDLE,
+    OPT_NICE,
+    OPT_PIN,
+    OPT_UNPIN,
+    OPT_NO_PROG_STATS,
+    OPT_NO_MMAP_STATS,
+};
+
+static int unpin_all(void);
+
+static __u32 parse_u32(const char *arg, const char *name) {
+    char *end;
+    unsigned long val;
+
+    errno = 0;
+    val = strtoul(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || val > UINT32_MAX) {
+        fprintf(stderr, "Invalid value for %s: %s\n", name, arg);
+        exit(1);
+    }
+    return val;
+}
+
+static int parse_rtt_backend(const char *arg) {
+    if (strcmp(arg, "auto") == 0)
+        return RTT_AUTO;
+    for (int i = 0; i < NR_RTT_BACKENDS; i++) {
+        if (strcmp(arg, rtt_backend_names[i]) == 0)
+            return i;
+    }
+    fprintf(stderr, "Invalid RTT backend: %s\n", arg);
+    exit(1);
+}
+
+static enum poll_mode parse_poll_mode(const char *arg) {
+    int mode = poll_mode_parse(arg);
+    
+    if (mode < 0) {
+        fprintf(stderr, "Invalid --poll: %s (epoll, busy or coalesce)\n", arg);
+        exit(1);
+    }
+    return mode;
+}
+
+static int parse_nice(const char *arg) {
+    char *end;
+    long val = strtol(arg, &end, 10);
+    
+    if (end == arg || *end != '\0' || val < -20 || val > 19) {
+        fprintf(stderr, "Invalid --nice: %s (-20 to 19)\n", arg);
+        exit(1);
+    }
+    return val;
+}
+
+static void parse_args(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "shared-maps",    no_argument,       NULL, 'S' },
+        { "no-mmap-stats",  no_argument,       NULL, OPT_NO_MMAP_STATS },
+        { "aggregate-only", no_argument,       NULL, 'a' },
+        { "rtt-sample",     required_argument, NULL, OPT_RTT_SAMPLE },
+        { "retrans-sample", required_argument, NULL, OPT_RETRANS_SAMPLE },
+        { "drop-sample",    required_argument, NULL, OPT_DROP_SAMPLE },
+        { "event-budget",   required_argument, NULL, OPT_EVENT_BUDGET },
+        { "batch-events",   no_argument,       NULL, OPT_BATCH_EVENTS },
+        { "drop-locations", no_argument,       NULL, OPT_DROP_LOCATIONS },
+        { "rtt-outlier-ms", required_argument, NULL, OPT_RTT_OUTLIER },
+        { "rtt-interval-ms", required_argument, NULL, OPT_RTT_MIN_INTERVAL },
+        { "rtt-change-us",  required_argument, NULL, OPT_RTT_MIN_CHANGE },
+        { "rtt-backend",    required_argument, NULL, 'r' },
+        { "cgroup",         required_argument, NULL, OPT_CGROUP },
+        { "cgroup-metrics", no_argument,       NULL, OPT_CGROUP_METRICS },
+        { "pod-top",        required_argument, NULL, OPT_POD_TOP },
+        { "flow-topk",      no_argument,       NULL, OPT_FLOW_TOPK },
+        { "udp-latency",    no_argument,       NULL, OPT_UDP_LATENCY },
+        { "peers",          required_argument, NULL, 'P' },
+        { "port",           required_argument, NULL, 'p' },
+        { "stdout",         no_argument,       NULL, OPT_STDOUT },
+        { "interval-ms",    required_argument, NULL, 'i' },
+        { "push",           required_argument, NULL, OPT_PUSH },
+        { "history",        required_argument, NULL, OPT_HISTORY },
+        { "history-records", required_argument, NULL, OPT_HISTORY_RECORDS },
+        { "probe-port",     required_argument, NULL, OPT_PROBE_PORT },
+        { "probe-interval", required_argument, NULL, OPT_PROBE_INTERVAL },
+        { "probe-fanout",   required_argument, NULL, OPT_PROBE_FANOUT },
+        { "poll",           required_argument, NULL, OPT_POLL },
+        { "poll-period-us", required_argument, NULL, OPT_POLL_PERIOD },
+        { "busy-cpu",       required_argument, NULL, OPT_BUSY_CPU },
+        { "cpus",           required_argument, NULL, OPT_CPUS },
+        { "sched-idle",     no_argument,       NULL, OPT_SCHED_IDLE },
+        { "nice",           required_argument, NULL, OPT_NICE },
+        { "pin",            no_argument,       NULL, OPT_PIN },
+        { "unpin",          no_argument,       NULL, OPT_UNPIN },
+        { "no-prog-stats",  no_argument,       NULL, OPT_NO_PROG_STATS },
+        { "verbose",        no_argument,       NULL, 'v' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "Sar:P:p:i:vh", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'S':
+                env.percpu_maps = false;
+                break;
+            case OPT_NO_MMAP_STATS:
+                env.mmap_stats = false;
+                break;
+            case 'a':
+                env.aggregate_only = true;
+                break;
+            case OPT_RTT_SAMPLE:
+                env.rtt_sample_rate = parse_u32(optarg, "--rtt-sample");
+                break;
+            case OPT_RETRANS_SAMPLE:
+                env.retrans_sample_rate = parse_u32(optarg, "--retrans-sample");
+                break;
+            case OPT_DROP_SAMPLE:
+                env.drop_sample_rate = parse_u32(optarg, "--drop-sample");
+                break;
+            case OPT_EVENT_BUDGET:
+                env.event_budget = parse_u32(optarg, "--event-budget");
+                break;
+            case OPT_BATCH_EVENTS:
+                env.batch_events = true;
+                break;
+            case OPT_DROP_LOCATIONS:
+                env.drop_locations = true;
+                break;
+            case OPT_RTT_OUTLIER:
+                env.rtt_outlier_ms = parse_u32(optarg, "--rtt-outlier-ms");
+                break;
+            case OPT_RTT_MIN_INTERVAL:
+                env.rtt_min_interval_ms = parse_u32(optarg, "--rtt-interval-ms");
+                break;
+            case OPT_RTT_MIN_CHANGE:
+                env.rtt_min_change_us = parse_u32(optarg, "--rtt-change-us");
+                break;
+            case 'r':
+                env.rtt_backend = parse_rtt_backend(optarg);
+                break;
+            case OPT_CGROUP:
+                env.cgroup_path = optarg;
+                break;
+            case OPT_CGROUP_METRICS:
+                env.cgroup_metrics = true;
+                break;
+            case OPT_POD_TOP:
+                env.pod_top = parse_u32(optarg, "--pod-top");
+                if (env.pod_top > MAX_POD_TOP) {
+                    fprintf(stderr, "Invalid --pod-top: %s (max %d)\n", optarg, MAX_POD_TOP);
+                    exit(1);
+                }
+                break;
+            case OPT_FLOW_TOPK:
+                env.flow_topk = true;
+                break;
+            case OPT_UDP_LATENCY:
+                env.udp_latency = true;
+                break;
+            case 'P':
+                env.peers_file = optarg;
+                break;
+            case 'p':
+                env.port = parse_u32(optarg, "--port");
+                if (env.port > 65535) {
+                    fprintf(stderr, "Invalid port: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_STDOUT:
+                env.stdout_export = true;
+                break;
+            case 'i':
+                env.interval_ms = parse_u32(optarg, "--interval-ms");
+                if (env.interval_ms < 100) {
+                    fprintf(stderr, "Invalid --interval-ms: %s (min 100)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_PUSH:
+                env.push_addr = optarg;
+                break;
+            case OPT_HISTORY:
+                env.history_path = optarg;
+                break;
+            case OPT_HISTORY_RECORDS:
+                env.history_records = parse_u32(optarg, "--history-records");
+                if (!env.history_records) {
+                    fprintf(stderr, "Invalid --history-records: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_PROBE_PORT:
+                env.probe_port = parse_u32(optarg, "--probe-port");
+                if (env.probe_port > 65535) {
+                    fprintf(stderr, "Invalid --probe-port: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_PROBE_INTERVAL:
+                env.probe_interval_ms = parse_u32(optarg, "--probe-interval");
+                if (!env.probe_interval_ms) {
+                    fprintf(stderr, "Invalid --probe-interval: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_PROBE_FANOUT:
+                env.probe_fanout = parse_u32(optarg, "--probe-fanout");
+                if (!env.probe_fanout) {
+                    fprintf(stderr, "Invalid --probe-fanout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_POLL:
+                env.poll.mode = parse_poll_mode(optarg);
+                break;
+            case OPT_POLL_PERIOD:
+                env.poll.period_us = parse_u32(optarg, "--poll-period-us");
+                if (!env.poll.period_us) {
+                    fprintf(stderr, "Invalid --poll-period-us: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_BUSY_CPU:
+                env.poll.busy_cpu = parse_u32(optarg, "--busy-cpu");
+                if (env.poll.busy_cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid --busy-cpu: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_CPUS:
+                if (cpu_list_parse(optarg, &env.threads.cpus)) {
+                    fprintf(stderr, "Invalid --cpus: %s\n", optarg);
+                    exit(1);
+                }
+                env.threads.set_cpus = true;
+                break;
+            case OPT_SCHED_IDLE:
+                env.threads.sched_idle = true;
+                break;
+            case OPT_NICE:
+                env.threads.nice = parse_nice(optarg);
+                break;
+            case OPT_PIN:
+                env.pin = true;
+                break;
+            case OPT_UNPIN:
+                exit(unpin_all() ? 1 : 0);
+            case OPT_NO_PROG_STATS:
+                env.prog_stats = false;
+                break;
+            case 'v':
+                env.verbose = true;
+                break;
+            case 'h':
+                fputs(usage, stdout);
+                exit(0);
+            default:
+                fputs(usage, stderr);
+                exit(1);
+        }
+    }
+}
+
+// CPU utilization over the last interval from /proc/stat. The file stays
+// open and is re-read with pread() at offset 0; only the leading cpu lines
+// are parsed, with a small integer scanner instead of stdio.
+struct cpu_times {
+    __u64 busy;
+    __u64 total;
+};
+
+static struct cpu_sampler {
+    int fd;
+    char *buf;
+    size_t cap;
+    struct cpu_times prev[MAX_STAT_CPUS + 1];   // [0] is the node-wide line
+    bool have_prev[MAX_STAT_CPUS + 1];
+} cpu_sampler = { .fd = -1 };
+
+static const char *scan_u64(const char *p, const char *end, __u64 *val) {
+    __u64 v = 0;
+    
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return NULL;
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    *val = v;
+    return p;
+}
+
+// Parse "cpu[N] user nice system idle iowait irq softirq steal ..." into
+// slot 0 for the node or N + 1. Guest time is already part of user and
+// nice. Returns the next line, or NULL when the line is cut off.
+static const char *parse_cpu_line(const char *p, const char *end, int *slot,
+                                  struct cpu_times *t) {
+    __u64 v[8] = {0};   // user nice system idle iowait irq softirq steal
+    int n = 0;
+    
+    p += 3;
+    if (p < end && *p == ' ') {
+        *slot = 0;
+    } else {
+        __u64 cpu;
+        if (!(p = scan_u64(p, end, &cpu)))
+            return NULL;
+        *slot = cpu < MAX_STAT_CPUS ? cpu + 1 : -1;
+    }
+    for (const char *q; n < 8 && (q = scan_u64(p, end, &v[n])); n++)
+        p = q;
+    while (p < end && *p != '\n')
+        p++;
+    if (p == end || n < 5)
+        return NULL;
+    
+    t->busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+    t->total = t->busy + v[3] + v[4];
+    return p + 1;
+}
+
+static double cpu_interval_util(const struct cpu_times *prev, const struct cpu_times *cur) {
+    __u64 busy = cur->busy - prev->busy;
+    __u64 total = cur->total - prev->total;
+    
+    return cur->total > prev->total ? (double)busy / total * 100.0 : 0.0;
+}
+
+// Fill the node and per-core utilization since the previous call; the
+// first call reports the average since boot
+static void update_cpu_utilization(struct prometheus_metrics *metrics) {
+    struct cpu_sampler *s = &cpu_sampler;
+    ssize_t len;
+    
+    if (s->fd < 0 && (s->fd = open("/proc/stat", O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    
+    // Grow the buffer until it holds all cpu lines
+    for (;;) {
+        if (!s->buf) {
+            s->cap = 16384;
+            if (!(s->buf = malloc(s->cap)))
+                return;
+        }
+        len = pread(s->fd, s->buf, s->cap, 0);
+        if (len <= 0)
+            return;
+        if ((size_t)len < s->cap || memmem(s->buf, len, "\nintr", 5))
+            break;
+        char *buf = realloc(s->buf, s->cap * 2);
+        if (!buf)
+            return;
+        s->buf = buf;
+        s->cap *= 2;
+    }
+    
+    const char *p = s->buf, *end = s->buf + len;
+    metrics->nr_cpu_cores = 0;
+    while (end - p > 3 && memcmp(p, "cpu", 3) == 0) {
+        static const struct cpu_times zero;
+        struct cpu_times cur;
+        int slot;
+        
+        if (!(p = parse_cpu_line(p, end, &slot, &cur)))
+            break;
+        if (slot < 0)
+            continue;
+        
+        double util = cpu_interval_util(s->have_prev[slot] ? &s->prev[slot] : &zero, &cur);
+        s->prev[slot] = cur;
+        s->have_prev[slot] = true;
+        if (slot == 0) {
+            metrics->cpu_utilization = util;
+            continue;
+        }
+        // Offline CPUs have no line; leave a hole for them
+        while (metrics->nr_cpu_cores < slot - 1)
+            metrics->cpu_core_utilization[metrics->nr_cpu_cores++] = -1.0;
+        metrics->cpu_core_utilization[metrics->nr_cpu_cores++] = util;
+    }
+}
+
+// Get node name from $NODE_NAME (set by the DaemonSet) or the hostname
+static void get_node_name(char *node_name, size_t size) {
+    const char *env_name = getenv("NODE_NAME");
+    
+    if (env_name && *env_name) {
+        snprintf(node_name, size, "%s", env_name);
+        return;
+    }
+    if (gethostname(node_name, size) != 0) {
+        strncpy(node_name, "unknown", size);
+    }
+}
+
+static void map_dump_free(struct map_dump *d) {
+    free(d->keys);
+    free(d->values);
+    free(d->prev_key);
+    d->keys = d->values = d->prev_key = NULL;
+}
+
+static bool map_is_percpu(const struct bpf_map *map) {
+    switch (bpf_map__type(map)) {
+        case BPF_MAP_TYPE_PERCPU_HASH:
+        case BPF_MAP_TYPE_PERCPU_ARRAY:
+        case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int map_dump_init(struct map_dump *d, struct bpf_map *map) {
+    memset(d, 0, sizeof(*d));
+    d->map = map;
+    d->key_size = bpf_map__key_size(map);
+    d->value_size = (bpf_map__value_size(map) + 7) & ~7u;
+    d->max_entries = bpf_map__max_entries(map);
+    d->nr_values = map_is_percpu(map) ? nr_cpus : 1;
+    d->keys = calloc(d->max_entries, d->key_size);
+    d->values = calloc((size_t)d->max_entries * d->nr_values, d->value_size);
+    d->prev_key = calloc(1, d->key_size);
+    if (!d->keys || !d->values || !d->prev_key) {
+        map_dump_free(d);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Value of entry idx as seen by one CPU (cpu is 0 for shared maps)
+static inline void *map_dump_value(const struct map_dump *d, __u32 idx, int cpu) {
+    return (char *)d->values + ((size_t)idx * d->nr_values + cpu) * d->value_size;
+}
+
+// Fallback for kernels without BPF_MAP_LOOKUP_BATCH (< 5.6)
+static int map_dump_iterate(struct map_dump *d, bool delete) {
+    int fd = bpf_map__fd(d->map);
+    char *key = d->keys;
+    bool first = true;
+
+    d->count = 0;
+    while (d->count < d->max_entries &&
+           bpf_map_get_next_key(fd, first ? NULL : d->prev_key, key) == 0) {
+        first = false;
+        memcpy(d->prev_key, key, d->key_size);
+        if (bpf_map_lookup_elem(fd, key, map_dump_value(d, d->count, 0)) == 0) {
+            key += d->key_size;
+            d->count++;
+        }
+    }
+    // Delete after the walk so get_next_key does not restart from the top
+    if (delete) {
+        for (__u32 i = 0; i < d->count; i++)
+            bpf_map_delete_elem(fd, (char *)d->keys + (size_t)i * d->key_size);
+    }
+    return 0;
+}
+
+// Read every entry of the map into the dump buffers. With delete set the
+// entries are removed as they are read, which resets interval counters.
+static int map_dump_read(struct map_dump *d, bool delete) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    int fd = bpf_map__fd(d->map);
+    __u64 token;
+    __u32 total = 0;
+    bool first = true;
+    int err = 0;
+
+    if (d->no_batch)
+        return map_dump_iterate(d, delete);
+
+    while (total < d->max_entries) {
+        void *keys = (char *)d->keys + (size_t)total * d->key_size;
+        void *values = map_dump_value(d, total, 0);
+        __u32 count = d->max_entries - total;
+
+        if (delete)
+            err = bpf_map_lookup_and_delete_batch(fd, first ? NULL : &token, &token,
+                                                  keys, values, &count, &opts);
+        else
+            err = bpf_map_lookup_batch(fd, first ? NULL : &token, &token,
+                                       keys, values, &count, &opts);
+        first = false;
+        total += count;
+        if (err)
+            break;
+    }
+
+    if (total == 0 && (err == -EINVAL || err == -EOPNOTSUPP || err == -ENOTSUPP)) {
+        d->no_batch = true;
+        return map_dump_iterate(d, delete);
+    }
+    if (err && err != -ENOENT)
+        return err;
+
+    d->count = total;
+    return 0;
+}
+
+static int peer_dest_index(const char *name) {
+    for (int i = 0; i < nr_peer_dests; i++) {
+        if (strcmp(peer_dests[i].name, name) == 0)
+            return i;
+    }
+    if (nr_peer_dests == MAX_PEER_DESTS)
+        return -1;
+    snprintf(peer_dests[nr_peer_dests].name, sizeof(peer_dests[0].name), "%s", name);
+    return nr_peer_dests++;
+}
+
+static int cmp_peer_cidr(const void *a, const void *b) {
+    const struct peer_cidr *x = a, *y = b;
+    return (int)y->prefix_len - (int)x->prefix_len;
+}
+
+// Load "<cidr> <node-name>" lines; '#' starts a comment
+static int load_peer_table(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    int lineno = 0;
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open peer table %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char cidr[PEER_CIDR_MAX + 1], name[64], *slash, *end;
+        struct peer_cidr *pc = &peer_cidrs[nr_peer_cidrs];
+        unsigned long len;
+
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (sscanf(line, "%" XSTRINGIFY(PEER_CIDR_MAX) "s %63s", cidr, name) != 2)
+            continue;  // blank or comment line
+        if (nr_peer_cidrs == MAX_PEER_CIDRS) {
+            fprintf(stderr, "%s:%d: too many entries (max %d)\n", path, lineno, MAX_PEER_CIDRS);
+            break;
+        }
+
+        slash = strchr(cidr, '/');
+        if (slash)
+            *slash++ = '\0';
+        memset(pc, 0, sizeof(*pc));
+        if (inet_pton(AF_INET, cidr, pc->addr) == 1) {
+            pc->family = AF_INET;
+            len = 32;
+        } else if (inet_pton(AF_INET6, cidr, pc->addr) == 1) {
+            pc->family = AF_INET6;
+            len = 128;
+        } else {
+            fprintf(stderr, "%s:%d: invalid address '%s'\n", path, lineno, cidr);
+            continue;
+        }
+        if (slash) {
+            unsigned long max = len;
+            len = strtoul(slash, &end, 10);
+            if (*end != '\0' || len > max) {
+                fprintf(stderr, "%s:%d: invalid prefix length '/%s'\n", path, lineno, slash);
+                continue;
+            }
+        }
+        pc->prefix_len = len;
+        pc->dest = peer_dest_index(name);
+        if (pc->dest < 0) {
+            fprintf(stderr, "%s:%d: too many node names (max %d)\n", path, lineno, MAX_PEER_DESTS);
+            continue;
+        }
+        nr_peer_cidrs++;
+    }
+    fclose(fp);
+
+    qsort(peer_cidrs, nr_peer_cidrs, sizeof(peer_cidrs[0]), cmp_peer_cidr);
+    printf("Loaded %d peer CIDRs for %d nodes from %s\n",
+           nr_peer_cidrs, nr_peer_dests - 1, path);
+    return 0;
+}
+
+static bool prefix_match(const __u8 *addr, const __u8 *net, int prefix_len) {
+    int bytes = prefix_len / 8, bits = prefix_len % 8;
+
+    if (memcmp(addr, net, bytes) != 0)
+        return false;
+    if (bits == 0)
+        return true;
+    __u8 mask = 0xff << (8 - bits);
+    return (addr[bytes] & mask) == (net[bytes] & mask);
+}
+
+// Longest-prefix match of a peer address to its destination node
+static int resolve_peer(const struct peer_key *key) {
+    for (int i = 0; i < nr_peer_cidrs; i++) {
+        const struct peer_cidr *pc = &peer_cidrs[i];
+        if (pc->family == key->family && prefix_match(key->addr, pc->addr, pc->prefix_len))
+            return pc->dest;
+    }
+    return PEER_DEST_OTHER;
+}
+
+// Fold the peer map into per-destination-node RTT and retransmit stats
+// over the last interval
+static void update_peer_metrics(struct prometheus_metrics *metrics, __u64 now_ns) {
+    metrics->nr_peers = 0;
+    if (map_dump_read(&peer_dump, false) != 0)
+        return;
+    double interval = delta_begin(peer_deltas, now_ns);
+
+    for (int d = 0; d < nr_peer_dests; d++) {
+        memset(&peer_dests[d].rtt, 0, sizeof(peer_dests[d].rtt));
+        peer_dests[d].retrans_count = 0;
+        peer_dests[d].active = false;
+    }
+
+    for (__u32 i = 0; i < peer_dump.count; i++) {
+        const struct peer_key *key = (const struct peer_key *)peer_dump.keys + i;
+        const struct peer_metrics *pm = map_dump_value(&peer_dump, i, 0);
+        struct peer_dest *dest = &peer_dests[resolve_peer(key)];
+        struct peer_sample cur, delta;
+
+        cur.retrans_count = pm->retrans_count;
+        cur.rtt = pm->rtt;
+        delta_update(peer_deltas, key, &cur, &delta);
+        for (int j = 0; j < MAX_SLOTS; j++)
+            dest->rtt.slots[j] += delta.rtt.slots[j];
+        dest->retrans_count += delta.retrans_count;
+        dest->active = true;
+    }
+
+    for (int d = 0; d < nr_peer_dests; d++) {
+        struct peer_dest *dest = &peer_dests[d];
+        struct peer_rtt_stats *ps;
+
+        if (!dest->active)
+            continue;
+
+        ps = &metrics->peers[metrics->nr_peers++];
+        ps->dest = dest->name;
+        ps->rtt_p50_ms = hist_percentile(&dest->rtt, 50.0) / 1000.0;
+        ps->rtt_p99_ms = hist_percentile(&dest->rtt, 99.0) / 1000.0;
+        ps->retrans_rate = interval > 0 ? dest->retrans_count / interval : 0.0;
+    }
+}
+
+// Probe the nodes of the single-address --peers entries, one address per
+// node and never this node itself
+static int probe_targets_init(const char *self) {
+    bool added[MAX_PEER_DESTS] = {0};
+
+    for (int i = 0; i < nr_peer_cidrs; i++) {
+        const struct peer_cidr *pc = &peer_cidrs[i];
+
+        if (pc->prefix_len != (pc->family == AF_INET ? 32 : 128) || added[pc->dest] ||
+            strcmp(peer_dests[pc->dest].name, self) == 0)
+            continue;
+        if (prober_add_target(prober, peer_dests[pc->dest].name, pc->family, pc->addr) < 0) {
+            fprintf(stderr, "Not probing %s: too many targets or no IPv6\n",
+                    peer_dests[pc->dest].name);
+            continue;
+        }
+        added[pc->dest] = true;
+    }
+    return prober_nr_targets(prober);
+}
+
+// The probe matrix row of this node. Cells stay until the agent restarts;
+// their age says how fresh they are.
+static void update_probe_metrics(struct prometheus_metrics *metrics, __u64 now_ns) {
+    metrics->nr_probes = 0;
+    if (!prober)
+        return;
+    for (int i = 0; i < prober_nr_targets(prober); i++) {
+        const struct probe_stats *st = prober_stats(prober, i);
+        struct probe_peer_stats *ps;
+
+        if (!st->sent)
+            continue;
+        ps = &metrics->probes[metrics->nr_probes++];
+        ps->dest = st->name;
+        ps->sent = st->sent;
+        ps->lost = st->lost;
+        ps->replied = st->replies > 0;
+        ps->srtt_ms = st->srtt_us / 1000.0;
+        ps->age_s = (now_ns - st->last_reply_ns) / 1e9;
+    }
+}
+
+// Per-pod accumulation of all cgroups of a pod over the last interval; the
+// extra slot collects cgroups outside any known pod
+struct pod_accum {
+    struct hist rtt;
+    struct hist runqlat;
+    __u64 retrans_count;
+    __u64 activity;         // samples of all kinds, ranks the pods
+};
+
+static struct pod_accum pod_accum[CGROUP_CACHE_MAX_PODS + 1];
+#define POD_OTHER CGROUP_CACHE_MAX_PODS
+
+// Forget a removed cgroup in the BPF map too, so that dead pods drop out
+static void cgroup_removed(uint64_t cgroup_id, void *ctx) {
+    bpf_map_delete_elem(bpf_map__fd(skel->maps.cgroup_metrics_map), &cgroup_id);
+}
+
+static void pod_accum_add(struct pod_accum *dst, const struct pod_accum *src) {
+    for (int j = 0; j < MAX_SLOTS; j++) {
+        dst->rtt.slots[j] += src->rtt.slots[j];
+        dst->runqlat.slots[j] += src->runqlat.slots[j];
+    }
+    dst->retrans_count += src->retrans_count;
+    dst->activity += src->activity;
+}
+
+static int cmp_pod_activity(const void *a, const void *b) {
+    const struct pod_accum *x = &pod_accum[*(const int *)a];
+    const struct pod_accum *y = &pod_accum[*(const int *)b];
+    return x->activity < y->activity ? 1 : x->activity > y->activity ? -1 : 0;
+}
+
+static void pod_stats_fill(struct pod_stats *ps, const char *uid, const struct pod_accum *acc,
+                           double interval) {
+    snprintf(ps->uid, sizeof(ps->uid), "%s", uid);
+    ps->rtt_p99_ms = hist_percentile(&acc->rtt, 99.0) / 1000.0;
+    ps->runqlat_p95_ms = hist_percentile(&acc->runqlat, 95.0) / 1000.0;
+    ps->retrans_rate = interval > 0 ? acc->retrans_count / interval : 0.0;
+}
+
+// Fold the interval deltas of the cgroup map into pods and keep the
+// --pod-top busiest ones over that interval; the rest are merged into
+// "other" to bound the number of series
+static void update_pod_metrics(struct prometheus_metrics *metrics, __u64 now_ns) {
+    static int order[CGROUP_CACHE_MAX_PODS];
+    int nr_active = 0;
+    double interval;
+    
+    metrics->nr_pods = 0;
+    if (!env.cgroup_metrics)
+        return;
+    if (cgroups)
+        cgroup_cache_refresh(cgroups);
+    if (map_dump_read(&cgroup_dump, false) != 0)
+        return;
+    interval = delta_begin(cgroup_deltas, now_ns);
+    
+    memset(pod_accum, 0, sizeof(pod_accum));
+    for (__u32 i = 0; i < cgroup_dump.count; i++) {
+        __u64 id = ((const __u64 *)cgroup_dump.keys)[i];
+        const struct cgroup_metrics *cm = map_dump_value(&cgroup_dump, i, 0);
+        int pod = cgroups ? cgroup_cache_pod(cgroups, id) : -1;
+        struct pod_accum *acc = &pod_accum[pod < 0 ? POD_OTHER : pod];
+        struct cgroup_sample cur = {
+            .retrans_count = cm->retrans_count,
+            .activity = cm->rtt_count + cm->retrans_count + cm->runqlat_count,
+            .rtt = cm->rtt,
+            .runqlat = cm->runqlat,
+        }, delta;
+        
+        delta_update(cgroup_deltas, &id, &cur, &delta);
+        for (int j = 0; j < MAX_SLOTS; j++) {
+            acc->rtt.slots[j] += delta.rtt.slots[j];
+            acc->runqlat.slots[j] += delta.runqlat.slots[j];
+        }
+        acc->retrans_count += delta.retrans_count;
+        acc->activity += delta.activity;
+    }
+    
+    for (int p = 0; p < CGROUP_CACHE_MAX_PODS; p++) {
+        if (pod_accum[p].activity)
+            order[nr_active++] = p;
+    }
+    qsort(order, nr_active, sizeof(order[0]), cmp_pod_activity);
+    
+    for (int i = 0; i < nr_active; i++) {
+        int p = order[i];
+        if ((__u32)i < env.pod_top)
+            pod_stats_fill(&metrics->pods[metrics->nr_pods++],
+                           cgroup_cache_pod_uid(cgroups, p), &pod_accum[p], interval);
+        else
+            pod_accum_add(&pod_accum[POD_OTHER], &pod_accum[p]);
+    }
+    if (pod_accum[POD_OTHER].activity)
+        pod_stats_fill(&metrics->pods[metrics->nr_pods++], "other", &pod_accum[POD_OTHER],
+                       interval);
+}
+
+// Drop reason labels, taken from the running kernel's enum skb_drop_reason
+// since its values change between releases. NULL entries are printed as
+// numbers.
+static char *drop_reason_names[MAX_DROP_REASONS];
+
+static void load_drop_reason_names(void) {
+    struct btf *btf = btf__load_vmlinux_btf();
+    static const char prefix[] = "SKB_DROP_REASON_";
+    
+    if (!btf)
+        return;
+    int id = btf__find_by_name_kind(btf, "skb_drop_reason", BTF_KIND_ENUM);
+    if (id > 0) {
+        const struct btf_type *t = btf__type_by_id(btf, id);
+        const struct btf_enum *e = btf_enum(t);
+        
+        for (int i = 0; i < btf_vlen(t); i++, e++) {
+            const char *name = btf__name_by_offset(btf, e->name_off);
+            if (e->val < 0 || e->val >= MAX_DROP_REASONS - 1 || !name)
+                continue;
+            if (strncmp(name, prefix, sizeof(prefix) - 1) == 0)
+                name += sizeof(prefix) - 1;
+            else if (strncmp(name, "SKB_", 4) == 0)
+                name += 4;
+            char *label = strdup(name);
+            if (!label)
+                break;
+            for (char *c = label; *c; c++)
+                *c = tolower((unsigned char)*c);
+            drop_reason_names[e->val] = label;
+        }
+    }
+    btf__free(btf);
+    // Also holds every reason past the end of the array
+    drop_reason_names[MAX_DROP_REASONS - 1] = strdup("other");
+}
+
+// Kernel symbols for naming drop call sites, sorted by address
+struct ksym {
+    __u64 addr;
+    char *name;
+};
+
+static struct ksym *ksyms;
+static size_t nr_ksyms;
+
+static int cmp_ksym(const void *a, const void *b) {
+    const struct ksym *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int load_ksyms(void) {
+    FILE *fp = fopen("/proc/kallsyms", "r");
+    size_t cap = 0;
+    char line[256];
+    
+    if (!fp) {
+        fprintf(stderr, "Failed to open /proc/kallsyms: %s\n", strerror(errno));
+        return -errno;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long addr;
+        char type, name[128];
+        
+        if (sscanf(line, "%llx %c %127s", &addr, &type, name) != 3 ||
+            (type != 't' && type != 'T'))
+            continue;
+        if (nr_ksyms == cap) {
+            size_t new_cap = cap ? cap * 2 : 65536;
+            struct ksym *n = realloc(ksyms, new_cap * sizeof(*n));
+            if (!n)
+                break;
+            ksyms = n;
+            cap = new_cap;
+        }
+        ksyms[nr_ksyms].addr = addr;
+        ksyms[nr_ksyms].name = strdup(name);
+        if (ksyms[nr_ksyms].name)
+            nr_ksyms++;
+    }
+    fclose(fp);
+    qsort(ksyms, nr_ksyms, sizeof(*ksyms), cmp_ksym);
+    return 0;
+}
+
+static void free_ksyms(void) {
+    for (size_t i = 0; i < nr_ksyms; i++)
+        free(ksyms[i].name);
+    free(ksyms);
+    ksyms = NULL;
+    nr_ksyms = 0;
+}
+
+// Format an address as symbol+offset, or as hex without a match
+static void ksym_format(__u64 addr, char *buf, size_t size) {
+    size_t lo = 0, hi = nr_ksyms;
+    
+    // Last symbol at or below addr
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ksyms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || addr == 0)
+        snprintf(buf, size, "0x%llx", (unsigned long long)addr);
+    else
+        snprintf(buf, size, "%s+0x%llx", ksyms[lo - 1].name,
+                 (unsigned long long)(addr - ksyms[lo - 1].addr));
+}
+
+// Sum drops per reason and pick the busiest call sites
+static void update_drop_metrics(struct prometheus_metrics *metrics, __u64 now_ns) {
+    // With mmap stats the reasons come from node_stats_map instead
+    if (!env.mmap_stats && map_dump_read(&drop_reason_dump, false) == 0) {
+        double interval = delta_begin(drop_deltas, now_ns);
+        __u64 dropped = 0;
+        
+        memset(metrics->drops, 0, sizeof(metrics->drops));
+        for (__u32 i = 0; i < drop_reason_dump.count; i++) {
+            __u32 reason = ((const __u32 *)drop_reason_dump.keys)[i];
+            __u64 delta;
+            if (reason >= MAX_DROP_REASONS)
+                continue;
+            for (int cpu = 0; cpu < drop_reason_dump.nr_values; cpu++)
+                metrics->drops[reason] += *(const __u64 *)map_dump_value(&drop_reason_dump, i, cpu);
+            delta_update(drop_deltas, &reason, &metrics->drops[reason], &delta);
+            dropped += delta;
+        }
+        metrics->drop_rate = interval > 0 ? dropped / interval : 0.0;
+        history_rec.drops = dropped;
+    }
+    
+    if (!env.drop_locations || map_dump_read(&drop_location_dump, false) != 0)
+        return;
+    metrics->nr_drop_locations = 0;
+    for (__u32 i = 0; i < drop_location_dump.count; i++) {
+        struct drop_location_count loc = {
+            .addr = ((const __u64 *)drop_location_dump.keys)[i],
+            .count = *(const __u64 *)map_dump_value(&drop_location_dump, i, 0),
+        };
+        int pos = metrics->nr_drop_locations;
+        
+        // Insert into the top K, kept sorted by descending count
+        if (pos == DROP_LOCATION_TOPK) {
+            if (loc.count <= metrics->drop_locations[pos - 1].count)
+                continue;
+            pos--;
+        } else {
+            metrics->nr_drop_locations++;
+        }
+        while (pos > 0 && metrics->drop_locations[pos - 1].count < loc.count) {
+            metrics->drop_locations[pos] = metrics->drop_locations[pos - 1];
+            pos--;
+        }
+        metrics->drop_locations[pos] = loc;
+    }
+}
+
+// Read a histogram entry, summing the per-CPU copies
+static int read_hist(struct bpf_map *map, __u32 key, struct hist *out) {
+    const struct hist *vals = percpu_buf;
+    int err;
+
+    err = bpf_map_lookup_elem(bpf_map__fd(map), &key, percpu_buf);
+    if (err)
+        return err;
+
+    memset(out, 0, sizeof(*out));
+    for (int cpu = 0; cpu < nr_cpus; cpu++) {
+        for (int i = 0; i < MAX_SLOTS; i++)
+            out->slots[i] += vals[cpu].slots[i];
+    }
+    return 0;
+}
+
+// Read and zero a retired histogram epoch
+static int drain_hist(struct bpf_map *map, __u32 epoch, struct hist *out) {
+    int err = read_hist(map, epoch, out);
+    
+    if (err)
+        return err;
+    memset(percpu_buf, 0, nr_cpus * sizeof(struct hist));
+    return bpf_map_update_elem(bpf_map__fd(map), &epoch, percpu_buf, BPF_ANY);
+}
+
+// Copy a CPU's node_stats slot, retrying while its writer is halfway
+// through an update. A writer only holds the slot for a few stores, so
+// running out of retries is left with the last copy.
+static void node_stats_copy(const struct node_stats *slot, struct node_stats *out) {
+    for (int tries = 0; tries < NODE_STATS_RETRIES; tries++) {
+        __u64 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        
+        if (seq & 1)
+            continue;
+        memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+    memcpy(out, slot, sizeof(*out));
+}
+
+// Node retransmits, drops and histograms over the last interval, summed
+// over the CPUs. The slots only count up, and unsigned differences stay
+// right when a histogram slot wraps.
+static void read_node_stats(struct prometheus_metrics *metrics, __u64 now_ns,
+                            struct hist *rtt_hist, struct hist *runqlat_hist,
+                            struct hist *net_hists) {
+    double interval = node_stats_last_ns ? (now_ns - node_stats_last_ns) / 1e9 : 0.0;
+    __u64 retrans = 0, connect_failed = 0, dropped = 0;
+    struct node_stats cur;
+    
+    memset(metrics->drops, 0, sizeof(metrics->drops));
+    for (int cpu = 0; cpu < node_stats_cpus; cpu++) {
+        struct node_stats *prev = &node_stats_prev[cpu];
+        
+        node_stats_copy(&node_stats_mem[cpu], &cur);
+        retrans += cur.retrans_count - prev->retrans_count;
+        connect_failed += cur.connect_failed - prev->connect_failed;
+        for (int i = 0; i < MAX_DROP_REASONS; i++) {
+            metrics->drops[i] += cur.drops[i];
+            dropped += cur.drops[i] - prev->drops[i];
+        }
+        for (int i = 0; i < MAX_SLOTS; i++) {
+            rtt_hist->slots[i] += cur.rtt.slots[i] - prev->rtt.slots[i];
+            runqlat_hist->slots[i] += cur.runqlat.slots[i] - prev->runqlat.slots[i];
+            for (int h = 0; h < NR_NET_HISTS; h++)
+                net_hists[h].slots[i] += cur.net[h].slots[i] - prev->net[h].slots[i];
+        }
+        *prev = cur;
+    }
+    node_stats_last_ns = now_ns;
+    
+    metrics->tcp_retrans_rate = interval > 0 ? retrans / interval : 0.0;
+    metrics->connect_fail_rate = interval > 0 ? connect_failed / interval : 0.0;
+    metrics->drop_rate = interval > 0 ? dropped / interval : 0.0;
+    history_rec.retrans = retrans;
+    history_rec.drops = dropped;
+}
+
+// Make the BPF programs fill the next histogram epoch and return the one
+// they filled during the last interval. Its only writers are then the few
+// programs that read hist_epoch just before the switch. Their per-CPU
+// increments are not atomic, so one that lands while the retired slot is
+// read and zeroed is either lost or left in the slot for the epoch's next
+// turn; at most one sample per in-flight program, per CPU and interval.
+static __u32 rotate_hist_epoch(void) {
+    __u32 retired = skel->data->hist_epoch;
+    
+    __atomic_store_n(&skel->data->hist_epoch, (retired + 1) % NR_HIST_EPOCHS,
+                     __ATOMIC_RELEASE);
+    return retired;
+}
+
+// Flow top-K buffers (--flow-topk). The flow maps stay per-CPU with
+// --shared-maps too, so they hold one value per possible CPU.
+static int flow_nr_cpus;
+static struct flow_topk *flow_topk_buf;
+static void *flow_sketch_zero;      // zeroed flow_sketch values for every CPU
+static struct flow_slot *flow_cands;   // FLOW_TOPK candidates per CPU
+
+static int flow_slot_key_cmp(const void *a, const void *b) {
+    return memcmp(&((const struct flow_slot *)a)->key, &((const struct flow_slot *)b)->key,
+                  sizeof(struct flow_key));
+}
+
+static int flow_slot_value_cmp(const void *a, const void *b) {
+    __u32 x = ((const struct flow_slot *)a)->value, y = ((const struct flow_slot *)b)->value;
+    
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void format_flow_addr(char *buf, size_t size, __u16 family, const __u32 *addr,
+                             __u16 port) {
+    char ip[INET6_ADDRSTRLEN];
+    
+    if (!inet_ntop(family, addr, ip, sizeof(ip)))
+        snprintf(ip, sizeof(ip), "?");
+    snprintf(buf, size, family == AF_INET6 ? "[%s]:%u" : "%s:%u", ip, port);
+}
+
+// Merge the per-CPU candidates of one table: a flow seen on several CPUs
+// adds up its retransmit estimates (sum) or keeps its worst srtt, then the
+// FLOW_TOPK largest are kept
+static int merge_flow_topk(size_t table_off, bool sum, struct flow_stats *out) {
+    int n = 0, nr_out = 0;
+    
+    for (int cpu = 0; cpu < flow_nr_cpus; cpu++) {
+        const struct flow_slot *slots =
+            (const struct flow_slot *)((const char *)&flow_topk_buf[cpu] + table_off);
+        for (int i = 0; i < FLOW_TOPK; i++) {
+            if (slots[i].hash)
+                flow_cands[n++] = slots[i];
+        }
+    }
+    
+    qsort(flow_cands, n, sizeof(*flow_cands), flow_slot_key_cmp);
+    int merged = 0;
+    for (int i = 0; i < n; i++) {
+        if (merged && flow_slot_key_cmp(&flow_cands[merged - 1], &flow_cands[i]) == 0) {
+            struct flow_slot *m = &flow_cands[merged - 1];
+            if (sum)
+                m->value += flow_cands[i].value;
+            else if (flow_cands[i].value > m->value)
+                m->value = flow_cands[i].value;
+        } else {
+            flow_cands[merged++] = flow_cands[i];
+        }
+    }
+    qsort(flow_cands, merged, sizeof(*flow_cands), flow_slot_value_cmp);
+    
+    for (int i = 0; i < merged && nr_out < FLOW_TOPK; i++, nr_out++) {
+        const struct flow_key *k = &flow_cands[i].key;
+        format_flow_addr(out[nr_out].src, sizeof(out[nr_out].src), k->family, k->saddr, k->sport);
+        format_flow_addr(out[nr_out].dst, sizeof(out[nr_out].dst), k->family, k->daddr, k->dport);
+        out[nr_out].value = flow_cands[i].value;
+    }
+    return nr_out;
+}
+
+// Read and zero the flow tables and sketch of a retired epoch
+static void update_flow_metrics(struct prometheus_metrics *metrics, __u32 epoch) {
+    int topk_fd = bpf_map__fd(skel->maps.flow_topk_map);
+    
+    if (!env.flow_topk)
+        return;
+    if (bpf_map_lookup_elem(topk_fd, &epoch, flow_topk_buf) == 0) {
+        metrics->nr_flow_retrans = merge_flow_topk(offsetof(struct flow_topk, retrans), true,
+                                                   metrics->flow_retrans);
+        metrics->nr_flow_rtt = merge_flow_topk(offsetof(struct flow_topk, rtt), false,
+                                               metrics->flow_rtt);
+        memset(flow_topk_buf, 0, flow_nr_cpus * sizeof(*flow_topk_buf));
+        bpf_map_update_elem(topk_fd, &epoch, flow_topk_buf, BPF_ANY);
+    }
+    bpf_map_update_elem(bpf_map__fd(skel->maps.flow_sketch_map), &epoch, flow_sketch_zero,
+                        BPF_ANY);
+}
+
+// Process telemetry data and update metrics. Rates and percentiles cover
+// the interval since the previous call at now_ns (CLOCK_MONOTONIC).
+static void update_metrics(struct prometheus_metrics *metrics, __u64 now_ns) {
+    struct hist rtt_hist = {0};
+    struct hist runqlat_hist = {0};
+    struct hist net_hists[NR_NET_HISTS] = {0};
+    
+    // Dump node metrics; every node_id key is a slice of this node's
+    // counters, so fold all keys and CPUs together
+    if (env.mmap_stats) {
+        read_node_stats(metrics, now_ns, &rtt_hist, &runqlat_hist, net_hists);
+    } else if (map_dump_read(&node_metrics_dump, false) == 0) {
+        double interval = delta_begin(node_deltas, now_ns);
+        __u64 retrans = 0, connect_failed = 0;
+        
+        for (__u32 i = 0; i < node_metrics_dump.count; i++) {
+            const void *key = (const char *)node_metrics_dump.keys + i * node_metrics_dump.key_size;
+            struct node_sample cur = {0}, delta;
+            
+            for (int cpu = 0; cpu < node_metrics_dump.nr_values; cpu++) {
+                const struct node_metrics *v = map_dump_value(&node_metrics_dump, i, cpu);
+                cur.retrans_count += v->retrans_count;
+                cur.connect_failed += v->connect_failed;
+            }
+            delta_update(node_deltas, key, &cur, &delta);
+            retrans += delta.retrans_count;
+            connect_failed += delta.connect_failed;
+        }
+        
+        // Retransmission and failed connect rates (per second)
+        metrics->tcp_retrans_rate = interval > 0 ? retrans / interval : 0.0;
+        metrics->connect_fail_rate = interval > 0 ? connect_failed / interval : 0.0;
+        history_rec.retrans = retrans;
+    }
+    
+    update_drop_metrics(metrics, now_ns);
+    update_peer_metrics(metrics, now_ns);
+    update_probe_metrics(metrics, now_ns);
+    update_pod_metrics(metrics, now_ns);
+    
+    // RTT and runqueue latency percentiles over the epoch that just ended,
+    // or over the interval node_stats_map was read for
+    __u32 epoch = rotate_hist_epoch();
+    if (env.mmap_stats ||
+        drain_hist(skel->maps.runqlat_hist_map, epoch, &runqlat_hist) == 0)
+        metrics->runqlat_p95_ms = hist_percentile(&runqlat_hist, 95.0) / 1000.0;
+    if (env.mmap_stats ||
+        drain_hist(skel->maps.rtt_hist_map, epoch, &rtt_hist) == 0) {
+        metrics->rtt_p50_ms = hist_percentile(&rtt_hist, 50.0) / 1000.0;
+        metrics->rtt_p99_ms = hist_percentile(&rtt_hist, 99.0) / 1000.0;
+    }
+    for (int h = 0; h < NR_NET_HISTS; h++) {
+        if (!env.mmap_stats &&
+            drain_hist(skel->maps.net_hist_map, epoch * NR_NET_HISTS + h, &net_hists[h]) != 0)
+            continue;
+        metrics->net_p50_ms[h] = hist_percentile(&net_hists[h], 50.0) / 1000.0;
+        metrics->net_p99_ms[h] = hist_percentile(&net_hists[h], 99.0) / 1000.0;
+    }
+    update_flow_metrics(metrics, epoch);
+    
+    update_cpu_utilization(metrics);
+    
+    // Update timestamp
+    metrics->last_update = time(NULL);
+    
+    if (history) {
+        struct timespec ts;
+        
+        clock_gettime(CLOCK_REALTIME, &ts);
+        history_rec.timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        history_rec.interval_ns = history_last_ns ? now_ns - history_last_ns : 0;
+        history_rec.cpu_utilization = metrics->cpu_utilization;
+        history_rec.rtt = rtt_hist;
+        history_rec.runqlat = runqlat_hist;
+        history_append(history, &history_rec);
+        history_last_ns = now_ns;
+    }
+}
+
+// Reusable buffer for the text exposition. It is allocated once and only
+// grows if the output ever outgrows it, so steady-state scrapes allocate
+// nothing.
+struct expo_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void expo_printf(struct expo_buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void expo_printf(struct expo_buf *b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (b->len + n < b->cap)
+            break;
+
+        size_t cap = b->cap * 2;
+        while (cap <= b->len + n)
+            cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data)
+            return;  // keep what fits
+        b->data = data;
+        b->cap = cap;
+    }
+    b->len += n;
+}
+
+// Agent self-monitoring: how many events make it to userspace, and how far
+// behind the consumer is
+static void render_pipeline_metrics(struct expo_buf *b, const char *node,
+                                    const struct pipeline_stats *p) {
+    expo_printf(b, "# HELP ebpf_agent_events_submitted_total Events written to the ring buffer\n");
+    expo_printf(b, "# TYPE ebpf_agent_events_submitted_total counter\n");
+    for (int i = 0; i < MAX_EVENT_TYPES; i++) {
+        if (event_type_names[i])
+            expo_printf(b, "ebpf_agent_events_submitted_total{node=\"%s\",type=\"%s\"} %llu\n",
+                        node, event_type_names[i], p->events[i].submitted);
+    }
+    
+    expo_printf(b, "# HELP ebpf_agent_ringbuf_reserve_failures_total Events lost because the ring buffer was full\n");
+    expo_printf(b, "# TYPE ebpf_agent_ringbuf_reserve_failures_total counter\n");
+    for (int i = 0; i < MAX_EVENT_TYPES; i++) {
+        if (event_type_names[i])
+            expo_printf(b, "ebpf_agent_ringbuf_reserve_failures_total{node=\"%s\",type=\"%s\"} %llu\n",
+                        node, event_type_names[i], p->events[i].reserve_failed);
+    }
+    
+    expo_printf(b, "# HELP ebpf_agent_sample_probability Probability that an event is exported to userspace\n");
+    expo_printf(b, "# TYPE ebpf_agent_sample_probability gauge\n");
+    for (int i = 0; i < MAX_EVENT_TYPES; i++) {
+        if (event_type_names[i])
+            expo_printf(b, "ebpf_agent_sample_probability{node=\"%s\",type=\"%s\"} %.6g\n",
+                        node, event_type_names[i], p->sample_probability[i]);
+    }
+    
+    expo_printf(b, "# HELP ebpf_agent_events_estimated_total Events seen by the hooks, estimated from the sampled events\n");
+    expo_printf(b, "# TYPE ebpf_agent_events_estimated_total counter\n");
+    for (int i = 0; i < MAX_EVENT_TYPES; i++) {
+        if (event_type_names[i])
+            expo_printf(b, "ebpf_agent_events_estimated_total{node=\"%s\",type=\"%s\"} %.0f\n",
+                        node, event_type_names[i], p->events_estimated[i]);
+    }
+    
+    expo_printf(b, "# HELP ebpf_agent_event_queue_dropped_total Events lost because the aggregator queue was full\n");
+    expo_printf(b, "# TYPE ebpf_agent_event_queue_dropped_total counter\n");
+    expo_printf(b, "ebpf_agent_event_queue_dropped_total{node=\"%s\"} %llu\n",
+                node, (unsigned long long)p->queue_dropped);
+    
+    expo_printf(b, "# HELP ebpf_agent_ringbuf_size_bytes Ring buffer capacity\n");
+    expo_printf(b, "# TYPE ebpf_agent_ringbuf_size_bytes gauge\n");
+    expo_printf(b, "ebpf_agent_ringbuf_size_bytes{node=\"%s\"} %zu\n", node, p->ringbuf_size);
+    
+    expo_printf(b, "# HELP ebpf_agent_ringbuf_pending_bytes Ring buffer bytes not consumed yet\n");
+    expo_printf(b, "# TYPE ebpf_agent_ringbuf_pending_bytes gauge\n");
+    expo_printf(b, "ebpf_agent_ringbuf_pending_bytes{node=\"%s\"} %zu\n", node, p->ringbuf_pending);
+    
+    expo_printf(b, "# HELP ebpf_agent_consumer_lag_seconds Delay from event creation to ring buffer consumption over the last interval\n");
+    expo_printf(b, "# TYPE ebpf_agent_consumer_lag_seconds gauge\n");
+    expo_printf(b, "ebpf_agent_consumer_lag_seconds{node=\"%s\",stat=\"avg\"} %.6f\n",
+                node, p->consumer_lag_avg_s);
+    expo_printf(b, "ebpf_agent_consumer_lag_seconds{node=\"%s\",stat=\"max\"} %.6f\n",
+                node, p->consumer_lag_max_s);
+    
+    expo_printf(b, "# HELP ebpf_agent_poll_batch_max_seconds Longest single ring buffer drain over the last interval\n");
+    expo_printf(b, "# TYPE ebpf_agent_poll_batch_max_seconds gauge\n");
+    expo_printf(b, "ebpf_agent_poll_batch_max_seconds{node=\"%s\"} %.6f\n",
+                node, p->poll_batch_max_s);
+    
+    expo_printf(b, "# HELP ebpf_agent_prog_runtime_ns_total Time spent in each BPF program, while BPF run time stats are on\n");
+    expo_printf(b, "# TYPE ebpf_agent_prog_runtime_ns_total counter\n");
+    for (int i = 0; i < p->nr_progs; i++)
+        expo_printf(b, "ebpf_agent_prog_runtime_ns_total{node=\"%s\",prog=\"%s\"} %llu\n",
+                    node, p->progs[i].name, p->progs[i].run_time_ns);
+    expo_printf(b, "# HELP ebpf_agent_prog_runs_total Runs of each BPF program, while BPF run time stats are on\n");
+    expo_printf(b, "# TYPE ebpf_agent_prog_runs_total counter\n");
+    for (int i = 0; i < p->nr_progs; i++)
+        expo_printf(b, "ebpf_agent_prog_runs_total{node=\"%s\",prog=\"%s\"} %llu\n",
+                    node, p->progs[i].name, p->progs[i].run_cnt);
+    
+    expo_printf(b, "# HELP ebpf_agent_stage_runtime_ns_total Time spent in each agent stage\n");
+    expo_printf(b, "# TYPE ebpf_agent_stage_runtime_ns_total counter\n");
+    for (int i = 0; i < NR_AGENT_STAGES; i++)
+        expo_printf(b, "ebpf_agent_stage_runtime_ns_total{node=\"%s\",stage=\"%s\"} %llu\n",
+                    node, agent_stage_names[i], p->stages[i].time_ns);
+    expo_printf(b, "# HELP ebpf_agent_stage_runs_total Runs of each agent stage\n");
+    expo_printf(b, "# TYPE ebpf_agent_stage_runs_total counter\n");
+    for (int i = 0; i < NR_AGENT_STAGES; i++)
+        expo_printf(b, "ebpf_agent_stage_runs_total{node=\"%s\",stage=\"%s\"} %llu\n",
+                    node, agent_stage_names[i], p->stages[i].runs);
+}
+
+// Render metrics in the Prometheus text exposition format
+static void render_prometheus_metrics(struct expo_buf *b,
+                                      const struct prometheus_metrics *metrics) {
+    b->len = 0;
+    
+    expo_printf(b, "# HELP ebpf_rtt_p50_milliseconds 50th percentile RTT in milliseconds\n");
+    expo_printf(b, "# TYPE ebpf_rtt_p50_milliseconds gauge\n");
+    expo_printf(b, "ebpf_rtt_p50_milliseconds{node=\"%s\"} %.3f\n", 
+                metrics->node_name, metrics->rtt_p50_ms);
+    
+    expo_printf(b, "# HELP ebpf_rtt_p99_milliseconds 99th percentile RTT in milliseconds\n");
+    expo_printf(b, "# TYPE ebpf_rtt_p99_milliseconds gauge\n");
+    expo_printf(b, "ebpf_rtt_p99_milliseconds{node=\"%s\"} %.3f\n", 
+                metrics->node_name, metrics->rtt_p99_ms);
+    
+    expo_printf(b, "# HELP ebpf_peer_rtt_p50_milliseconds 50th percentile RTT to a remote node in milliseconds\n");
+    expo_printf(b, "# TYPE ebpf_peer_rtt_p50_milliseconds gauge\n");
+    for (int i = 0; i < metrics->nr_peers; i++) {
+        expo_printf(b, "ebpf_peer_rtt_p50_milliseconds{source=\"%s\",dest=\"%s\"} %.3f\n",
+                    metrics->node_name, metrics->peers[i].dest, metrics->peers[i].rtt_p50_ms);
+    }
+    
+    expo_printf(b, "# HELP ebpf_peer_rtt_p99_milliseconds 99th percentile RTT to a remote node in milliseconds\n");
+    expo_printf(b, "# TYPE ebpf_peer_rtt_p99_milliseconds gauge\n");
+    for (int i = 0; i < metrics->nr_peers; i++) {
+        expo_printf(b, "ebpf_peer_rtt_p99_milliseconds{source=\"%s\",dest=\"%s\"} %.3f\n",
+                    metrics->node_name, metrics->peers[i].dest, metrics->peers[i].rtt_p99_ms);
+    }
+    
+    expo_printf(b, "# HELP ebpf_peer_tcp_retrans_rate TCP retransmissions per second to a remote node\n");
+    expo_printf(b, "# TYPE ebpf_peer_tcp_retrans_rate gauge\n");
+    for (int i = 0; i < metrics->nr_peers; i++) {
+        expo_printf(b, "ebpf_peer_tcp_retrans_rate{source=\"%s\",dest=\"%s\"} %.2f\n",
+                    metrics->node_name, metrics->peers[i].dest, metrics->peers[i].retrans_rate);
+    }
+    
+    if (env.probe_port) {
+        expo_printf(b, "# HELP ebpf_probe_rtt_milliseconds Smoothed RTT of active probes to a remote node in milliseconds\n");
+        expo_printf(b, "# TYPE ebpf_probe_rtt_milliseconds gauge\n");
+        for (int i = 0; i < metrics->nr_probes; i++) {
+            if (metrics->probes[i].replied)
+                expo_printf(b, "ebpf_probe_rtt_milliseconds{source=\"%s\",dest=\"%s\"} %.3f\n",
+                            metrics->node_name, metrics->probes[i].dest, metrics->probes[i].srtt_ms);
+        }
+        
+        expo_printf(b, "# HELP ebpf_probe_reply_age_seconds Time since the last probe reply from a remote node\n");
+        expo_printf(b, "# TYPE ebpf_probe_reply_age_seconds gauge\n");
+        for (int i = 0; i < metrics->nr_probes; i++) {
+            if (metrics->probes[i].replied)
+                expo_printf(b, "ebpf_probe_reply_age_seconds{source=\"%s\",dest=\"%s\"} %.1f\n",
+                            metrics->node_name, metrics->probes[i].dest, metrics->probes[i].age_s);
+        }
+        
+        expo_printf(b, "# HELP ebpf_probe_sent_total Active probes sent to a remote node\n");
+        expo_printf(b, "# TYPE ebpf_probe_sent_total counter\n");
+        for (int i = 0; i < metrics->nr_probes; i++) {
+            expo_printf(b, "ebpf_probe_sent_total{source=\"%s\",dest=\"%s\"} %llu\n",
+                        metrics->node_name, metrics->probes[i].dest,
+                        (unsigned long long)metrics->probes[i].sent);
+        }
+        
+        expo_printf(b, "# HELP ebpf_probe_lost_total Active probes to a remote node without a reply within %d ms\n",
+                    PROBE_TIMEOUT_MS);
+        expo_printf(b, "# TYPE ebpf_probe_lost_total counter\n");
+        for (int i = 0; i < metrics->nr_probes; i++) {
+            expo_printf(b, "ebpf_probe_lost_total{source=\"%s\",dest=\"%s\"} %llu\n",
+                        metrics->node_name, metrics->probes[i].dest,
+                        (unsigned long long)metrics->probes[i].lost);
+        }
+    }
+    
+    if (env.cgroup_metrics) {
+        expo_printf(b, "# HELP ebpf_pod_rtt_p99_milliseconds 99th percentile RTT of a pod's sockets in milliseconds\n");
+        expo_printf(b, "# TYPE ebpf_pod_rtt_p99_milliseconds gauge\n");
+        for (int i = 0; i < metrics->nr_pods; i++) {
+            expo_printf(b, "ebpf_pod_rtt_p99_milliseconds{node=\"%s\",pod_uid=\"%s\"} %.3f\n",
+                        metrics->node_name, metrics->pods[i].uid, metrics->pods[i].rtt_p99_ms);
+        }
+        
+        expo_printf(b, "# HELP ebpf_pod_tcp_retrans_rate TCP retransmissions per second of a pod's sockets\n");
+        expo_printf(b, "# TYPE ebpf_pod_tcp_retrans_rate gauge\n");
+        for (int i = 0; i < metrics->nr_pods; i++) {
+            expo_printf(b, "ebpf_pod_tcp_retrans_rate{node=\"%s\",pod_uid=\"%s\"} %.2f\n",
+                        metrics->node_name, metrics->pods[i].uid, metrics->pods[i].retrans_rate);
+        }
+        
+        expo_printf(b, "# HELP ebpf_pod_runqlat_p95_milliseconds 95th percentile runqueue latency of a pod's tasks\n");
+        expo_printf(b, "# TYPE ebpf_pod_runqlat_p95_milliseconds gauge\n");
+        for (int i = 0; i < metrics->nr_pods; i++) {
+            expo_printf(b, "ebpf_pod_runqlat_p95_milliseconds{node=\"%s\",pod_uid=\"%s\"} %.3f\n",
+                        metrics->node_name, metrics->pods[i].uid, metrics->pods[i].runqlat_p95_ms);
+        }
+    }
+    
+    if (env.flow_topk) {
+        expo_printf(b, "# HELP ebpf_flow_retransmits Estimated TCP retransmissions of the flows retransmitting most over the last interval\n");
+        expo_printf(b, "# TYPE ebpf_flow_retransmits gauge\n");
+        for (int i = 0; i < metrics->nr_flow_retrans; i++) {
+            expo_printf(b, "ebpf_flow_retransmits{node=\"%s\",src=\"%s\",dst=\"%s\"} %u\n",
+                        metrics->node_name, metrics->flow_retrans[i].src,
+                        metrics->flow_retrans[i].dst, metrics->flow_retrans[i].value);
+        }
+        
+        expo_printf(b, "# HELP ebpf_flow_srtt_milliseconds Worst smoothed RTT over the last interval of the slowest flows\n");
+        expo_printf(b, "# TYPE ebpf_flow_srtt_milliseconds gauge\n");
+        for (int i = 0; i < metrics->nr_flow_rtt; i++) {
+            expo_printf(b, "ebpf_flow_srtt_milliseconds{node=\"%s\",src=\"%s\",dst=\"%s\"} %.3f\n",
+                        metrics->node_name, metrics->flow_rtt[i].src,
+                        metrics->flow_rtt[i].dst, metrics->flow_rtt[i].value / 1000.0);
+        }
+    }
+    
+    expo_printf(b, "# HELP ebpf_tcp_retrans_rate TCP retransmission rate per second\n");
+    expo_printf(b, "# TYPE ebpf_tcp_retrans_rate gauge\n");
+    expo_printf(b, "ebpf_tcp_retrans_rate{node=\"%s\"} %.2f\n", 
+                metrics->node_name, metrics->tcp_retrans_rate);
+    
+    expo_printf(b, "# HELP ebpf_packet_drops_total Dropped packets by kernel drop reason\n");
+    expo_printf(b, "# TYPE ebpf_packet_drops_total counter\n");
+    for (int i = 0; i < MAX_DROP_REASONS; i++) {
+        if (!metrics->drops[i])
+            continue;
+        if (drop_reason_names[i])
+            expo_printf(b, "ebpf_packet_drops_total{node=\"%s\",reason=\"%s\"} %llu\n",
+                        metrics->node_name, drop_reason_names[i], metrics->drops[i]);
+        else
+            expo_printf(b, "ebpf_packet_drops_total{node=\"%s\",reason=\"%d\"} %llu\n",
+                        metrics->node_name, i, metrics->drops[i]);
+    }
+    
+    if (env.drop_locations) {
+        expo_printf(b, "# HELP ebpf_packet_drop_location_total Dropped packets at the busiest kfree_skb call sites\n");
+        expo_printf(b, "# TYPE ebpf_packet_drop_location_total counter\n");
+        for (int i = 0; i < metrics->nr_drop_locations; i++) {
+            char location[160];
+            
+            ksym_format(metrics->drop_locations[i].addr, location, sizeof(location));
+            expo_printf(b, "ebpf_packet_drop_location_total{node=\"%s\",location=\"%s\"} %llu\n",
+                        metrics->node_name, location,
+                        (unsigned long long)metrics->drop_locations[i].count);
+        }
+    }
+    
+    expo_printf(b, "# HELP ebpf_runqlat_p95_milliseconds 95th percentile runqueue latency\n");
+    expo_printf(b, "# TYPE ebpf_runqlat_p95_milliseconds gauge\n");
+    expo_printf(b, "ebpf_runqlat_p95_milliseconds{node=\"%s\"} %.3f\n", 
+                metrics->node_name, metrics->runqlat_p95_ms);
+    
+    for (int h = 0; h < NR_NET_HISTS; h++) {
+        const char *name = net_hist_names[h];
+        
+        if (!env.udp_latency && (h == NET_HIST_UDP_SEND || h == NET_HIST_UDP_RECV))
+            continue;
+        expo_printf(b, "# HELP ebpf_%s_p50_milliseconds Median %s\n", name, net_hist_help[h]);
+        expo_printf(b, "# TYPE ebpf_%s_p50_milliseconds gauge\n", name);
+        expo_printf(b, "ebpf_%s_p50_milliseconds{node=\"%s\"} %.3f\n",
+                    name, metrics->node_name, metrics->net_p50_ms[h]);
+        expo_printf(b, "# HELP ebpf_%s_p99_milliseconds 99th percentile %s\n", name, net_hist_help[h]);
+        expo_printf(b, "# TYPE ebpf_%s_p99_milliseconds gauge\n", name);
+        expo_printf(b, "ebpf_%s_p99_milliseconds{node=\"%s\"} %.3f\n",
+                    name, metrics->node_name, metrics->net_p99_ms[h]);
+    }
+    
+    expo_printf(b, "# HELP ebpf_tcp_connect_fail_rate Active TCP opens per second that never got established\n");
+    expo_printf(b, "# TYPE ebpf_tcp_connect_fail_rate gauge\n");
+    expo_printf(b, "ebpf_tcp_connect_fail_rate{node=\"%s\"} %.2f\n",
+                metrics->node_name, metrics->connect_fail_rate);
+    
+    expo_printf(b, "# HELP ebpf_cpu_utilization CPU utilization percentage\n");
+    expo_printf(b, "# TYPE ebpf_cpu_utilization gauge\n");
+    expo_printf(b, "ebpf_cpu_utilization{node=\"%s\"} %.2f\n", 
+                metrics->node_name, metrics->cpu_utilization);
+    
+    expo_printf(b, "# HELP ebpf_cpu_core_utilization CPU utilization percentage of one core\n");
+    expo_printf(b, "# TYPE ebpf_cpu_core_utilization gauge\n");
+    for (int i = 0; i < metrics->nr_cpu_cores; i++) {
+        if (metrics->cpu_core_utilization[i] >= 0)
+            expo_printf(b, "ebpf_cpu_core_utilization{node=\"%s\",cpu=\"%d\"} %.2f\n",
+                        metrics->node_name, i, metrics->cpu_core_utilization[i]);
+    }
+    
+    render_pipeline_metrics(b, metrics->node_name, &metrics->pipeline);
+}
+
+// Handle one event taken off the event queue
+static void handle_event(const struct telemetry_event *e) {
+    // Exceptional events are always reported; the rest only when verbose
+    if (e->event_type == EVENT_RTT && (e->extra_data & EVENT_F_OUTLIER)) {
+        printf("WARN: RTT outlier - Node: %u, Value: %.3f ms\n",
+               e->node_id, e->value / 1000.0);
+        return;
+    }
+    
+    if (!env.verbose)
+        return;
+    
+    switch (e->event_type) {
+        case EVENT_RTT:
+            printf("DEBUG: RTT event - Node: %u, Value: %.3f ms\n", 
+                   e->node_id, e->value / 1000.0);
+            break;
+        case EVENT_RETRANS:
+            printf("DEBUG: Retrans event - Node: %u\n", e->node_id);
+            break;
+        case EVENT_DROP:
+            printf("DEBUG: Drop event - Node: %u, Reason: %u\n", 
+                   e->node_id, e->extra_data);
+            break;
+        case EVENT_RUNQLAT:
+            printf("DEBUG: Runqlat event - Node: %u, Value: %llu ms\n", 
+                   e->node_id, e->value);
+            break;
+    }
+}
+
+// Threading model. The consumer thread only drains the ring buffer into
+// the event queue, so a slow scrape or a long map dump can never let the
+// ring buffer overflow. The aggregator thread handles queued events, dumps
+// the maps every interval and publishes a rendered snapshot, which the main
+// thread serves over HTTP without taking any lock.
+
+// Single-producer single-consumer queue from the ring buffer consumer to
+// the aggregator. head is only written by the producer, tail only by the
+// consumer; each lives on its own cache line.
+#define EVENT_QUEUE_SIZE (1 << 16)   // power of two
+#define EVENT_DRAIN_MS 100           // how often the aggregator drains it
+#define BATCH_FLUSH_MS 50            // max age of a staged --batch-events batch
+
+struct event_queue {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_ullong dropped;   // events lost to a full queue
+    struct telemetry_event events[EVENT_QUEUE_SIZE];
+};
+
+static struct event_queue event_queue;
+
+static bool event_queue_push(struct event_queue *q, const struct telemetry_event *e) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    
+    if (head - tail == EVENT_QUEUE_SIZE)
+        return false;
+    q->events[head & (EVENT_QUEUE_SIZE - 1)] = *e;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+static bool event_queue_pop(struct event_queue *q, struct telemetry_event *e) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    
+    if (tail == head)
+        return false;
+    *e = q->events[tail & (EVENT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Consumer timings; the aggregator takes and resets them every interval
+struct consumer_stats {
+    atomic_ullong lag_sum_ns;     // event timestamp to consumer callback
+    atomic_ullong lag_count;
+    atomic_ullong lag_max_ns;
+    atomic_ullong batch_max_ns;   // longest single drain of the ring buffer
+    __u64 batch_start_ns;         // consumer thread only
+};
+
+static struct consumer_stats consumer_stats;
+
+static __u64 monotonic_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);  // same clock as bpf_ktime_get_ns()
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void atomic_max(atomic_ullong *max, __u64 val) {
+    unsigned long long cur = atomic_load_explicit(max, memory_order_relaxed);
+    
+    while (val > cur &&
+           !atomic_compare_exchange_weak_explicit(max, &cur, val, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+// Cumulative agent stage timings, exported next to the BPF program stats
+static struct {
+    atomic_ullong runs;
+    atomic_ullong time_ns;
+} stage_timers[NR_AGENT_STAGES];
+
+static void stage_add(enum agent_stage stage, __u64 ns) {
+    atomic_fetch_add_explicit(&stage_timers[stage].runs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stage_timers[stage].time_ns, ns, memory_order_relaxed);
+}
+
+// BPF programs whose run time is exported. The kernel only counts it
+// while a BPF_ENABLE_STATS fd is held, for the price of two clock reads
+// per run. Programs reused from pinned links are not loaded by this
+// process, so their fds come from the links.
+static struct {
+    const char *name;
+    int fd;
+    bool owned;           // opened by id, closed on exit
+} prog_stat_fds[MAX_PROG_STATS];
+static int nr_prog_stat_fds;
+static int bpf_stats_fd = -1;
+
+static void read_prog_stats(struct pipeline_stats *p) {
+    p->nr_progs = 0;
+    for (int i = 0; i < nr_prog_stat_fds; i++) {
+        struct bpf_prog_info info = {};
+        __u32 len = sizeof(info);
+        
+        if (bpf_prog_get_info_by_fd(prog_stat_fds[i].fd, &info, &len) != 0)
+            continue;
+        p->progs[p->nr_progs++] = (struct prog_stat){
+            .name = prog_stat_fds[i].name,
+            .run_cnt = info.run_cnt,
+            .run_time_ns = info.run_time_ns,
+        };
+    }
+}
+
+static void queue_one_event(struct event_queue *q, const struct telemetry_event *e,
+                            __u64 now) {
+    if (now > e->timestamp) {
+        atomic_fetch_add_explicit(&consumer_stats.lag_sum_ns, now - e->timestamp,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&consumer_stats.lag_count, 1, memory_order_relaxed);
+        atomic_max(&consumer_stats.lag_max_ns, now - e->timestamp);
+    }
+    
+    if (!event_queue_push(q, e))
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+}
+
+// Unpack an event_batch record into regular events
+static void queue_event_batch(struct event_queue *q, const struct event_batch *b,
+                              size_t data_sz, __u64 now) {
+    size_t count = (data_sz - offsetof(struct event_batch, entries)) /
+                   sizeof(struct event_entry);
+    
+    if (count > b->count)
+        count = b->count;
+    for (size_t i = 0; i < count; i++) {
+        const struct event_entry *ent = &b->entries[i];
+        struct telemetry_event e = {
+            .node_id = LOCAL_NODE_ID,
+            .event_type = ent->event_type,
+            .value = ent->value,
+            .timestamp = b->base_ts + ent->ts_delta,
+            .extra_data = ent->extra_data,
+            .sample_thresh = ent->sample_thresh,
+        };
+        queue_one_event(q, &e, now);
+    }
+}
+
+// Ring buffer callback: copy the record out and return right away
+static int queue_event(void *ctx, void *data, size_t data_sz) {
+    struct event_queue *q = ctx;
+    __u64 now = monotonic_ns();
+    
+    if (!consumer_stats.batch_start_ns)
+        consumer_stats.batch_start_ns = now;
+    if (env.batch_events) {
+        if (data_sz >= offsetof(struct event_batch, entries))
+            queue_event_batch(q, data, data_sz, now);
+    } else if (data_sz >= sizeof(struct telemetry_event)) {
+        queue_one_event(q, data, now);
+    }
+    return 0;
+}
+
+// Time of the drain that just ended, if it found anything
+static void consumer_drained(void *ctx) {
+    if (consumer_stats.batch_start_ns) {
+        __u64 batch_ns = monotonic_ns() - consumer_stats.batch_start_ns;
+        
+        atomic_max(&consumer_stats.batch_max_ns, batch_ns);
+        stage_add(STAGE_RINGBUF_DRAIN, batch_ns);
+        consumer_stats.batch_start_ns = 0;
+    }
+}
+
+static void *consumer_main(void *arg) {
+    struct ring_buffer *rb = arg;
+    
+    // With --poll=epoll, ring_buffer__poll() sleeps and consumes whatever
+    // is ready. Batches are mostly submitted without a wakeup, and so is
+    // everything when the running programs were loaded with
+    // ringbuf_no_wakeup, so then the poll timeout also picks up whatever
+    // was written meanwhile. skel->rodata is the loaded map here, the
+    // pinned one on a hot restart.
+    env.poll.consume_on_timeout = env.batch_events || skel->rodata->ringbuf_no_wakeup;
+    int err = collector_poll(rb, &env.poll, &exiting, consumer_drained, NULL);
+    if (err) {
+        fprintf(stderr, "Error polling ring buffer: %d\n", err);
+        exiting = true;
+    }
+    return NULL;
+}
+
+// Sum the BPF-side per-type event counters over all CPUs
+static int read_event_stats(struct event_stats stats[MAX_EVENT_TYPES]) {
+    int err = map_dump_read(&event_stats_dump, false);
+    
+    if (err)
+        return err;
+    memset(stats, 0, sizeof(struct event_stats) * MAX_EVENT_TYPES);
+    for (__u32 i = 0; i < event_stats_dump.count; i++) {
+        __u32 type = ((const __u32 *)event_stats_dump.keys)[i];
+        if (type >= MAX_EVENT_TYPES)
+            continue;
+        for (int cpu = 0; cpu < event_stats_dump.nr_values; cpu++) {
+            const struct event_stats *v = map_dump_value(&event_stats_dump, i, cpu);
+            stats[type].submitted += v->submitted;
+            stats[type].reserve_failed += v->reserve_failed;
+        }
+    }
+    return 0;
+}
+
+// Collect BPF-side event counters, ring buffer fill and consumer timings
+static void update_pipeline_stats(struct pipeline_stats *p, struct ring_buffer *rb) {
+    struct ring *ring = ring_buffer__ring(rb, 0);
+    
+    read_event_stats(p->events);
+    p->queue_dropped = atomic_load(&event_queue.dropped);
+    if (ring) {
+        p->ringbuf_size = ring__size(ring);
+        p->ringbuf_pending = ring__avail_data_size(ring);
+    }
+    
+    __u64 lag_sum = atomic_exchange(&consumer_stats.lag_sum_ns, 0);
+    __u64 lag_count = atomic_exchange(&consumer_stats.lag_count, 0);
+    p->consumer_lag_avg_s = lag_count ? lag_sum / 1e9 / lag_count : 0.0;
+    p->consumer_lag_max_s = atomic_exchange(&consumer_stats.lag_max_ns, 0) / 1e9;
+    p->poll_batch_max_s = atomic_exchange(&consumer_stats.batch_max_ns, 0) / 1e9;
+    
+    read_prog_stats(p);
+    for (int i = 0; i < NR_AGENT_STAGES; i++) {
+        p->stages[i].runs = atomic_load(&stage_timers[i].runs);
+        p->stages[i].time_ns = atomic_load(&stage_timers[i].time_ns);
+    }
+}
+
+// Adaptive sampling. The BPF side exports an event when a random u32 falls
+// below sample_thresh[type], which lives in .data and so can be rewritten
+// while the programs run. Once a second the aggregator splits the event
+// budget evenly over the enabled types, scales each threshold towards its
+// share of the budget and halves them all whenever events were lost. The
+// --*-sample rates are the ceiling a threshold grows back to. Every event
+// carries the threshold it was sampled with, so scaling each one by
+// 2^32 / threshold keeps the estimated totals unbiased across changes.
+#define SAMPLE_CONTROL_MS 1000
+#define SAMPLE_MIN_THRESH (SAMPLE_ALWAYS >> 20)   // never below ~1 in a million
+
+struct sample_controller {
+    __u32 max_thresh[MAX_EVENT_TYPES];     // from the configured rates
+    __u32 thresh[MAX_EVENT_TYPES];         // what the BPF side uses now
+    __u64 received[MAX_EVENT_TYPES];       // events since the last step
+    double estimated[MAX_EVENT_TYPES];
+    __u64 prev_lost;
+    __u64 last_step_ns;
+};
+
+static __u32 sample_rate_thresh(__u32 rate) {
+    if (rate == 0)
+        return 0;
+    return rate == 1 ? SAMPLE_ALWAYS : SAMPLE_ALWAYS / rate;
+}
+
+static double sample_weight(__u32 thresh) {
+    return thresh == SAMPLE_ALWAYS || thresh == 0 ? 1.0 : 4294967296.0 / thresh;
+}
+
+static void sample_controller_init(struct sample_controller *c) {
+    memset(c, 0, sizeof(*c));
+    c->max_thresh[EVENT_RTT] = sample_rate_thresh(env.rtt_sample_rate);
+    c->max_thresh[EVENT_RETRANS] = sample_rate_thresh(env.retrans_sample_rate);
+    c->max_thresh[EVENT_DROP] = sample_rate_thresh(env.drop_sample_rate);
+    memcpy(c->thresh, c->max_thresh, sizeof(c->thresh));
+}
+
+static void sample_controller_count(struct sample_controller *c,
+                                    const struct telemetry_event *e) {
+    if (e->event_type >= MAX_EVENT_TYPES)
+        return;
+    c->received[e->event_type]++;
+    c->estimated[e->event_type] += sample_weight(e->sample_thresh);
+}
+
+static void sample_controller_step(struct sample_controller *c, __u64 now_ns) {
+    struct event_stats stats[MAX_EVENT_TYPES];
+    double elapsed_s = (now_ns - c->last_step_ns) / 1e9;
+    __u64 lost = atomic_load(&event_queue.dropped);
+    int nr_enabled = 0;
+    
+    if (read_event_stats(stats) == 0) {
+        for (int t = 0; t < MAX_EVENT_TYPES; t++)
+            lost += stats[t].reserve_failed;
+    }
+    for (int t = 0; t < MAX_EVENT_TYPES; t++)
+        nr_enabled += c->max_thresh[t] != 0;
+    
+    if (env.event_budget && nr_enabled && c->last_step_ns) {
+        double share = (double)env.event_budget / nr_enabled;
+        bool lossy = lost > c->prev_lost;
+        
+        for (int t = 0; t < MAX_EVENT_TYPES; t++) {
+            double rate = c->received[t] / elapsed_s;
+            double next = c->thresh[t];
+            
+            if (!c->max_thresh[t])
+                continue;
+            if (lossy)
+                next /= 2;
+            else if (rate > share)
+                next *= share / rate;
+            else if (rate < share / 2)
+                next *= 2;
+            
+            if (next > c->max_thresh[t])
+                next = c->max_thresh[t];
+            if (next < SAMPLE_MIN_THRESH)
+                next = SAMPLE_MIN_THRESH;
+            c->thresh[t] = (__u32)next;
+            skel->data->sample_thresh[t] = c->thresh[t];
+        }
+    }
+    
+    c->prev_lost = lost;
+    c->last_step_ns = now_ns;
+    memset(c->received, 0, sizeof(c->received));
+}
+
+static void sample_controller_export(const struct sample_controller *c,
+                                     struct pipeline_stats *p) {
+    for (int t = 0; t < MAX_EVENT_TYPES; t++) {
+        p->sample_probability[t] = c->thresh[t] == SAMPLE_ALWAYS ?
+                                   1.0 : c->thresh[t] / 4294967296.0;
+        p->events_estimated[t] = c->estimated[t];
+    }
+}
+
+// Rendered exposition shared with the HTTP server. Readers take a reference
+// and then check that the snapshot is still current; the aggregator only
+// rewrites snapshots that are neither current nor referenced, so a reader
+// that loses the race drops its reference and retries instead of reading
+// a buffer that is being rewritten.
+#define NR_SNAPSHOTS 4
+
+struct metrics_snapshot {
+    struct expo_buf expo;
+    atomic_int refs;        // HTTP connections still sending this snapshot
+};
+
+static struct metrics_snapshot snapshots[NR_SNAPSHOTS];
+static _Atomic(struct metrics_snapshot *) current_snapshot;
+
+static struct metrics_snapshot *snapshot_get(void) {
+    for (;;) {
+        struct metrics_snapshot *snap = atomic_load(&current_snapshot);
+        if (!snap)
+            return NULL;
+        atomic_fetch_add(&snap->refs, 1);
+        if (atomic_load(&current_snapshot) == snap)
+            return snap;
+        atomic_fetch_sub(&snap->refs, 1);
+    }
+}
+
+static void snapshot_put(struct metrics_snapshot *snap) {
+    atomic_fetch_sub(&snap->refs, 1);
+}
+
+// Render into a spare snapshot and make it current
+static void snapshot_publish(const struct prometheus_metrics *metrics) {
+    struct metrics_snapshot *cur = atomic_load(&current_snapshot);
+    
+    for (int i = 0; i < NR_SNAPSHOTS; i++) {
+        struct metrics_snapshot *snap = &snapshots[i];
+        
+        if (snap == cur || atomic_load(&snap->refs) != 0)
+            continue;
+        render_prometheus_metrics(&snap->expo, metrics);
+        atomic_store(&current_snapshot, snap);
+        return;
+    }
+    // Every spare snapshot is still being sent; keep serving the current one
+}
+
+// Node snapshot sent to the scheduler extender with --push, one UDP
+// datagram per interval, so placement does not wait for a Prometheus
+// scrape and query. Fields are big-endian, rates and latencies are IEEE 754
+// doubles; scheduler-extender/main.go decodes the same layout.
+#define PUSH_MAGIC 0x45425046   // "EBPF"
+#define PUSH_VERSION 1
+
+struct push_snapshot {
+    __u32 magic;
+    __u16 version;
+    __u16 size;             // sizeof(struct push_snapshot)
+    __u64 timestamp_ns;     // CLOCK_REALTIME; orders snapshots of a node
+    __u64 rtt_p99_ms;
+    __u64 retrans_rate;
+    __u64 drop_rate;
+    __u64 runqlat_p95_ms;
+    __u64 cpu_util;
+    char node[64];
+};
+
+_Static_assert(sizeof(struct push_snapshot) == 120, "push_snapshot layout changed");
+
+static __u64 push_double(double v) {
+    __u64 bits;
+    
+    memcpy(&bits, &v, sizeof(bits));
+    return htobe64(bits);
+}
+
+// Open a UDP socket connected to HOST:PORT ([HOST]:PORT for IPv6)
+static int push_open(const char *addr) {
+    struct addrinfo hints = { .ai_socktype = SOCK_DGRAM }, *res, *ai;
+    char host[256];
+    const char *port = strrchr(addr, ':');
+    int fd = -1, err;
+    
+    if (!port || port == addr || (size_t)(port - addr) >= sizeof(host)) {
+        fprintf(stderr, "Invalid --push address: %s\n", addr);
+        return -EINVAL;
+    }
+    if (addr[0] == '[' && port[-1] == ']')
+        snprintf(host, sizeof(host), "%.*s", (int)(port - addr - 2), addr + 1);
+    else
+        snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+    
+    err = getaddrinfo(host, port + 1, &hints, &res);
+    if (err) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", addr, gai_strerror(err));
+        return -EINVAL;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        err = -errno;
+        if (fd >= 0)
+            close(fd);
+        fd = err;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        fprintf(stderr, "Failed to connect to %s: %s\n", addr, strerror(-fd));
+    return fd;
+}
+
+// Send the node snapshot; a missing extender only costs one ICMP error
+static void push_snapshot_send(int fd, const struct prometheus_metrics *metrics) {
+    struct push_snapshot snap = {
+        .magic = htobe32(PUSH_MAGIC),
+        .version = htobe16(PUSH_VERSION),
+        .size = htobe16(sizeof(snap)),
+        .rtt_p99_ms = push_double(metrics->rtt_p99_ms),
+        .retrans_rate = push_double(metrics->tcp_retrans_rate),
+        .drop_rate = push_double(metrics->drop_rate),
+        .runqlat_p95_ms = push_double(metrics->runqlat_p95_ms),
+        .cpu_util = push_double(metrics->cpu_utilization),
+    };
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snap.timestamp_ns = htobe64(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    snprintf(snap.node, sizeof(snap.node), "%s", metrics->node_name);
+    send(fd, &snap, sizeof(snap), MSG_DONTWAIT);
+}
+
+struct aggregator {
+    struct event_queue *queue;
+    struct ring_buffer *rb;
+    struct prometheus_metrics metrics;
+    struct expo_buf stdout_buf;
+    struct sample_controller sampling;
+    int timer_fd;
+    int push_fd;            // --push socket, or -1
+};
+
+static void *aggregator_main(void *arg) {
+    struct aggregator *agg = arg;
+    struct pollfd pfd[3] = { { .fd = agg->timer_fd, .events = POLLIN } };
+    int nfds = 1;
+    struct telemetry_event e;
+    
+    // Probe replies are timestamped by the kernel, so handling them at the
+    // aggregator's pace costs no accuracy
+    if (prober) {
+        int fds[2];
+        
+        prober_fds(prober, fds);
+        for (int i = 0; i < 2; i++)
+            pfd[nfds++] = (struct pollfd){ .fd = fds[i], .events = POLLIN };
+    }
+    
+    while (!exiting) {
+        int n = poll(pfd, nfds, EVENT_DRAIN_MS);
+        
+        if (prober)
+            prober_poll(prober, monotonic_ns());
+        
+        while (event_queue_pop(agg->queue, &e)) {
+            sample_controller_count(&agg->sampling, &e);
+            handle_event(&e);
+        }
+        
+        __u64 now = monotonic_ns();
+        if (now - agg->sampling.last_step_ns >= SAMPLE_CONTROL_MS * 1000000ULL)
+            sample_controller_step(&agg->sampling, now);
+        
+        __u64 expirations;
+        if (n <= 0 || !(pfd[0].revents & POLLIN) || read(agg->timer_fd, &expirations, sizeof(expirations)) < 0)
+            continue;
+        
+        update_metrics(&agg->metrics, now);
+        stage_add(STAGE_UPDATE_METRICS, monotonic_ns() - now);
+        update_pipeline_stats(&agg->metrics.pipeline, agg->rb);
+        sample_controller_export(&agg->sampling, &agg->metrics.pipeline);
+        
+        __u64 export_start = monotonic_ns();
+        snapshot_publish(&agg->metrics);
+        stage_add(STAGE_EXPORT, monotonic_ns() - export_start);
+        if (agg->push_fd >= 0)
+            push_snapshot_send(agg->push_fd, &agg->metrics);
+        if (env.stdout_export) {
+            render_prometheus_metrics(&agg->stdout_buf, &agg->metrics);
+            fwrite(agg->stdout_buf.data, 1, agg->stdout_buf.len, stdout);
+            fputc('\n', stdout);
+            fflush(stdout);
+        }
+    }
+    return NULL;
+}
+
+// Embedded HTTP server for /metrics, /health and /ready. It runs on the
+// main thread's epoll loop: non-blocking sockets, one request per connection.
+#define HTTP_MAX_CONNS 32
+#define HTTP_REQ_MAX 2048
+
+struct http_conn {
+    int fd;                 // -1 when the slot is free
+    size_t req_len;
+    size_t hdr_len;
+    const char *body;
+    size_t body_len;
+    size_t sent;            // bytes of hdr + body written so far
+    struct metrics_snapshot *snap;  // snapshot the body points into, if any
+    char hdr[256];
+    char req[HTTP_REQ_MAX];
+};
+
+struct http_server {
+    int listen_fd;
+    int epoll_fd;
+    struct http_conn conns[HTTP_MAX_CONNS];
+};
 
-// Signal handler for graceful shutdown
-static void sig_handler(int sig) {
-    exiting = true;
+// epoll tags; connections use EP_CONN + slot index
+enum {
+    EP_LISTEN = 1,
+    EP_CONN = 0x100,
+};
+
+static int http_server_init(struct http_server *srv, int epoll_fd, int port) {
+    struct sockaddr_in6 addr = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+        .sin6_addr = IN6ADDR_ANY_INIT,
+    };
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EP_LISTEN };
+    int one = 1;
+
+    memset(srv, 0, sizeof(*srv));
+    srv->listen_fd = -1;
+    for (int i = 0; i < HTTP_MAX_CONNS; i++)
+        srv->conns[i].fd = -1;
+    srv->epoll_fd = epoll_fd;
+
+    srv->listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv->listen_fd < 0)
+        return -errno;
+    setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(srv->listen_fd, 64) ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev))
+        return -errno;
+    return 0;
 }
 
-// Calculate percentile from histogram
-static double calculate_percentile(struct hist *hist, double percentile) {
-    __u32 total = 0;
-    __u32 target_count;
-    __u32 running_count = 0;
+static void http_conn_close(struct http_server *srv, struct http_conn *c) {
+    if (c->snap)
+        snapshot_put(c->snap);
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->snap = NULL;
+}
+
+static void http_server_free(struct http_server *srv) {
+    if (srv->listen_fd < 0)
+        return;  // never started
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        if (srv->conns[i].fd >= 0)
+            http_conn_close(srv, &srv->conns[i]);
+    }
+    close(srv->listen_fd);
+}
+
+static void http_accept(struct http_server *srv) {
+    for (;;) {
+        int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;  // EAGAIN or a transient error; try again on next wakeup
+
+        int slot = -1;
+        for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+            if (srv->conns[i].fd < 0) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0) {
+            close(fd);
+            continue;
+        }
+
+        struct http_conn *c = &srv->conns[slot];
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EP_CONN + slot };
+        memset(c, 0, offsetof(struct http_conn, hdr));
+        c->fd = fd;
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            c->fd = -1;
+        }
+    }
+}
+
+// Write as much of the response as the socket takes; true when finished
+static bool http_flush(struct http_conn *c) {
+    while (c->sent < c->hdr_len + c->body_len) {
+        struct iovec iov[2];
+        int n = 0;
+
+        if (c->sent < c->hdr_len) {
+            iov[n].iov_base = c->hdr + c->sent;
+            iov[n++].iov_len = c->hdr_len - c->sent;
+            iov[n].iov_base = (void *)c->body;
+            iov[n++].iov_len = c->body_len;
+        } else {
+            iov[n].iov_base = (void *)(c->body + (c->sent - c->hdr_len));
+            iov[n++].iov_len = c->body_len - (c->sent - c->hdr_len);
+        }
+
+        ssize_t w = writev(c->fd, iov, n);
+        if (w < 0)
+            return errno != EAGAIN && errno != EINTR;  // give up on errors
+        c->sent += w;
+    }
+    return true;
+}
+
+static void http_respond(struct http_server *srv, struct http_conn *c) {
+    static const char ok_body[] = "OK\n";
+    static const char not_found[] = "Not Found\n";
+    static const char bad_method[] = "Method Not Allowed\n";
+    static const char not_ready[] = "Metrics not collected yet\n";
+    const char *status = "200 OK";
+    const char *type = "text/plain; charset=utf-8";
+    char method[8] = "", path[256] = "";
+
+    if (sscanf(c->req, "%7s %255s", method, path) != 2) {
+        status = "400 Bad Request";
+        c->body = "";
+    } else if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        status = "405 Method Not Allowed";
+        c->body = bad_method;
+    } else if (strcmp(path, "/metrics") == 0) {
+        // Pin the latest snapshot until the response has been sent
+        c->snap = snapshot_get();
+        if (c->snap) {
+            type = "text/plain; version=0.0.4; charset=utf-8";
+            c->body = c->snap->expo.data;
+            c->body_len = c->snap->expo.len;
+        } else {
+            status = "503 Service Unavailable";
+            c->body = not_ready;
+        }
+    } else if (strcmp(path, "/health") == 0 || strcmp(path, "/ready") == 0) {
+        c->body = ok_body;
+    } else {
+        status = "404 Not Found";
+        c->body = not_found;
+    }
+    if (!c->snap)
+        c->body_len = strlen(c->body);
+
+    c->hdr_len = snprintf(c->hdr, sizeof(c->hdr),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n",
+                          status, type, c->body_len);
+    if (strcmp(method, "HEAD") == 0)
+        c->body_len = 0;
+}
+
+static void http_handle(struct http_server *srv, int slot, __u32 events) {
+    struct http_conn *c = &srv->conns[slot];
+
+    if (c->fd < 0)
+        return;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        http_conn_close(srv, c);
+        return;
+    }
+
+    if (c->hdr_len == 0) {
+        ssize_t n = read(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            http_conn_close(srv, c);
+            return;
+        }
+        if (n < 0)
+            return;
+        c->req_len += n;
+        c->req[c->req_len] = '\0';
+
+        if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+            if (c->req_len == sizeof(c->req) - 1)
+                http_conn_close(srv, c);  // request too large
+            return;
+        }
+        http_respond(srv, c);
+    }
+
+    if (http_flush(c)) {
+        http_conn_close(srv, c);
+    } else {
+        struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = EP_CONN + slot };
+        epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+static struct bpf_program *rtt_backend_prog(int backend) {
+    switch (backend) {
+        case RTT_SOCKOPS:
+            return skel->progs.sockops_rtt;
+        case RTT_FENTRY:
+            return skel->progs.fentry_tcp_rcv_established;
+        case RTT_KPROBE:
+            return skel->progs.kprobe_tcp_rcv_established;
+        default:
+            return skel->progs.trace_tcp_ack;
+    }
+}
+
+// Kernel features, probed once before anything is loaded. They rule out
+// the RTT backends the kernel cannot run and pick the variant of each hook.
+static struct features {
+    bool btf;             // vmlinux BTF, for CO-RE and BTF-typed programs
+    bool tracing;         // fentry and tp_btf programs
+    bool sockops;         // sock_ops programs with socket storage
+    bool ringbuf;
+    bool task_storage;    // task storage usable from tp_btf programs
+    bool rcv_established; // tcp_rcv_established in BTF, for fentry
+    bool tcp_ack;         // tcp/tcp_ack tracepoint
+    bool mmapable;        // BPF_F_MMAPABLE arrays
+} features;
+
+// Whether category/name exists in tracefs. Without an accessible tracefs
+// the answer is left to the attach.
+static bool tracepoint_exists(const char *category, const char *name) {
+    static const char *const roots[] = {
+        "/sys/kernel/tracing/events",
+        "/sys/kernel/debug/tracing/events",
+    };
+    char path[PATH_MAX];
+    bool tracefs = false;
+
+    for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+        if (access(roots[i], F_OK) != 0)
+            continue;
+        tracefs = true;
+        snprintf(path, sizeof(path), "%s/%s/%s", roots[i], category, name);
+        if (access(path, F_OK) == 0)
+            return true;
+    }
+    return !tracefs;
+}
+
+static void probe_features(void) {
+    struct btf *btf = btf__load_vmlinux_btf();
+
+    if (btf) {
+        features.btf = true;
+        features.rcv_established =
+            btf__find_by_name_kind(btf, "tcp_rcv_established", BTF_KIND_FUNC) > 0;
+        // The typedef tp_btf attaches by
+        features.tracing = btf__find_by_name_kind(btf, "btf_trace_sched_switch",
+                                                  BTF_KIND_TYPEDEF) > 0 &&
+                           libbpf_probe_bpf_prog_type(BPF_PROG_TYPE_TRACING, NULL) == 1;
+        btf__free(btf);
+    }
+    features.sockops = libbpf_probe_bpf_prog_type(BPF_PROG_TYPE_SOCK_OPS, NULL) == 1 &&
+                       libbpf_probe_bpf_map_type(BPF_MAP_TYPE_SK_STORAGE, NULL) == 1;
+    features.ringbuf = libbpf_probe_bpf_map_type(BPF_MAP_TYPE_RINGBUF, NULL) == 1;
+    // The map type (5.11) predates its use from tracing programs (5.12)
+    features.task_storage = features.tracing &&
+        libbpf_probe_bpf_helper(BPF_PROG_TYPE_TRACING, BPF_FUNC_task_storage_get, NULL) == 1;
+    features.tcp_ack = tracepoint_exists("tcp", "tcp_ack");
+
+    LIBBPF_OPTS(bpf_map_create_opts, opts, .map_flags = BPF_F_MMAPABLE);
+    int fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, NULL, sizeof(__u32), sizeof(__u32), 1, &opts);
+    features.mmapable = fd >= 0;
+    if (fd >= 0)
+        close(fd);
+
+    printf("Kernel features: btf=%d tracing=%d sockops=%d ringbuf=%d task_storage=%d mmapable=%d\n",
+           features.btf, features.tracing, features.sockops, features.ringbuf,
+           features.task_storage, features.mmapable);
+}
+
+static bool rtt_backend_supported(int backend) {
+    switch (backend) {
+        case RTT_SOCKOPS:
+            return features.sockops;
+        case RTT_FENTRY:
+            return features.tracing && features.rcv_established;
+        case RTT_KPROBE:
+            return true;
+        default:
+            return features.tcp_ack;
+    }
+}
+
+// Leave out the tracepoints the kernel does not have rather than failing
+// the attach; the RTT backend is chosen on its own
+static void skip_missing_tracepoints(int backend) {
+    struct bpf_program *prog;
+
+    bpf_object__for_each_program(prog, skel->obj) {
+        const char *sec = bpf_program__section_name(prog);
+        char category[64];
+        const char *name;
+
+        if (!bpf_program__autoload(prog) || prog == rtt_backend_prog(backend) ||
+            strncmp(sec, "tracepoint/", 11) != 0)
+            continue;
+        sec += 11;
+        name = strchr(sec, '/');
+        if (!name || name - sec >= (int)sizeof(category))
+            continue;
+        snprintf(category, sizeof(category), "%.*s", (int)(name - sec), sec);
+        if (!tracepoint_exists(category, name + 1)) {
+            fprintf(stderr, "Tracepoint %s/%s not found, %s disabled\n", category, name + 1,
+                    bpf_program__name(prog));
+            bpf_program__set_autoload(prog, false);
+        }
+    }
+}
+
+// sock_ops programs are attached to a cgroup rather than auto-attached;
+// attaching at the cgroup v2 root covers every socket on the node
+static int attach_sockops(void) {
+    int cg_fd, err;
     
-    // Calculate total count
-    for (int i = 0; i < MAX_SLOTS; i++) {
-        total += hist->slots[i];
+    cg_fd = open(env.cgroup_path, O_RDONLY | O_DIRECTORY);
+    if (cg_fd < 0) {
+        err = -errno;
+        fprintf(stderr, "Failed to open cgroup %s: %s\n", env.cgroup_path, strerror(-err));
+        return err;
     }
     
-    if (total == 0)
-        return 0.0;
+    skel->links.sockops_rtt = bpf_program__attach_cgroup(skel->progs.sockops_rtt, cg_fd);
+    err = skel->links.sockops_rtt ? 0 : -errno;
+    close(cg_fd);
+    if (err)
+        fprintf(stderr, "Failed to attach sockops to %s: %d\n", env.cgroup_path, err);
+    return err;
+}
+
+// Clock events on every CPU that run flush_event_batch in --batch-events
+// mode, so a CPU that stops producing events still gets its batch out
+static struct bpf_link **flush_links;
+static int nr_flush_links;
+
+static void detach_batch_flush(void) {
+    for (int i = 0; i < nr_flush_links; i++)
+        bpf_link__destroy(flush_links[i]);   // also closes the perf event
+    free(flush_links);
+    flush_links = NULL;
+    nr_flush_links = 0;
+}
+
+static int attach_batch_flush(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_SOFTWARE,
+        .config = PERF_COUNT_SW_CPU_CLOCK,
+        .size = sizeof(attr),
+        .freq = 1,
+        .sample_freq = 1000 / BATCH_FLUSH_MS,
+    };
+    int n = libbpf_num_possible_cpus();
+    int err;
     
-    target_count = (total * percentile) / 100.0;
+    if (n < 0)
+        return n;
+    flush_links = calloc(n, sizeof(*flush_links));
+    if (!flush_links)
+        return -ENOMEM;
     
-    // Find the bucket containing the target percentile
-    for (int i = 0; i < MAX_SLOTS; i++) {
-        running_count += hist->slots[i];
-        if (running_count >= target_count) {
-            // Convert bucket index back to value (2^i)
-            return (double)(1 << i);
+    for (int cpu = 0; cpu < n; cpu++) {
+        int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENODEV)   // possible but offline CPU
+                continue;
+            err = -errno;
+            fprintf(stderr, "Failed to open clock event on CPU %d: %s\n", cpu, strerror(-err));
+            return err;
         }
+        struct bpf_link *link = bpf_program__attach_perf_event(skel->progs.flush_event_batch, fd);
+        if (!link) {
+            err = -errno;
+            close(fd);
+            fprintf(stderr, "Failed to attach batch flush on CPU %d: %d\n", cpu, err);
+            return err;
+        }
+        flush_links[nr_flush_links++] = link;
+    }
+    return 0;
+}
+
+// Pinned state for --pin. Maps and links of one BPF object and
+// configuration live in PIN_ROOT/<hash>/. An agent that restarts with the
+// same object and knobs opens the pinned links instead of loading the
+// programs, so the verifier does not run again, the hooks never detach
+// and the maps keep counting. Any other object or configuration gets a
+// directory of its own, and the stale ones are removed once it runs.
+static char pin_dir[PATH_MAX];
+static bool hot_restart;    // load_ebpf reused pinned programs and maps
+
+static __u64 fnv1a(__u64 h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Derive pin_dir from the object, the .rodata knobs and the programs
+// loaded, which together decide the hooks and map layouts. Changing a knob
+// such as --poll (ringbuf_no_wakeup) therefore never reuses programs built
+// for another value.
+static void pin_dir_init(void) {
+    const struct bpf_object_skeleton *s = skel->skeleton;
+    size_t elf_sz, rodata_sz;
+    const void *elf = telemetry_bpf__elf_bytes(&elf_sz);
+    const void *rodata = bpf_map__initial_value(skel->maps.rodata, &rodata_sz);
+    __u64 h = 0xcbf29ce484222325ULL;
+
+    h = fnv1a(h, elf, elf_sz);
+    h = fnv1a(h, rodata, rodata_sz);
+    for (int i = 0; i < s->prog_cnt; i++) {
+        if (bpf_program__autoload(*s->progs[i].prog))
+            h = fnv1a(h, s->progs[i].name, strlen(s->progs[i].name) + 1);
     }
+    snprintf(pin_dir, sizeof(pin_dir), "%s/%016llx", PIN_ROOT, (unsigned long long)h);
+}
+
+static int pin_path(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static int pin_path(char *buf, size_t size, const char *fmt, ...) {
+    va_list ap;
+    int n = snprintf(buf, size, "%s/", pin_dir);
     
-    return 0.0;
+    va_start(ap, fmt);
+    n += vsnprintf(buf + n, size - n, fmt, ap);
+    va_end(ap);
+    return (size_t)n < size ? 0 : -ENAMETOOLONG;
 }
 
-// Get CPU utilization from /proc/stat
-static double get_cpu_utilization() {
-    FILE *fp = fopen("/proc/stat", "r");
-    if (!fp)
-        return 0.0;
+// Remove the pins in dir whose names start with prefix (all for ""), and
+// dir itself once it is empty
+static void unpin_dir(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    char path[PATH_MAX];
     
-    unsigned long long user, nice, system, idle, iowait, irq, softirq;
-    if (fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu",
-               &user, &nice, &system, &idle, &iowait, &irq, &softirq) != 7) {
-        fclose(fp);
-        return 0.0;
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strncmp(de->d_name, prefix, strlen(prefix)) != 0)
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) < (int)sizeof(path))
+            unlink(path);
     }
-    fclose(fp);
+    closedir(d);
+    rmdir(dir);
+}
+
+// Drop the directories of other objects and configurations; their
+// programs detach once no agent holds them any more
+static void unpin_stale(void) {
+    DIR *d = opendir(PIN_ROOT);
+    struct dirent *de;
+    char path[PATH_MAX];
     
-    unsigned long long total = user + nice + system + idle + iowait + irq + softirq;
-    unsigned long long busy = total - idle - iowait;
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' ||
+            snprintf(path, sizeof(path), "%s/%s", PIN_ROOT, de->d_name) >= (int)sizeof(path) ||
+            strcmp(path, pin_dir) == 0)
+            continue;
+        unpin_dir(path, "");
+    }
+    closedir(d);
+}
+
+static int unpin_all(void) {
+    DIR *d = opendir(PIN_ROOT);
     
-    return (double)busy / total * 100.0;
+    if (!d)
+        return errno == ENOENT ? 0 : -errno;
+    closedir(d);
+    pin_dir[0] = '\0';
+    unpin_stale();
+    if (rmdir(PIN_ROOT) != 0) {
+        fprintf(stderr, "Failed to remove %s: %s\n", PIN_ROOT, strerror(errno));
+        return -errno;
+    }
+    return 0;
 }
 
-// Get node name from hostname
-static void get_node_name(char *node_name, size_t size) {
-    if (gethostname(node_name, size) != 0) {
-        strncpy(node_name, "unknown", size);
+// Point every map at its pin before load: libbpf reuses a compatible
+// pinned map and pins the maps it creates
+static int pin_maps(void) {
+    struct bpf_map *map;
+    char path[PATH_MAX];
+    int err;
+    
+    if ((mkdir(PIN_ROOT, 0700) && errno != EEXIST) || (mkdir(pin_dir, 0700) && errno != EEXIST)) {
+        err = -errno;
+        fprintf(stderr, "Failed to create %s: %s\n", pin_dir, strerror(-err));
+        return err;
     }
+    bpf_object__for_each_map(map, skel->obj) {
+        err = pin_path(path, sizeof(path), "%s", bpf_map__name(map));
+        if (!err)
+            err = bpf_map__set_pin_path(map, path);
+        if (err)
+            return err;
+    }
+    return 0;
 }
 
-// Process telemetry data and update metrics
-static void update_metrics(struct prometheus_metrics *metrics, __u32 node_id) {
-    struct node_metrics node_data;
-    struct hist rtt_hist;
+// Open the links pinned for this configuration in place of attaching.
+// Fails unless every program that would be attached has one.
+static int open_pinned_links(void) {
+    const struct bpf_object_skeleton *s = skel->skeleton;
+    char path[PATH_MAX];
+    int n = libbpf_num_possible_cpus();
     
-    // Read node metrics from BPF map
-    if (bpf_map_lookup_elem(bpf_map__fd(skel->maps.node_metrics_map), 
-                           &node_id, &node_data) == 0) {
-        
-        // Calculate retransmission rate (per second)
-        static __u64 prev_retrans = 0;
-        static __u64 prev_drops = 0;
-        static time_t prev_time = 0;
-        
-        time_t current_time = time(NULL);
-        if (prev_time > 0) {
-            double time_diff = difftime(current_time, prev_time);
-            if (time_diff > 0) {
-                metrics->tcp_retrans_rate = 
-                    (node_data.retrans_count - prev_retrans) / time_diff;
-                metrics->drop_rate = 
-                    (node_data.drop_count - prev_drops) / time_diff;
-            }
-        }
+    for (int i = 0; i < s->prog_cnt; i++) {
+        struct bpf_program *prog = *s->progs[i].prog;
         
-        prev_retrans = node_data.retrans_count;
-        prev_drops = node_data.drop_count;
-        prev_time = current_time;
-        
-        // Calculate average runqueue latency (simplified - should be percentile)
-        if (node_data.runqlat_count > 0) {
-            metrics->runqlat_p95_ms = 
-                (double)node_data.runqlat_sum / node_data.runqlat_count;
-        }
+        if (!bpf_program__autoload(prog) || prog == skel->progs.flush_event_batch)
+            continue;
+        if (pin_path(path, sizeof(path), "link.%s", s->progs[i].name))
+            return -ENAMETOOLONG;
+        *s->progs[i].link = bpf_link__open(path);
+        if (!*s->progs[i].link)
+            return -errno;
     }
     
-    // Read RTT histogram and calculate percentiles
-    if (bpf_map_lookup_elem(bpf_map__fd(skel->maps.rtt_hist_map), 
-                           &node_id, &rtt_hist) == 0) {
-        metrics->rtt_p50_ms = calculate_percentile(&rtt_hist, 50.0);
-        metrics->rtt_p99_ms = calculate_percentile(&rtt_hist, 99.0);
+    if (!env.batch_events)
+        return 0;
+    flush_links = calloc(n > 0 ? n : 1, sizeof(*flush_links));
+    if (!flush_links)
+        return -ENOMEM;
+    for (int i = 0; i < n; i++) {
+        if (pin_path(path, sizeof(path), "link.flush_event_batch.%d", i))
+            return -ENAMETOOLONG;
+        if (!(flush_links[nr_flush_links] = bpf_link__open(path)))
+            break;
+        nr_flush_links++;
     }
+    return nr_flush_links ? 0 : -ENOENT;
+}
+
+// Pin the links of a fresh attach, replacing whatever was left over
+static int pin_links(void) {
+    const struct bpf_object_skeleton *s = skel->skeleton;
+    char path[PATH_MAX];
+    int err;
     
-    // Get CPU utilization
-    metrics->cpu_utilization = get_cpu_utilization();
+    unpin_dir(pin_dir, "link.");
+    for (int i = 0; i < s->prog_cnt; i++) {
+        if (!*s->progs[i].link)
+            continue;
+        err = pin_path(path, sizeof(path), "link.%s", s->progs[i].name);
+        if (!err)
+            err = bpf_link__pin(*s->progs[i].link, path);
+        if (err)
+            goto fail;
+    }
+    // Kernels without perf_event BPF links cannot pin these; such agents
+    // just load the programs again on the next start
+    for (int i = 0; i < nr_flush_links; i++) {
+        if (pin_path(path, sizeof(path), "link.flush_event_batch.%d", i) ||
+            bpf_link__pin(flush_links[i], path)) {
+            unpin_dir(pin_dir, "link.flush_event_batch.");
+            break;
+        }
+    }
+    return 0;
     
-    // Update timestamp
-    metrics->last_update = time(NULL);
+fail:
+    fprintf(stderr, "Failed to pin links in %s: %s\n", pin_dir, strerror(-err));
+    unpin_dir(pin_dir, "link.");
+    return err;
+}
+
+// Sampling thresholds of the flags; before load they are the initial value
+// of .data, afterwards they go straight to the mapped map
+static void set_sample_thresh(void) {
+    skel->data->sample_thresh[EVENT_RTT] = sample_rate_thresh(env.rtt_sample_rate);
+    skel->data->sample_thresh[EVENT_RETRANS] = sample_rate_thresh(env.retrans_sample_rate);
+    skel->data->sample_thresh[EVENT_DROP] = sample_rate_thresh(env.drop_sample_rate);
 }
 
-// Export metrics in Prometheus format
-static void export_prometheus_metrics(struct prometheus_metrics *metrics) {
-    printf("# HELP ebpf_rtt_p50_milliseconds 50th percentile RTT in milliseconds\n");
-    printf("# TYPE ebpf_rtt_p50_milliseconds gauge\n");
-    printf("ebpf_rtt_p50_milliseconds{node=\"%s\"} %.2f\n", 
-           metrics->node_name, metrics->rtt_p50_ms);
+// Open, load and attach the skeleton with the given RTT backend. With
+// --pin and hot_only, only a restart onto pinned links is attempted.
+static int load_ebpf(int backend, bool hot_only) {
+    bool hot = false;
+    int err;
     
-    printf("# HELP ebpf_rtt_p99_milliseconds 99th percentile RTT in milliseconds\n");
-    printf("# TYPE ebpf_rtt_p99_milliseconds gauge\n");
-    printf("ebpf_rtt_p99_milliseconds{node=\"%s\"} %.2f\n", 
-           metrics->node_name, metrics->rtt_p99_ms);
+    skel = telemetry_bpf__open();
+    if (!skel) {
+        fprintf(stderr, "Failed to open BPF skeleton\n");
+        return -errno;
+    }
     
-    printf("# HELP ebpf_tcp_retrans_rate TCP retransmission rate per second\n");
-    printf("# TYPE ebpf_tcp_retrans_rate gauge\n");
-    printf("ebpf_tcp_retrans_rate{node=\"%s\"} %.2f\n", 
-           metrics->node_name, metrics->tcp_retrans_rate);
+    // Map types and knobs must be fixed before load
+    skel->rodata->percpu_maps = env.percpu_maps;
+    skel->rodata->mmap_stats = env.mmap_stats;
+    skel->rodata->aggregate_only = env.aggregate_only;
+    skel->rodata->batch_events = env.batch_events;
+    skel->rodata->batch_flush_ns = BATCH_FLUSH_MS * 1000000ULL;
+    skel->rodata->ringbuf_no_wakeup = env.poll.mode != POLL_EPOLL;
+    skel->rodata->drop_locations = env.drop_locations;
+    skel->rodata->cgroup_metrics = env.cgroup_metrics;
+    skel->rodata->flow_topk = env.flow_topk;
+    set_sample_thresh();
+    skel->rodata->rtt_outlier_ms = env.rtt_outlier_ms;
+    skel->rodata->rtt_min_interval_ms = env.rtt_min_interval_ms;
+    skel->rodata->rtt_min_change_us = env.rtt_min_change_us;
+    if (!env.percpu_maps) {
+        bpf_map__set_type(skel->maps.node_metrics_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.rtt_hist_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.drop_reason_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.runqlat_hist_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.net_hist_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.event_stats_map, BPF_MAP_TYPE_ARRAY);
+    }
+    bpf_map__set_autocreate(skel->maps.node_stats_map, env.mmap_stats);
+    bpf_map__set_autocreate(skel->maps.node_metrics_map, !env.mmap_stats);
+    bpf_map__set_autocreate(skel->maps.rtt_hist_map, !env.mmap_stats);
+    bpf_map__set_autocreate(skel->maps.drop_reason_map, !env.mmap_stats);
+    bpf_map__set_autocreate(skel->maps.runqlat_hist_map, !env.mmap_stats);
+    bpf_map__set_autocreate(skel->maps.net_hist_map, !env.mmap_stats);
+    if (env.mmap_stats)
+        bpf_map__set_max_entries(skel->maps.node_stats_map, libbpf_num_possible_cpus());
+    for (int i = 0; i < NR_RTT_BACKENDS; i++)
+        bpf_program__set_autoload(rtt_backend_prog(i), i == backend);
+    // Socket storage for the BTF-aware backends, an LRU map for the others
+    bpf_map__set_autocreate(skel->maps.sk_rtt_storage,
+                            backend == RTT_SOCKOPS || backend == RTT_FENTRY);
+    bpf_map__set_autocreate(skel->maps.sk_rtt_lru,
+                            backend == RTT_KPROBE || backend == RTT_TRACEPOINT);
+    bpf_program__set_autoload(skel->progs.flush_event_batch, env.batch_events);
+    bpf_map__set_autocreate(skel->maps.event_staging_map, env.batch_events);
+    bpf_map__set_autocreate(skel->maps.drop_location_map, env.drop_locations);
+    bpf_map__set_autocreate(skel->maps.cgroup_metrics_map, env.cgroup_metrics);
+    bpf_map__set_autocreate(skel->maps.cgroup_init, env.cgroup_metrics);
+    bpf_map__set_autocreate(skel->maps.flow_sketch_map, env.flow_topk);
+    bpf_map__set_autocreate(skel->maps.flow_topk_map, env.flow_topk);
+    // UDP latency needs kprobes on hot paths; only with --udp-latency
+    bpf_program__set_autoload(skel->progs.kprobe_udp_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kretprobe_udp_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kprobe_udpv6_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kretprobe_udpv6_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kprobe_udp_enqueue, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kprobe_udp_consume, env.udp_latency);
+    bpf_map__set_autocreate(skel->maps.udp_send_start, env.udp_latency);
+    bpf_map__set_autocreate(skel->maps.udp_enqueue_ts, env.udp_latency);
+    // Runqueue hooks: tp_btf with task storage where the kernel has both,
+    // else the classic tracepoints with a PID hash
+    bpf_program__set_autoload(skel->progs.tp_btf_sched_wakeup, features.task_storage);
+    bpf_program__set_autoload(skel->progs.tp_btf_sched_wakeup_new, features.task_storage);
+    bpf_program__set_autoload(skel->progs.tp_btf_sched_switch, features.task_storage);
+    bpf_program__set_autoload(skel->progs.trace_sched_wakeup, !features.task_storage);
+    bpf_program__set_autoload(skel->progs.trace_sched_wakeup_new, !features.task_storage);
+    bpf_program__set_autoload(skel->progs.trace_sched_switch, !features.task_storage);
+    bpf_map__set_autocreate(skel->maps.task_wakeup_storage, features.task_storage);
+    bpf_map__set_autocreate(skel->maps.wakeup_ts_map, !features.task_storage);
+    skip_missing_tracepoints(backend);
+
+    if (env.pin) {
+        pin_dir_init();
+        hot = open_pinned_links() == 0;
+        if (!hot) {
+            err = -ENOENT;
+            if (hot_only)
+                goto fail;
+            // Links of a partial pin die with the skeleton; the pins stay
+            for (int i = 0; i < skel->skeleton->prog_cnt; i++) {
+                bpf_link__destroy(*skel->skeleton->progs[i].link);
+                *skel->skeleton->progs[i].link = NULL;
+            }
+            detach_batch_flush();
+        }
+        err = pin_maps();
+        if (err)
+            goto fail;
+        // The pinned links keep the running programs; load maps only
+        if (hot) {
+            struct bpf_program *prog;
+            bpf_object__for_each_program(prog, skel->obj)
+                bpf_program__set_autoload(prog, false);
+        }
+    }
     
-    printf("# HELP ebpf_drop_rate Packet drop rate per second\n");
-    printf("# TYPE ebpf_drop_rate gauge\n");
-    printf("ebpf_drop_rate{node=\"%s\"} %.2f\n", 
-           metrics->node_name, metrics->drop_rate);
+    err = telemetry_bpf__load(skel);
+    if (err) {
+        fprintf(stderr, "Failed to load BPF skeleton (%s RTT backend): %d\n",
+                rtt_backend_names[backend], err);
+        goto fail;
+    }
+    if (hot) {
+        // The pinned .data map was reused as it was, with the previous
+        // agent's sampling thresholds
+        set_sample_thresh();
+        hot_restart = true;
+        printf("Reusing pinned BPF programs and maps in %s\n", pin_dir);
+        return 0;
+    }
     
-    printf("# HELP ebpf_runqlat_p95_milliseconds 95th percentile runqueue latency\n");
-    printf("# TYPE ebpf_runqlat_p95_milliseconds gauge\n");
-    printf("ebpf_runqlat_p95_milliseconds{node=\"%s\"} %.2f\n", 
-           metrics->node_name, metrics->runqlat_p95_ms);
+    err = telemetry_bpf__attach(skel);
+    if (!err && backend == RTT_SOCKOPS)
+        err = attach_sockops();
+    if (!err && env.batch_events)
+        err = attach_batch_flush();
+    if (err) {
+        fprintf(stderr, "Failed to attach BPF skeleton (%s RTT backend): %d\n",
+                rtt_backend_names[backend], err);
+        goto fail;
+    }
+    if (env.pin) {
+        err = pin_links();
+        if (err)
+            goto fail;
+        unpin_stale();
+    }
+    return 0;
     
-    printf("# HELP ebpf_cpu_utilization CPU utilization percentage\n");
-    printf("# TYPE ebpf_cpu_utilization gauge\n");
-    printf("ebpf_cpu_utilization{node=\"%s\"} %.2f\n", 
-           metrics->node_name, metrics->cpu_utilization);
+fail:
+    detach_batch_flush();
+    telemetry_bpf__destroy(skel);
+    skel = NULL;
+    // Maps pinned by a failed cold start would only be reused by accident
+    if (env.pin && !hot && !hot_only)
+        unpin_dir(pin_dir, "");
+    return err;
+}
+
+// fd of the program behind a link, for programs this process did not load
+static int link_prog_fd(struct bpf_link *link) {
+    struct bpf_link_info info = {};
+    __u32 len = sizeof(info);
     
-    printf("\n");
-    fflush(stdout);
+    if (bpf_link_get_info_by_fd(bpf_link__fd(link), &info, &len) != 0)
+        return -errno;
+    return bpf_prog_get_fd_by_id(info.prog_id);
 }
 
-// Handle ring buffer events
-static int handle_event(void *ctx, void *data, size_t data_sz) {
-    const struct telemetry_event *e = data;
+// Turn on BPF run time stats and collect the fds of the running programs
+static void prog_stats_init(void) {
+    const struct bpf_object_skeleton *s = skel->skeleton;
     
-    switch (e->event_type) {
-        case 1: // RTT event
-            printf("DEBUG: RTT event - Node: %u, Value: %llu ms\n", 
-                   e->node_id, e->value);
-            break;
-        case 2: // Retransmission event
-            printf("DEBUG: Retrans event - Node: %u\n", e->node_id);
-            break;
-        case 3: // Drop event
-            printf("DEBUG: Drop event - Node: %u, Reason: %u\n", 
-                   e->node_id, e->extra_data);
-            break;
-        case 4: // Runqueue latency event
-            printf("DEBUG: Runqlat event - Node: %u, Value: %llu ms\n", 
-                   e->node_id, e->value);
-            break;
-    }
+    if (!env.prog_stats)
+        return;
+    bpf_stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+    if (bpf_stats_fd < 0)
+        fprintf(stderr, "Failed to enable BPF run time stats: %s; run times only count "
+                "with kernel.bpf_stats_enabled\n", strerror(-bpf_stats_fd));
     
-    return 0;
+    for (int i = 0; i < s->prog_cnt && nr_prog_stat_fds < MAX_PROG_STATS; i++) {
+        struct bpf_program *prog = *s->progs[i].prog;
+        struct bpf_link *link = *s->progs[i].link;
+        int fd = bpf_program__fd(prog);
+        bool owned = false;
+        
+        if (fd < 0 && prog == skel->progs.flush_event_batch && nr_flush_links)
+            link = flush_links[0];
+        if (fd < 0 && link) {
+            fd = link_prog_fd(link);
+            owned = true;
+        }
+        if (fd < 0)
+            continue;
+        prog_stat_fds[nr_prog_stat_fds].name = s->progs[i].name;
+        prog_stat_fds[nr_prog_stat_fds].fd = fd;
+        prog_stat_fds[nr_prog_stat_fds].owned = owned;
+        nr_prog_stat_fds++;
+    }
+}
+
+static void prog_stats_free(void) {
+    for (int i = 0; i < nr_prog_stat_fds; i++) {
+        if (prog_stat_fds[i].owned)
+            close(prog_stat_fds[i].fd);
+    }
+    nr_prog_stat_fds = 0;
+    if (bpf_stats_fd >= 0)
+        close(bpf_stats_fd);
+    bpf_stats_fd = -1;
 }
 
 // Setup eBPF program
 static int setup_ebpf() {
-    int err;
+    int backend = env.rtt_backend;
     
-    // Open and load eBPF program
-    skel = telemetry_bpf__open();
-    if (!skel) {
-        fprintf(stderr, "Failed to open BPF skeleton\n");
+    probe_features();
+    if (!features.ringbuf) {
+        fprintf(stderr, "Kernel lacks BPF ring buffers (5.8+), which the agent needs\n");
         return 1;
     }
+    // Per-CPU slots only; --shared-maps keeps measuring the shared maps
+    env.mmap_stats &= features.mmapable && env.percpu_maps;
     
-    err = telemetry_bpf__load(skel);
-    if (err) {
-        fprintf(stderr, "Failed to load BPF skeleton: %d\n", err);
+    // A restart with --pin first looks for the programs it left running
+    if (env.pin && backend == RTT_AUTO) {
+        for (backend = 0; backend < NR_RTT_BACKENDS; backend++) {
+            if (load_ebpf(backend, true) == 0)
+                break;
+        }
+        if (backend == NR_RTT_BACKENDS)
+            backend = RTT_AUTO;
+    }
+    
+    if (skel) {
+        // Restarted onto pinned programs
+    } else if (backend == RTT_AUTO) {
+        // Cheapest hook first, down to the tracepoint older kernels still have
+        for (backend = 0; backend < NR_RTT_BACKENDS; backend++) {
+            if (rtt_backend_supported(backend) && load_ebpf(backend, false) == 0)
+                break;
+        }
+        if (backend == NR_RTT_BACKENDS)
+            return 1;
+    } else if (load_ebpf(backend, false) != 0) {
+        return 1;
+    }
+    
+    nr_cpus = env.percpu_maps ? libbpf_num_possible_cpus() : 1;
+    if (nr_cpus < 0) {
+        fprintf(stderr, "Failed to get number of possible CPUs: %d\n", nr_cpus);
+        telemetry_bpf__destroy(skel);
+        return 1;
+    }
+    percpu_buf = calloc(nr_cpus, sizeof(struct hist) > sizeof(struct node_metrics) ?
+                                 sizeof(struct hist) : sizeof(struct node_metrics));
+    if (!percpu_buf) {
+        fprintf(stderr, "Failed to allocate map lookup buffer\n");
         telemetry_bpf__destroy(skel);
         return 1;
     }
     
-    err = telemetry_bpf__attach(skel);
-    if (err) {
-        fprintf(stderr, "Failed to attach BPF skeleton: %d\n", err);
+    if (env.mmap_stats) {
+        node_stats_cpus = bpf_map__max_entries(skel->maps.node_stats_map);
+        node_stats_len = (size_t)node_stats_cpus * sizeof(struct node_stats);
+        node_stats_mem = mmap(NULL, node_stats_len, PROT_READ, MAP_SHARED,
+                              bpf_map__fd(skel->maps.node_stats_map), 0);
+        node_stats_prev = calloc(node_stats_cpus, sizeof(*node_stats_prev));
+        if (node_stats_mem == MAP_FAILED || !node_stats_prev) {
+            fprintf(stderr, "Failed to map node_stats_map: %s\n", strerror(errno));
+            node_stats_mem = NULL;
+            telemetry_bpf__destroy(skel);
+            return 1;
+        }
+    }
+    
+    if ((!env.mmap_stats &&
+         (map_dump_init(&node_metrics_dump, skel->maps.node_metrics_map) ||
+          map_dump_init(&drop_reason_dump, skel->maps.drop_reason_map))) ||
+        map_dump_init(&peer_dump, skel->maps.peer_metrics_map) ||
+        map_dump_init(&event_stats_dump, skel->maps.event_stats_map) ||
+        (env.drop_locations &&
+         map_dump_init(&drop_location_dump, skel->maps.drop_location_map)) ||
+        (env.cgroup_metrics &&
+         map_dump_init(&cgroup_dump, skel->maps.cgroup_metrics_map))) {
+        fprintf(stderr, "Failed to allocate map dump buffers\n");
+        telemetry_bpf__destroy(skel);
+        return 1;
+    }
+    
+    if (!env.mmap_stats) {
+        node_deltas = delta_set_new(sizeof(__u32), node_metrics_dump.max_entries, 2, 0);
+        drop_deltas = delta_set_new(sizeof(__u32), MAX_DROP_REASONS, 1, 0);
+    }
+    peer_deltas = delta_set_new(sizeof(struct peer_key), peer_dump.max_entries, 1, 1);
+    cgroup_deltas = env.cgroup_metrics ?
+                    delta_set_new(sizeof(__u64), cgroup_dump.max_entries, 2, 2) : NULL;
+    if ((!env.mmap_stats && (!node_deltas || !drop_deltas)) || !peer_deltas ||
+        (env.cgroup_metrics && !cgroup_deltas)) {
+        fprintf(stderr, "Failed to allocate metric snapshots\n");
         telemetry_bpf__destroy(skel);
         return 1;
     }
     
-    printf("eBPF program loaded and attached successfully\n");
+    if (env.flow_topk) {
+        flow_nr_cpus = libbpf_num_possible_cpus();
+        if (flow_nr_cpus > 0) {
+            flow_topk_buf = calloc(flow_nr_cpus, sizeof(*flow_topk_buf));
+            flow_sketch_zero = calloc(flow_nr_cpus, sizeof(struct flow_sketch));
+            flow_cands = calloc((size_t)flow_nr_cpus * FLOW_TOPK, sizeof(*flow_cands));
+        }
+        if (!flow_topk_buf || !flow_sketch_zero || !flow_cands) {
+            fprintf(stderr, "Failed to allocate flow top-K buffers\n");
+            telemetry_bpf__destroy(skel);
+            return 1;
+        }
+    }
+    
+    // Without BTF or kallsyms the labels just stay numeric
+    load_drop_reason_names();
+    if (env.drop_locations)
+        load_ksyms();
+    
+    // Without the cache every cgroup is reported as "other"
+    if (env.cgroup_metrics) {
+        cgroups = cgroup_cache_new(env.cgroup_path, cgroup_removed, NULL);
+        if (!cgroups)
+            fprintf(stderr, "Failed to watch cgroups below %s: %s\n",
+                    env.cgroup_path, strerror(errno));
+    }
+    
+    // Pinned maps still hold the previous agent's counts. Reading them once
+    // makes those the previous interval, so the first export covers only
+    // what came after the restart.
+    if (hot_restart) {
+        static struct prometheus_metrics seed;
+        
+        update_metrics(&seed, monotonic_ns());
+    }
+    
+    prog_stats_init();
+    
+    printf("eBPF program loaded and attached successfully (%s maps, %s RTT backend)\n",
+           env.mmap_stats ? "per-CPU mmap" : env.percpu_maps ? "per-CPU" : "shared",
+           rtt_backend_names[backend]);
     return 0;
 }
 
 int main(int argc, char **argv) {
     struct ring_buffer *rb = NULL;
-    struct prometheus_metrics metrics = {0};
-    int err;
+    static struct aggregator agg = { .queue = &event_queue, .timer_fd = -1, .push_fd = -1 };
+    struct http_server srv = { .listen_fd = -1 };
+    pthread_t consumer, aggregator;
+    bool consumer_started = false, aggregator_started = false;
+    sigset_t sigs, old_sigs;
+    int epoll_fd = -1;
+    int err = 0;
+    
+    parse_args(argc, argv);
+    sample_controller_init(&agg.sampling);
     
     // Setup signal handlers
-    signal(SIGINT, sig_handler);
-    signal(SIGTERM, sig_handler);
+    collector_handle_signals(&exiting);
     
     // Increase RLIMIT_MEMLOCK for BPF
-    struct rlimit rlim_new = {
-        .rlim_cur = RLIM_INFINITY,
-        .rlim_max = RLIM_INFINITY,
-    };
-    if (setrlimit(RLIMIT_MEMLOCK, &rlim_new)) {
+    if (collector_bump_memlock()) {
         fprintf(stderr, "Failed to increase RLIMIT_MEMLOCK limit!\n");
         return 1;
     }
     
     // Get node name
-    get_node_name(metrics.node_name, sizeof(metrics.node_name));
+    get_node_name(agg.metrics.node_name, sizeof(agg.metrics.node_name));
+    
+    // Exposition buffers grow on demand; start big enough for most nodes
+    for (int i = 0; i < NR_SNAPSHOTS + env.stdout_export; i++) {
+        struct expo_buf *b = i < NR_SNAPSHOTS ? &snapshots[i].expo : &agg.stdout_buf;
+        b->cap = 64 * 1024;
+        b->data = malloc(b->cap);
+        if (!b->data) {
+            fprintf(stderr, "Failed to allocate exposition buffer\n");
+            err = -ENOMEM;
+            goto cleanup;
+        }
+    }
+    
+    if (env.peers_file && load_peer_table(env.peers_file) != 0) {
+        err = -EINVAL;
+        goto cleanup;
+    }
     
     // Setup eBPF program
     if (setup_ebpf() != 0) {
-        return 1;
+        err = -1;
+        goto cleanup;
     }
     
     // Setup ring buffer
-    rb = ring_buffer__new(bpf_map__fd(skel->maps.events), handle_event, NULL, NULL);
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.events), queue_event, &event_queue, NULL);
     if (!rb) {
         fprintf(stderr, "Failed to create ring buffer\n");
         err = -1;
         goto cleanup;
     }
+    agg.rb = rb;
+    
+    agg.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || agg.timer_fd < 0) {
+        fprintf(stderr, "Failed to create epoll/timer fd: %s\n", strerror(errno));
+        err = -errno;
+        goto cleanup;
+    }
+    
+    struct itimerspec its = {
+        .it_interval = {
+            .tv_sec = env.interval_ms / 1000,
+            .tv_nsec = env.interval_ms % 1000 * 1000000L,
+        },
+        // First update right away, or one interval after the seeding read
+        // of a hot restart
+        .it_value = {
+            .tv_sec = hot_restart ? env.interval_ms / 1000 : 0,
+            .tv_nsec = hot_restart ? env.interval_ms % 1000 * 1000000L : 1,
+        },
+    };
+    if (timerfd_settime(agg.timer_fd, 0, &its, NULL)) {
+        fprintf(stderr, "Failed to arm metrics timer: %s\n", strerror(errno));
+        err = -errno;
+        goto cleanup;
+    }
+    
+    if (env.push_addr) {
+        agg.push_fd = push_open(env.push_addr);
+        if (agg.push_fd < 0) {
+            err = agg.push_fd;
+            goto cleanup;
+        }
+        printf("Pushing node snapshots to %s every %u ms\n", env.push_addr, env.interval_ms);
+    }
+    
+    if (env.history_path) {
+        history = history_create(env.history_path, env.history_records,
+                                 env.interval_ms * 1000000ULL, agg.metrics.node_name);
+        if (!history) {
+            fprintf(stderr, "Failed to map history file %s: %s\n",
+                    env.history_path, strerror(errno));
+            err = -errno;
+            goto cleanup;
+        }
+        printf("Recording %u intervals of history in %s\n", env.history_records,
+               env.history_path);
+    }
+    
+    if (env.probe_port) {
+        prober = prober_new(env.probe_port, env.probe_interval_ms, env.probe_fanout);
+        if (!prober) {
+            fprintf(stderr, "Failed to open probe sockets on port %d: %s\n",
+                    env.probe_port, strerror(errno));
+            err = -errno;
+            goto cleanup;
+        }
+        int nr = probe_targets_init(agg.metrics.node_name);
+        if (!nr)
+            fprintf(stderr, "No single-address --peers entries to probe; only answering probes\n");
+        printf("Probing %d peers on UDP port %d, %u per round every %u ms\n",
+               nr, env.probe_port, env.probe_fanout, env.probe_interval_ms);
+    }
+    
+    if (env.port) {
+        err = http_server_init(&srv, epoll_fd, env.port);
+        if (err) {
+            fprintf(stderr, "Failed to start HTTP server on port %d: %s\n",
+                    env.port, strerror(-err));
+            goto cleanup;
+        }
+        printf("Serving metrics on :%d/metrics\n", env.port);
+    }
+    
+    // Everything is loaded; from here on the agent yields to the workloads
+    // as configured, and the worker threads inherit that
+    err = thread_policy_apply(&env.threads);
+    if (err) {
+        fprintf(stderr, "Failed to set the agent's CPU affinity or scheduling policy: %s\n",
+                strerror(-err));
+        goto cleanup;
+    }
+    
+    // Worker threads inherit a mask that keeps SIGINT/SIGTERM on this thread
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+    err = pthread_create(&consumer, NULL, consumer_main, rb);
+    consumer_started = err == 0;
+    if (!err) {
+        err = pthread_create(&aggregator, NULL, aggregator_main, &agg);
+        aggregator_started = err == 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+    if (err) {
+        fprintf(stderr, "Failed to start collector threads: %s\n", strerror(err));
+        err = -err;
+        goto cleanup;
+    }
     
-    printf("eBPF telemetry agent started on node: %s\n", metrics.node_name);
+    printf("eBPF telemetry agent started on node: %s\n", agg.metrics.node_name);
     printf("Collecting network and scheduling metrics...\n");
     
-    // Main collection loop
+    // The main thread only serves HTTP; the timeout notices worker failures
     while (!exiting) {
-        // Poll ring buffer for events
-        err = ring_buffer__poll(rb, 100 /* timeout_ms */);
-        if (err == -EINTR) {
-            err = 0;
-            break;
-        }
-        if (err < 0) {
-            printf("Error polling ring buffer: %d\n", err);
+        struct epoll_event events[16];
+        int n = epoll_wait(epoll_fd, events, 16, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err = -errno;
+            fprintf(stderr, "Error waiting for events: %s\n", strerror(errno));
             break;
         }
         
-        // Update metrics every 5 seconds
-        static time_t last_metrics_update = 0;
-        time_t now = time(NULL);
-        if (now - last_metrics_update >= 5) {
-            // Assuming node_id 0 for this node (simplification)
-            update_metrics(&metrics, 0);
-            export_prometheus_metrics(&metrics);
-            last_metrics_update = now;
+        for (int i = 0; i < n; i++) {
+            __u32 tag = events[i].data.u32;
+            
+            if (tag == EP_LISTEN) {
+                http_accept(&srv);
+            } else if (tag >= EP_CONN && tag < EP_CONN + HTTP_MAX_CONNS) {
+                http_handle(&srv, tag - EP_CONN, events[i].events);
+            }
         }
-        
-        sleep(1);
     }
     
 cleanup:
+    exiting = true;
+    if (consumer_started)
+        pthread_join(consumer, NULL);
+    if (aggregator_started)
+        pthread_join(aggregator, NULL);
+    http_server_free(&srv);
+    for (int i = 0; i < NR_SNAPSHOTS; i++)
+        free(snapshots[i].expo.data);
+    free(agg.stdout_buf.data);
+    if (agg.timer_fd >= 0)
+        close(agg.timer_fd);
+    if (agg.push_fd >= 0)
+        close(agg.push_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
     if (rb)
         ring_buffer__free(rb);
+    history_close(history);
+    prober_free(prober);
+    prog_stats_free();
+    detach_batch_flush();
     if (skel)
         telemetry_bpf__destroy(skel);
+    free(percpu_buf);
+    if (node_stats_mem)
+        munmap(node_stats_mem, node_stats_len);
+    free(node_stats_prev);
+    map_dump_free(&node_metrics_dump);
+    map_dump_free(&drop_reason_dump);
+    map_dump_free(&drop_location_dump);
+    map_dump_free(&cgroup_dump);
+    cgroup_cache_free(cgroups);
+    free_ksyms();
+    for (int i = 0; i < MAX_DROP_REASONS; i++)
+        free(drop_reason_names[i]);
+    map_dump_free(&peer_dump);
+    map_dump_free(&event_stats_dump);
+    delta_set_free(node_deltas);
+    delta_set_free(drop_deltas);
+    delta_set_free(peer_deltas);
+    delta_set_free(cgroup_deltas);
+    free(flow_topk_buf);
+    free(flow_sketch_zero);
+    free(flow_cands);
     
+    if (atomic_load(&event_queue.dropped))
+        fprintf(stderr, "%llu events dropped by a full event queue\n",
+                (unsigned long long)atomic_load(&event_queue.dropped));
     printf("eBPF telemetry agent exiting...\n");
     return err < 0 ? -err : 0;
 }
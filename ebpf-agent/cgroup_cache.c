@@ -0,0 +1,290 @@
+// Resolve cgroup v2 ids to Kubernetes pod UIDs
+//
+// The cgroup id the BPF side reports is the inode number of the cgroup
+// directory. The kubepods cgroups are scanned once at startup; after that
+// inotify reports every directory created or removed below them, so the
+// cache is updated incrementally and cgroupfs is never rescanned.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "cgroup_cache.h"
+
+#define CGROUP_TABLE_SIZE 8192   // power of two; filled to 3/4 at most
+#define CGROUP_WATCH_MASK (IN_CREATE | IN_ONLYDIR)
+
+struct cgroup_entry {
+    uint64_t id;     // 0 marks a free slot
+    int pod;
+};
+
+// Watched directory, indexed by inotify watch descriptor
+struct cgroup_watch {
+    char *path;      // NULL when unused
+    uint64_t id;
+    bool root;       // the cgroup root; only kubepods* children matter
+};
+
+struct pod_slot {
+    char uid[POD_UID_LEN];
+    int refs;        // cgroups of the pod in the table, 0 when free
+};
+
+struct cgroup_cache {
+    int fd;
+    char *root;
+    cgroup_removed_fn removed;
+    void *ctx;
+    struct cgroup_entry table[CGROUP_TABLE_SIZE];
+    int nr_entries;
+    struct cgroup_watch *watches;
+    int watch_cap;
+    struct pod_slot pods[CGROUP_CACHE_MAX_PODS];
+};
+
+static unsigned int cgroup_hash(uint64_t id) {
+    return (id * 0x9e3779b97f4a7c15ULL) >> 51;   // top 13 bits
+}
+
+// Slot holding id, or the free slot where it would go
+static unsigned int table_find(const struct cgroup_cache *c, uint64_t id) {
+    unsigned int i = cgroup_hash(id);
+
+    while (c->table[i].id && c->table[i].id != id)
+        i = (i + 1) & (CGROUP_TABLE_SIZE - 1);
+    return i;
+}
+
+// Linear probing deletion: shift later entries of the same run back so
+// lookups never stop at the hole
+static void table_remove(struct cgroup_cache *c, unsigned int i) {
+    unsigned int j = i;
+
+    c->nr_entries--;
+    for (;;) {
+        c->table[i].id = 0;
+        for (;;) {
+            j = (j + 1) & (CGROUP_TABLE_SIZE - 1);
+            if (!c->table[j].id)
+                return;
+            unsigned int home = cgroup_hash(c->table[j].id);
+            // Move j into the hole unless its home lies cyclically in (i, j]
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+                break;
+        }
+        c->table[i] = c->table[j];
+        i = j;
+    }
+}
+
+static int pod_get(struct cgroup_cache *c, const char *uid) {
+    int free_slot = -1;
+
+    for (int i = 0; i < CGROUP_CACHE_MAX_PODS; i++) {
+        if (c->pods[i].refs && strcmp(c->pods[i].uid, uid) == 0) {
+            c->pods[i].refs++;
+            return i;
+        }
+        if (!c->pods[i].refs && free_slot < 0)
+            free_slot = i;
+    }
+    if (free_slot < 0)
+        return -1;
+    snprintf(c->pods[free_slot].uid, POD_UID_LEN, "%s", uid);
+    c->pods[free_slot].refs = 1;
+    return free_slot;
+}
+
+// Pod UID from a cgroup path. The systemd driver names pod cgroups
+// kubepods-<qos>-pod<uid>.slice with '_' for '-', the cgroupfs driver
+// kubepods/<qos>/pod<uid>; container cgroups sit below them.
+static int parse_pod_uid(const char *path, char uid[POD_UID_LEN]) {
+    const char *p = strstr(path, "kubepods");
+
+    while (p && (p = strstr(p, "pod")) != NULL) {
+        p += 3;
+        if (p[-4] != '-' && p[-4] != '/')
+            continue;   // the "pod" in "kubepods"
+
+        int n = 0;
+        while (n < POD_UID_LEN - 1 && (isxdigit((unsigned char)p[n]) ||
+                                       p[n] == '-' || p[n] == '_')) {
+            uid[n] = p[n] == '_' ? '-' : p[n];
+            n++;
+        }
+        uid[n] = '\0';
+        if (n == POD_UID_LEN - 1)
+            return 0;
+    }
+    return -1;
+}
+
+static void cache_insert(struct cgroup_cache *c, uint64_t id, const char *path) {
+    char uid[POD_UID_LEN];
+    unsigned int i = table_find(c, id);
+
+    if (c->table[i].id || parse_pod_uid(path, uid) != 0)
+        return;   // already known, or a kubepods/QoS level cgroup
+    if (c->nr_entries >= CGROUP_TABLE_SIZE / 4 * 3)
+        return;
+
+    int pod = pod_get(c, uid);
+    if (pod < 0)
+        return;
+    c->table[i].id = id;
+    c->table[i].pod = pod;
+    c->nr_entries++;
+}
+
+static void cache_remove(struct cgroup_cache *c, uint64_t id) {
+    unsigned int i = table_find(c, id);
+
+    if (c->table[i].id) {
+        c->pods[c->table[i].pod].refs--;
+        table_remove(c, i);
+    }
+    if (c->removed)
+        c->removed(id, c->ctx);
+}
+
+static int watch_slot(struct cgroup_cache *c, int wd) {
+    if (wd >= c->watch_cap) {
+        int cap = c->watch_cap ? c->watch_cap : 256;
+        while (cap <= wd)
+            cap *= 2;
+        struct cgroup_watch *w = realloc(c->watches, cap * sizeof(*w));
+        if (!w)
+            return -ENOMEM;
+        memset(w + c->watch_cap, 0, (cap - c->watch_cap) * sizeof(*w));
+        c->watches = w;
+        c->watch_cap = cap;
+    }
+    return 0;
+}
+
+// Watch a cgroup directory, record it and walk its children. Children are
+// walked after the watch exists, so none created meanwhile is missed.
+static void add_cgroup(struct cgroup_cache *c, const char *path, bool root) {
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    int wd;
+
+    wd = inotify_add_watch(c->fd, path, CGROUP_WATCH_MASK);
+    if (wd < 0 || stat(path, &st) != 0 || watch_slot(c, wd) != 0)
+        return;
+
+    struct cgroup_watch *w = &c->watches[wd];
+    free(w->path);
+    w->path = strdup(path);
+    w->id = st.st_ino;
+    w->root = root;
+    if (!root)
+        cache_insert(c, st.st_ino, path);
+
+    dir = opendir(path);
+    if (!dir)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        char child[4096];
+
+        if (de->d_type != DT_DIR || de->d_name[0] == '.')
+            continue;
+        if (root && strncmp(de->d_name, "kubepods", 8) != 0)
+            continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) < (int)sizeof(child))
+            add_cgroup(c, child, false);
+    }
+    closedir(dir);
+}
+
+struct cgroup_cache *cgroup_cache_new(const char *root, cgroup_removed_fn removed,
+                                      void *ctx) {
+    struct cgroup_cache *c = calloc(1, sizeof(*c));
+
+    if (!c)
+        return NULL;
+    c->removed = removed;
+    c->ctx = ctx;
+    c->root = strdup(root);
+    c->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (c->fd < 0 || !c->root) {
+        int err = errno;
+        cgroup_cache_free(c);
+        errno = err;
+        return NULL;
+    }
+    add_cgroup(c, root, true);
+    return c;
+}
+
+void cgroup_cache_free(struct cgroup_cache *c) {
+    if (!c)
+        return;
+    if (c->fd >= 0)
+        close(c->fd);
+    for (int i = 0; i < c->watch_cap; i++)
+        free(c->watches[i].path);
+    free(c->watches);
+    free(c->root);
+    free(c);
+}
+
+int cgroup_cache_refresh(struct cgroup_cache *c) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(c->fd, buf, sizeof(buf));
+        if (len < 0)
+            return errno == EAGAIN ? 0 : -errno;
+
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            struct cgroup_watch *w = ev->wd >= 0 && ev->wd < c->watch_cap ?
+                                     &c->watches[ev->wd] : NULL;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Lost events: pick up new cgroups again; removals that
+                // were lost age out of the BPF LRU map instead
+                add_cgroup(c, c->root, true);
+                continue;
+            }
+            if (!w || !w->path)
+                continue;
+
+            if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) && ev->len) {
+                char child[4096];
+                if (w->root && strncmp(ev->name, "kubepods", 8) != 0)
+                    continue;
+                if (snprintf(child, sizeof(child), "%s/%s", w->path, ev->name) <
+                    (int)sizeof(child))
+                    add_cgroup(c, child, false);
+            } else if (ev->mask & IN_IGNORED) {
+                // The directory is gone and the kernel dropped its watch
+                cache_remove(c, w->id);
+                free(w->path);
+                w->path = NULL;
+            }
+        }
+    }
+}
+
+int cgroup_cache_pod(const struct cgroup_cache *c, uint64_t cgroup_id) {
+    unsigned int i = table_find(c, cgroup_id);
+
+    return c->table[i].id ? c->table[i].pod : -1;
+}
+
+const char *cgroup_cache_pod_uid(const struct cgroup_cache *c, int pod) {
+    return c->pods[pod].uid;
+}
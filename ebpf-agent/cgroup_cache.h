@@ -0,0 +1,33 @@
+// Resolve cgroup v2 ids to Kubernetes pod UIDs
+
+#ifndef __CGROUP_CACHE_H
+#define __CGROUP_CACHE_H
+
+#include <stdint.h>
+
+// Pods tracked at the same time; further pods resolve to no pod
+#define CGROUP_CACHE_MAX_PODS 512
+#define POD_UID_LEN 37   // 36 characters and NUL
+
+struct cgroup_cache;
+
+// Called for every cgroup directory that disappeared, with its id
+typedef void (*cgroup_removed_fn)(uint64_t cgroup_id, void *ctx);
+
+// Scan the kubepods cgroups below root once and watch them with inotify.
+// Returns NULL with errno set on failure.
+struct cgroup_cache *cgroup_cache_new(const char *root, cgroup_removed_fn removed,
+                                      void *ctx);
+void cgroup_cache_free(struct cgroup_cache *c);
+
+// Apply the pending inotify events without blocking; cheap when nothing
+// changed
+int cgroup_cache_refresh(struct cgroup_cache *c);
+
+// Pod index (below CGROUP_CACHE_MAX_PODS) of a cgroup or -1 when the cgroup
+// does not belong to a known pod. Indexes stay stable while the pod has
+// cgroups and may be reused afterwards.
+int cgroup_cache_pod(const struct cgroup_cache *c, uint64_t cgroup_id);
+const char *cgroup_cache_pod_uid(const struct cgroup_cache *c, int pod);
+
+#endif /* __CGROUP_CACHE_H */
@@ -0,0 +1,232 @@
+// Userspace runtime shared by ebpf-agent and simple_agent
+//
+// The poll strategies trade CPU for latency. epoll sleeps until the BPF
+// side wakes the consumer, which costs a wakeup per record but no CPU
+// while idle. Busy polling reads the ring buffer in a loop and sees a
+// record as soon as it is committed, at the price of a whole core.
+// Coalescing drains every period_us and never sleeps in the kernel on the
+// ring buffer, so the producers can skip wakeups altogether and a burst
+// of records costs one drain.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "collector.h"
+
+const char *const poll_mode_names[NR_POLL_MODES] = {
+    [POLL_EPOLL] = "epoll",
+    [POLL_BUSY] = "busy",
+    [POLL_COALESCE] = "coalesce",
+};
+
+int poll_mode_parse(const char *name) {
+    for (int i = 0; i < NR_POLL_MODES; i++) {
+        if (strcmp(name, poll_mode_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#endif
+}
+
+static int poll_epoll(struct ring_buffer *rb, const struct poll_policy *p, atomic_bool *stop,
+                      void (*on_drain)(void *ctx), void *ctx) {
+    while (!atomic_load(stop)) {
+        int err = ring_buffer__poll(rb, p->timeout_ms);
+
+        if (err == 0 && p->consume_on_timeout)
+            err = ring_buffer__consume(rb);
+        if (err < 0 && err != -EINTR)
+            return err;
+        if (on_drain)
+            on_drain(ctx);
+    }
+    return 0;
+}
+
+static int poll_busy(struct ring_buffer *rb, const struct poll_policy *p, atomic_bool *stop,
+                     void (*on_drain)(void *ctx), void *ctx) {
+    if (p->busy_cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(p->busy_cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            return -err;
+    }
+    while (!atomic_load_explicit(stop, memory_order_relaxed)) {
+        int n = ring_buffer__consume(rb);
+
+        if (n < 0)
+            return n;
+        if (n == 0) {
+            cpu_relax();
+            continue;
+        }
+        if (on_drain)
+            on_drain(ctx);
+    }
+    return 0;
+}
+
+static int poll_coalesce(struct ring_buffer *rb, const struct poll_policy *p, atomic_bool *stop,
+                         void (*on_drain)(void *ctx), void *ctx) {
+    const long period_ns = (p->period_us ? p->period_us : 1000) * 1000L;
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!atomic_load(stop)) {
+        struct timespec now;
+
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        // After a stall, start over from now instead of draining back to back
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+            next = now;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        int err = ring_buffer__consume(rb);
+        if (err < 0)
+            return err;
+        if (on_drain)
+            on_drain(ctx);
+    }
+    return 0;
+}
+
+int collector_poll(struct ring_buffer *rb, const struct poll_policy *p, atomic_bool *stop,
+                   void (*on_drain)(void *ctx), void *ctx) {
+    switch (p->mode) {
+        case POLL_BUSY:
+            return poll_busy(rb, p, stop, on_drain, ctx);
+        case POLL_COALESCE:
+            return poll_coalesce(rb, p, stop, on_drain, ctx);
+        default:
+            return poll_epoll(rb, p, stop, on_drain, ctx);
+    }
+}
+
+int cpu_list_parse(const char *list, cpu_set_t *set) {
+    const char *s = list;
+
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        long first = strtol(s, &end, 10), last = first;
+
+        if (end == s || first < 0)
+            return -EINVAL;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                return -EINVAL;
+        }
+        if (last >= CPU_SETSIZE || (*end && *end != ','))
+            return -EINVAL;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        s = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+int thread_policy_apply(const struct thread_policy *p) {
+    if (p->set_cpus) {
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(p->cpus), &p->cpus);
+        if (err)
+            return -err;
+    }
+    if (p->sched_idle) {
+        struct sched_param param = { .sched_priority = 0 };
+        int err = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+        if (err)
+            return -err;
+    }
+    // The nice value is per thread on Linux
+    if (p->nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), p->nice))
+        return -errno;
+    return 0;
+}
+
+static atomic_bool *stop_flag;
+
+static void stop_handler(int sig) {
+    atomic_store(stop_flag, true);
+}
+
+void collector_handle_signals(atomic_bool *stop) {
+    stop_flag = stop;
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+}
+
+int collector_bump_memlock(void) {
+    struct rlimit rlim = { .rlim_cur = RLIM_INFINITY, .rlim_max = RLIM_INFINITY };
+
+    return setrlimit(RLIMIT_MEMLOCK, &rlim) ? -errno : 0;
+}
+
+int collector_object_open(struct collector_object *co, const char *path) {
+    struct bpf_program *prog;
+    int nr = 0, err;
+
+    memset(co, 0, sizeof(*co));
+    co->obj = bpf_object__open_file(path, NULL);
+    if (!co->obj)
+        return -errno;
+    err = bpf_object__load(co->obj);
+    if (err)
+        goto fail;
+
+    bpf_object__for_each_program(prog, co->obj)
+        nr++;
+    co->links = calloc(nr ? nr : 1, sizeof(*co->links));
+    if (!co->links) {
+        err = -ENOMEM;
+        goto fail;
+    }
+    bpf_object__for_each_program(prog, co->obj) {
+        struct bpf_link *link;
+
+        if (!bpf_program__autoload(prog))
+            continue;
+        link = bpf_program__attach(prog);
+        if (!link) {
+            err = -errno;
+            goto fail;
+        }
+        co->links[co->nr_links++] = link;
+    }
+    return 0;
+
+fail:
+    collector_object_close(co);
+    return err;
+}
+
+void collector_object_close(struct collector_object *co) {
+    for (int i = 0; i < co->nr_links; i++)
+        bpf_link__destroy(co->links[i]);
+    free(co->links);
+    bpf_object__close(co->obj);
+    memset(co, 0, sizeof(*co));
+}
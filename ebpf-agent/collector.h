@@ -0,0 +1,76 @@
+// Userspace runtime shared by ebpf-agent and simple_agent: signals,
+// memlock, loading objects without a skeleton, ring buffer poll strategies
+// and the scheduling policy of the collector threads
+
+#ifndef __COLLECTOR_H
+#define __COLLECTOR_H
+
+#include <sched.h>    // cpu_set_t needs _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+
+// How the consumer waits for ring buffer records
+enum poll_mode {
+    POLL_EPOLL,       // sleep in epoll until the kernel wakes the consumer
+    POLL_BUSY,        // spin on the ring buffer; for lab runs on a dedicated core
+    POLL_COALESCE,    // drain on a fixed period, without wakeups
+    NR_POLL_MODES,
+};
+
+extern const char *const poll_mode_names[NR_POLL_MODES];
+
+// Mode of a name in poll_mode_names, or -1
+int poll_mode_parse(const char *name);
+
+struct poll_policy {
+    enum poll_mode mode;
+    int timeout_ms;            // POLL_EPOLL: longest sleep, bounds the stop latency
+    bool consume_on_timeout;   // POLL_EPOLL: also drain records sent without a wakeup
+    __u32 period_us;           // POLL_COALESCE: drain period
+    int busy_cpu;              // POLL_BUSY: core to pin the consumer to, -1 to keep
+};
+
+// Consume rb as the policy says until *stop is set. on_drain, if not NULL,
+// runs after every drain attempt. Returns 0 once stopped, or the negative
+// error that ended consumption.
+int collector_poll(struct ring_buffer *rb, const struct poll_policy *p, atomic_bool *stop,
+                   void (*on_drain)(void *ctx), void *ctx);
+
+// CPU affinity, scheduling class and nice value of the calling thread.
+// Linux copies all three into threads created afterwards, so applying it
+// before starting the collector threads covers the whole agent.
+struct thread_policy {
+    cpu_set_t cpus;
+    bool set_cpus;
+    bool sched_idle;           // SCHED_IDLE: run only when a core has nothing else to do
+    int nice;                  // 0 keeps the current value
+};
+
+// Parse a CPU list such as "0-3,8" into set. Returns 0 or -EINVAL.
+int cpu_list_parse(const char *list, cpu_set_t *set);
+
+// Returns 0 or a negative errno
+int thread_policy_apply(const struct thread_policy *p);
+
+// Set *stop on SIGINT and SIGTERM
+void collector_handle_signals(atomic_bool *stop);
+
+// Lift RLIMIT_MEMLOCK, which bounds BPF memory before kernel 5.11.
+// Returns 0 or a negative errno.
+int collector_bump_memlock(void);
+
+// A BPF object loaded from a file with every program attached
+struct collector_object {
+    struct bpf_object *obj;
+    struct bpf_link **links;
+    int nr_links;
+};
+
+// Open, load and attach path. Returns 0 or a negative error; co is left
+// empty on failure.
+int collector_object_open(struct collector_object *co, const char *path);
+void collector_object_close(struct collector_object *co);
+
+#endif /* __COLLECTOR_H */
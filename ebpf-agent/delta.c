@@ -0,0 +1,149 @@
+// Per-key interval deltas of cumulative BPF counters and histograms
+//
+// The BPF maps only ever count up, so rates and windowed percentiles come
+// from subtracting the values read one cycle earlier. Two generations of
+// an open-addressing table hold the values: a cycle looks keys up in the
+// previous generation and appends them to the current one, and swapping
+// generations drops whatever was not seen again, without deletions.
+
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+struct delta_gen {
+    uint32_t *index;        // table slot -> entry + 1, 0 marks a free slot
+    char *entries;          // key followed by value, entry_size apart
+    unsigned int nr;
+};
+
+struct delta_set {
+    size_t key_size;
+    size_t value_size;
+    size_t entry_size;
+    int nr_counters;
+    int nr_hists;
+    unsigned int max_keys;
+    unsigned int mask;      // table size - 1; at most half full
+    struct delta_gen gen[2];
+    int cur;
+    uint64_t last_ns;
+};
+
+// FNV-1a
+static uint32_t key_hash(const void *key, size_t size) {
+    const unsigned char *p = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h ^ (h >> 32);
+}
+
+static char *gen_entry(const struct delta_set *s, const struct delta_gen *g, unsigned int i) {
+    return g->entries + (size_t)i * s->entry_size;
+}
+
+// Table slot holding key, or the free slot where it would go
+static unsigned int gen_find(const struct delta_set *s, const struct delta_gen *g,
+                             const void *key, uint32_t hash) {
+    unsigned int i = hash & s->mask;
+
+    while (g->index[i] && memcmp(gen_entry(s, g, g->index[i] - 1), key, s->key_size) != 0)
+        i = (i + 1) & s->mask;
+    return i;
+}
+
+struct delta_set *delta_set_new(size_t key_size, unsigned int max_keys,
+                                int nr_counters, int nr_hists) {
+    struct delta_set *s = calloc(1, sizeof(*s));
+    unsigned int size = 2;
+
+    if (!s)
+        return NULL;
+    while (size < max_keys * 2)
+        size *= 2;
+    s->key_size = key_size;
+    s->value_size = nr_counters * sizeof(__u64) + nr_hists * sizeof(struct hist);
+    // Keep the counters of every entry 8-byte aligned
+    s->entry_size = (key_size + 7) / 8 * 8 + s->value_size;
+    s->nr_counters = nr_counters;
+    s->nr_hists = nr_hists;
+    s->max_keys = max_keys;
+    s->mask = size - 1;
+    for (int g = 0; g < 2; g++) {
+        s->gen[g].index = calloc(size, sizeof(uint32_t));
+        s->gen[g].entries = malloc((size_t)max_keys * s->entry_size);
+        if (!s->gen[g].index || !s->gen[g].entries) {
+            delta_set_free(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+void delta_set_free(struct delta_set *s) {
+    if (!s)
+        return;
+    for (int g = 0; g < 2; g++) {
+        free(s->gen[g].index);
+        free(s->gen[g].entries);
+    }
+    free(s);
+}
+
+double delta_begin(struct delta_set *s, uint64_t now_ns) {
+    double interval = s->last_ns ? (now_ns - s->last_ns) / 1e9 : 0.0;
+    struct delta_gen *g;
+
+    // The cycle that just ended becomes the previous one
+    s->cur = !s->cur;
+    g = &s->gen[s->cur];
+    memset(g->index, 0, (s->mask + 1) * sizeof(uint32_t));
+    g->nr = 0;
+    s->last_ns = now_ns;
+    return interval;
+}
+
+static void value_sub(const struct delta_set *s, const void *cur, const void *prev,
+                      void *delta) {
+    const __u64 *cc = cur, *pc = prev;
+    __u64 *dc = delta;
+    const struct hist *ch = (const struct hist *)(cc + s->nr_counters);
+    const struct hist *ph = (const struct hist *)(pc + s->nr_counters);
+    struct hist *dh = (struct hist *)(dc + s->nr_counters);
+
+    for (int i = 0; i < s->nr_counters; i++)
+        dc[i] = cc[i] >= pc[i] ? cc[i] - pc[i] : cc[i];
+
+    for (int h = 0; h < s->nr_hists; h++) {
+        bool reset = false;
+
+        for (int j = 0; j < MAX_SLOTS; j++) {
+            reset |= ch[h].slots[j] < ph[h].slots[j];
+            dh[h].slots[j] = ch[h].slots[j] - ph[h].slots[j];
+        }
+        if (reset)
+            dh[h] = ch[h];
+    }
+}
+
+bool delta_update(struct delta_set *s, const void *key, const void *cur, void *delta) {
+    size_t value_off = s->entry_size - s->value_size;
+    struct delta_gen *g = &s->gen[s->cur], *prev = &s->gen[!s->cur];
+    uint32_t hash = key_hash(key, s->key_size);
+    unsigned int i = gen_find(s, prev, key, hash);
+
+    if (prev->index[i])
+        value_sub(s, cur, gen_entry(s, prev, prev->index[i] - 1) + value_off, delta);
+    else
+        memcpy(delta, cur, s->value_size);
+
+    if (g->nr == s->max_keys)
+        return false;
+    i = gen_find(s, g, key, hash);
+    if (!g->index[i])
+        g->index[i] = ++g->nr;
+    memcpy(gen_entry(s, g, g->index[i] - 1), key, s->key_size);
+    memcpy(gen_entry(s, g, g->index[i] - 1) + value_off, cur, s->value_size);
+    return true;
+}
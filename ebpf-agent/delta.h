@@ -0,0 +1,34 @@
+// Per-key interval deltas of cumulative BPF counters and histograms
+
+#ifndef __DELTA_H
+#define __DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/types.h>
+#include "telemetry.h"
+
+struct delta_set;
+
+// Create a set for up to max_keys keys of key_size bytes. Each key tracks
+// a value of nr_counters __u64 counters followed by nr_hists struct hist,
+// so callers pass a struct with exactly that layout. All memory is
+// allocated here; cycles never allocate. Returns NULL on failure.
+struct delta_set *delta_set_new(size_t key_size, unsigned int max_keys,
+                                int nr_counters, int nr_hists);
+void delta_set_free(struct delta_set *s);
+
+// Start a cycle at now_ns (CLOCK_MONOTONIC). Returns the seconds since the
+// previous cycle, or 0 for the first one. Keys not updated during the
+// previous cycle are forgotten.
+double delta_begin(struct delta_set *s, uint64_t now_ns);
+
+// Store cur as the value of key and write cur minus the value of the
+// previous cycle into delta. A key without a previous value, or whose
+// counter or histogram went backwards because its map entry was recreated,
+// yields cur itself. Returns false when the cycle is full and key was not
+// stored; delta is still filled in.
+bool delta_update(struct delta_set *s, const void *key, const void *cur, void *delta);
+
+#endif /* __DELTA_H */
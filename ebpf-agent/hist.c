@@ -0,0 +1,49 @@
+// Userspace side of the log-linear histograms of telemetry.h
+//
+// The agent and history_query compute their percentiles here so both read
+// the same slot boundaries that hist_slot() writes.
+
+#include "hist.h"
+
+double hist_slot_lower(int slot) {
+    int group = slot >> HIST_SUB_BITS;
+    int sub = slot & (HIST_SUB_BUCKETS - 1);
+
+    if (group == 0)
+        return sub;
+    return (double)((__u64)(HIST_SUB_BUCKETS + sub) << (group - 1));
+}
+
+double hist_slot_width(int slot) {
+    int group = slot >> HIST_SUB_BITS;
+
+    return group == 0 ? 1.0 : (double)(1ULL << (group - 1));
+}
+
+double hist_percentile_slots(const __u64 *slots, double percentile) {
+    __u64 total = 0, running = 0;
+    double target;
+
+    for (int i = 0; i < MAX_SLOTS; i++)
+        total += slots[i];
+    if (total == 0)
+        return 0.0;
+
+    target = total * percentile / 100.0;
+    for (int i = 0; i < MAX_SLOTS; i++) {
+        __u64 count = slots[i];
+
+        if (count && running + count >= target)
+            return hist_slot_lower(i) + (target - running) / count * hist_slot_width(i);
+        running += count;
+    }
+    return 0.0;
+}
+
+double hist_percentile(const struct hist *h, double percentile) {
+    __u64 slots[MAX_SLOTS];
+
+    for (int i = 0; i < MAX_SLOTS; i++)
+        slots[i] = h->slots[i];
+    return hist_percentile_slots(slots, percentile);
+}
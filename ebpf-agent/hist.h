@@ -0,0 +1,21 @@
+// Userspace side of the log-linear histograms of telemetry.h
+
+#ifndef __HIST_H
+#define __HIST_H
+
+#include <linux/types.h>
+#include "telemetry.h"
+
+// Smallest value of a histogram slot and the slot's width (inverse of
+// hist_slot)
+double hist_slot_lower(int slot);
+double hist_slot_width(int slot);
+
+// Percentile of MAX_SLOTS slot counts, interpolated linearly within the
+// slot that holds the target rank; 0 for an empty histogram
+double hist_percentile_slots(const __u64 *slots, double percentile);
+
+// hist_percentile_slots of a struct hist
+double hist_percentile(const struct hist *h, double percentile);
+
+#endif /* __HIST_H */
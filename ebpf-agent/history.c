@@ -0,0 +1,162 @@
+// Fixed-record ring file of per-interval node telemetry
+//
+// The file is a one-page header followed by nr_records fixed-size records,
+// mapped shared by the agent and read-only by readers. The agent is the
+// only writer and never blocks on readers: each record carries a sequence
+// number that is cleared while it is rewritten and set once it is
+// complete, so a reader that raced the writer just sees a missing record.
+// Nothing is parsed; a window is a range of write numbers.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+_Static_assert(sizeof(struct history_header) <= HISTORY_HEADER_SIZE, "history header too big");
+_Static_assert(sizeof(struct history_record) % 8 == 0, "history_record must be 8-byte aligned");
+
+struct history {
+    struct history_header *hdr;
+    struct history_record *records;
+    size_t size;
+};
+
+static size_t history_size(__u32 nr_records) {
+    return HISTORY_HEADER_SIZE + (size_t)nr_records * sizeof(struct history_record);
+}
+
+static bool header_matches(const struct history_header *hdr, __u32 nr_records) {
+    return hdr->magic == HISTORY_MAGIC && hdr->version == HISTORY_VERSION &&
+           hdr->record_size == sizeof(struct history_record) &&
+           (!nr_records || hdr->nr_records == nr_records);
+}
+
+static struct history *history_map(int fd, size_t size, int prot) {
+    struct history *h = calloc(1, sizeof(*h));
+    void *base;
+
+    if (!h)
+        return NULL;
+    base = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(h);
+        return NULL;
+    }
+    h->hdr = base;
+    h->records = (struct history_record *)((char *)base + HISTORY_HEADER_SIZE);
+    h->size = size;
+    return h;
+}
+
+struct history *history_create(const char *path, __u32 nr_records, __u64 interval_ns,
+                               const char *node) {
+    size_t size = history_size(nr_records);
+    struct history_header old = {0};
+    struct history *h;
+    struct stat st;
+    int fd, saved;
+
+    if (!nr_records) {
+        errno = EINVAL;
+        return NULL;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st))
+        goto fail;
+    if ((size_t)st.st_size == size && pread(fd, &old, sizeof(old), 0) != sizeof(old))
+        memset(&old, 0, sizeof(old));
+
+    // Anything else starts over from an empty (sparse) file
+    if ((size_t)st.st_size != size || !header_matches(&old, nr_records)) {
+        if (ftruncate(fd, 0) || ftruncate(fd, size))
+            goto fail;
+    }
+    h = history_map(fd, size, PROT_READ | PROT_WRITE);
+    if (!h)
+        goto fail;
+    close(fd);
+
+    if (!header_matches(h->hdr, nr_records)) {
+        h->hdr->magic = HISTORY_MAGIC;
+        h->hdr->version = HISTORY_VERSION;
+        h->hdr->record_size = sizeof(struct history_record);
+        h->hdr->nr_records = nr_records;
+        h->hdr->head = 0;
+    }
+    h->hdr->interval_ns = interval_ns;
+    snprintf(h->hdr->node, sizeof(h->hdr->node), "%s", node);
+    return h;
+
+fail:
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return NULL;
+}
+
+struct history *history_open(const char *path) {
+    struct history_header hdr;
+    struct history *h = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        !header_matches(&hdr, 0) || (size_t)st.st_size < history_size(hdr.nr_records))
+        errno = EINVAL;
+    else
+        h = history_map(fd, history_size(hdr.nr_records), PROT_READ);
+    close(fd);
+    return h;
+}
+
+void history_close(struct history *h) {
+    if (!h)
+        return;
+    munmap(h->hdr, h->size);
+    free(h);
+}
+
+const struct history_header *history_header(const struct history *h) {
+    return h->hdr;
+}
+
+void history_append(struct history *h, const struct history_record *rec) {
+    __u64 n = h->hdr->head;
+    struct history_record *slot = &h->records[n % h->hdr->nr_records];
+    const size_t off = offsetof(struct history_record, timestamp_ns);
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + off, (const char *)rec + off, sizeof(*rec) - off);
+    __atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->hdr->head, n + 1, __ATOMIC_RELEASE);
+}
+
+bool history_read(const struct history *h, __u64 n, struct history_record *rec) {
+    __u64 head = __atomic_load_n(&h->hdr->head, __ATOMIC_ACQUIRE);
+    const struct history_record *slot = &h->records[n % h->hdr->nr_records];
+    __u64 seq;
+
+    if (n >= head || head - n > h->hdr->nr_records)
+        return false;
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != n + 1)
+        return false;
+    memcpy(rec, slot, sizeof(*rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+void history_hist_add(struct history_hist *sum, const struct hist *h) {
+    for (int i = 0; i < MAX_SLOTS; i++)
+        sum->slots[i] += h->slots[i];
+}
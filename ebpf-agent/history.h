@@ -0,0 +1,69 @@
+// Fixed-record ring file of per-interval node telemetry (--history)
+
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/types.h>
+#include "telemetry.h"
+
+#define HISTORY_MAGIC 0x48465045          // "EPFH"
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER_SIZE 4096          // records start page aligned
+#define HISTORY_DEFAULT_RECORDS 86400     // 24 h at 1 s
+
+// First page of the file
+struct history_header {
+    __u32 magic;
+    __u32 version;
+    __u32 record_size;     // sizeof(struct history_record)
+    __u32 nr_records;      // ring capacity
+    __u64 head;            // records ever written; the next goes to head % nr_records
+    __u64 interval_ns;     // nominal collection interval
+    char node[64];
+};
+
+// One collection interval. Histograms hold that interval's samples only,
+// so any window is the sum of its records.
+struct history_record {
+    __u64 seq;             // write number + 1; 0 while the record is rewritten
+    __u64 timestamp_ns;    // CLOCK_REALTIME at the end of the interval
+    __u64 interval_ns;     // 0 for the first record after the agent started
+    __u64 retrans;         // TCP retransmissions
+    __u64 drops;           // dropped packets, all reasons
+    double cpu_utilization;  // percent
+    struct hist rtt;       // microseconds
+    struct hist runqlat;   // microseconds
+};
+
+// Histograms summed over a window; wide enough for any number of records
+struct history_hist {
+    __u64 slots[MAX_SLOTS];
+};
+
+struct history;
+
+// Map path for appending, creating or resizing it as needed. A file with
+// the same layout and capacity is continued where it stopped. Returns
+// NULL with errno set on failure.
+struct history *history_create(const char *path, __u32 nr_records, __u64 interval_ns,
+                               const char *node);
+
+// Map an existing file read-only. Returns NULL with errno set on failure.
+struct history *history_open(const char *path);
+void history_close(struct history *h);
+
+const struct history_header *history_header(const struct history *h);
+
+// Write rec (its seq is filled in) as the newest record
+void history_append(struct history *h, const struct history_record *rec);
+
+// Copy write number n into rec. Returns false when it was overwritten,
+// never written, or is being rewritten by the agent right now.
+bool history_read(const struct history *h, __u64 n, struct history_record *rec);
+
+void history_hist_add(struct history_hist *sum, const struct hist *h);
+
+#endif /* __HISTORY_H */
@@ -0,0 +1,295 @@
+// history_query - percentiles over any window of an agent history file
+//
+// Maps the ring file written by `ebpf-agent --history` read-only and sums
+// the per-interval histograms and counters of the records inside the
+// window, optionally split into fixed steps. It runs next to a live agent:
+// records being rewritten at that moment are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "hist.h"
+#include "history.h"
+
+#define MAX_PERCENTILES 8
+
+static struct env {
+    const char *since;
+    const char *until;
+    __u64 step_ns;
+    double percentiles[MAX_PERCENTILES];
+    int nr_percentiles;
+    bool json;
+} env = {
+    .percentiles = { 50, 90, 99 },
+    .nr_percentiles = 3,
+};
+
+static const char usage[] =
+    "Usage: history_query [OPTIONS] FILE\n"
+    "Print RTT and runqueue latency percentiles, retransmits, drops and CPU\n"
+    "utilization over a window of a history file written by ebpf-agent --history.\n"
+    "\n"
+    "  -s, --since=TIME          start of the window (default: oldest record)\n"
+    "  -u, --until=TIME          end of the window (default: now)\n"
+    "  -w, --step=DURATION       one line per step instead of one for the window\n"
+    "  -p, --percentiles=LIST    comma separated percentiles (default 50,90,99)\n"
+    "  -j, --json                print JSON\n"
+    "  -h, --help                show this help\n"
+    "\n"
+    "TIME is a duration before now (90s, 15m, 2h, 1d) or @UNIX_SECONDS.\n";
+
+// "90", "90s", "15m", "2h" or "1d" in nanoseconds
+static __u64 parse_duration(const char *arg, const char *name) {
+    static const char units[] = "smhd";
+    static const double unit_secs[] = { 1, 60, 3600, 86400 };
+    char *end;
+    double val = strtod(arg, &end);
+    double mult = 1;
+    const char *unit = end != arg && *end ? strchr(units, *end) : NULL;
+
+    if (unit) {
+        mult = unit_secs[unit - units];
+        end++;
+    }
+    if (end == arg || *end != '\0' || val < 0) {
+        fprintf(stderr, "Invalid %s: %s\n", name, arg);
+        exit(1);
+    }
+    return val * mult * 1e9;
+}
+
+// Realtime nanoseconds of a TIME argument
+static __u64 parse_time(const char *arg, const char *name, __u64 now_ns) {
+    if (arg[0] == '@') {
+        char *end;
+        double secs = strtod(arg + 1, &end);
+
+        if (end == arg + 1 || *end != '\0' || secs < 0) {
+            fprintf(stderr, "Invalid %s: %s\n", name, arg);
+            exit(1);
+        }
+        return secs * 1e9;
+    }
+    __u64 ago = parse_duration(arg, name);
+    return ago < now_ns ? now_ns - ago : 0;
+}
+
+static void parse_percentiles(const char *arg) {
+    const char *p = arg;
+
+    env.nr_percentiles = 0;
+    while (*p) {
+        char *end;
+        double val = strtod(p, &end);
+
+        if (end == p || val <= 0 || val > 100 || env.nr_percentiles == MAX_PERCENTILES ||
+            (*end && *end != ',')) {
+            fprintf(stderr, "Invalid percentiles: %s (up to %d in (0, 100])\n",
+                    arg, MAX_PERCENTILES);
+            exit(1);
+        }
+        env.percentiles[env.nr_percentiles++] = val;
+        p = *end ? end + 1 : end;
+    }
+}
+
+static const char *parse_args(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "since",       required_argument, NULL, 's' },
+        { "until",       required_argument, NULL, 'u' },
+        { "step",        required_argument, NULL, 'w' },
+        { "percentiles", required_argument, NULL, 'p' },
+        { "json",        no_argument,       NULL, 'j' },
+        { "help",        no_argument,       NULL, 'h' },
+        {},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:u:w:p:jh", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                env.since = optarg;
+                break;
+            case 'u':
+                env.until = optarg;
+                break;
+            case 'w':
+                env.step_ns = parse_duration(optarg, "step");
+                if (!env.step_ns) {
+                    fprintf(stderr, "Invalid step: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                parse_percentiles(optarg);
+                break;
+            case 'j':
+                env.json = true;
+                break;
+            case 'h':
+                printf("%s", usage);
+                exit(0);
+            default:
+                fprintf(stderr, "%s", usage);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "%s", usage);
+        exit(1);
+    }
+    return argv[optind];
+}
+
+struct window {
+    __u64 start_ns;
+    __u64 records;
+    __u64 retrans;
+    __u64 drops;
+    double cpu_sum;
+    struct history_hist rtt;
+    struct history_hist runqlat;
+};
+
+static void format_time(char *buf, size_t size, __u64 ns) {
+    time_t secs = ns / 1000000000ULL;
+    struct tm tm;
+
+    gmtime_r(&secs, &tm);
+    strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void print_text(const struct window *w, int nr_windows) {
+    printf("%-20s %8s %10s %10s %6s", "start", "records", "retrans", "drops", "cpu%");
+    for (int p = 0; p < env.nr_percentiles; p++)
+        printf("  rtt_p%-5g", env.percentiles[p]);
+    for (int p = 0; p < env.nr_percentiles; p++)
+        printf("  runq_p%-4g", env.percentiles[p]);
+    printf("\n");
+
+    for (int i = 0; i < nr_windows; i++) {
+        char start[32];
+
+        if (!w[i].records && nr_windows > 1)
+            continue;
+        format_time(start, sizeof(start), w[i].start_ns);
+        printf("%-20s %8llu %10llu %10llu %6.1f", start, (unsigned long long)w[i].records,
+               (unsigned long long)w[i].retrans, (unsigned long long)w[i].drops,
+               w[i].records ? w[i].cpu_sum / w[i].records : 0.0);
+        // Milliseconds, like the Prometheus gauges
+        for (int p = 0; p < env.nr_percentiles; p++)
+            printf("  %10.3f", hist_percentile_slots(w[i].rtt.slots, env.percentiles[p]) / 1000.0);
+        for (int p = 0; p < env.nr_percentiles; p++)
+            printf("  %10.3f",
+                   hist_percentile_slots(w[i].runqlat.slots, env.percentiles[p]) / 1000.0);
+        printf("\n");
+    }
+}
+
+static void print_json_percentiles(const char *name, const struct history_hist *h) {
+    printf(", \"%s\": {", name);
+    for (int p = 0; p < env.nr_percentiles; p++)
+        printf("%s\"p%g\": %.3f", p ? ", " : "", env.percentiles[p],
+               hist_percentile_slots(h->slots, env.percentiles[p]) / 1000.0);
+    printf("}");
+}
+
+static void print_json(const char *node, const struct window *w, int nr_windows,
+                       __u64 step_ns, __u64 until_ns) {
+    bool first = true;
+
+    printf("{\"node\": \"%s\", \"windows\": [", node);
+    for (int i = 0; i < nr_windows; i++) {
+        if (!w[i].records && nr_windows > 1)
+            continue;
+        printf("%s\n  {\"start_ns\": %llu, \"end_ns\": %llu, \"records\": %llu, "
+               "\"retrans\": %llu, \"drops\": %llu, \"cpu_utilization\": %.2f",
+               first ? "" : ",", (unsigned long long)w[i].start_ns,
+               (unsigned long long)(until_ns - w[i].start_ns > step_ns ? w[i].start_ns + step_ns : until_ns),
+               (unsigned long long)w[i].records,
+               (unsigned long long)w[i].retrans, (unsigned long long)w[i].drops,
+               w[i].records ? w[i].cpu_sum / w[i].records : 0.0);
+        print_json_percentiles("rtt_ms", &w[i].rtt);
+        print_json_percentiles("runqlat_ms", &w[i].runqlat);
+        printf("}");
+        first = false;
+    }
+    printf("\n]}\n");
+}
+
+int main(int argc, char **argv) {
+    const char *path = parse_args(argc, argv);
+    struct history *h = history_open(path);
+    struct history_record rec;
+    struct timespec ts;
+
+    if (!h) {
+        fprintf(stderr, "Failed to open history file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    const struct history_header *hdr = history_header(h);
+    __u64 head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    __u64 first = head > hdr->nr_records ? head - hdr->nr_records : 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    __u64 now_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    __u64 until_ns = env.until ? parse_time(env.until, "until", now_ns) : now_ns;
+    __u64 since_ns = 0;
+
+    if (env.since) {
+        since_ns = parse_time(env.since, "since", now_ns);
+    } else {
+        // Oldest record still in the ring
+        for (__u64 n = first; n < head; n++) {
+            if (history_read(h, n, &rec)) {
+                since_ns = rec.timestamp_ns;
+                break;
+            }
+        }
+    }
+    if (until_ns <= since_ns) {
+        fprintf(stderr, "Empty window\n");
+        history_close(h);
+        return 1;
+    }
+
+    __u64 step_ns = env.step_ns ? env.step_ns : until_ns - since_ns + 1;
+    __u64 nr_windows = (until_ns - since_ns) / step_ns + 1;
+    struct window *w = calloc(nr_windows, sizeof(*w));
+    if (!w) {
+        fprintf(stderr, "Too many steps in the window\n");
+        history_close(h);
+        return 1;
+    }
+    for (__u64 i = 0; i < nr_windows; i++)
+        w[i].start_ns = since_ns + i * step_ns;
+
+    for (__u64 n = first; n < head; n++) {
+        if (!history_read(h, n, &rec) || rec.timestamp_ns < since_ns ||
+            rec.timestamp_ns >= until_ns)
+            continue;
+        struct window *win = &w[(rec.timestamp_ns - since_ns) / step_ns];
+        win->records++;
+        win->retrans += rec.retrans;
+        win->drops += rec.drops;
+        win->cpu_sum += rec.cpu_utilization;
+        history_hist_add(&win->rtt, &rec.rtt);
+        history_hist_add(&win->runqlat, &rec.runqlat);
+    }
+
+    if (env.json) {
+        print_json(hdr->node, w, nr_windows, step_ns, until_ns);
+    } else {
+        printf("# %s: %llu of %u records, %llu ms interval\n", hdr->node,
+               (unsigned long long)(head - first), hdr->nr_records,
+               (unsigned long long)(hdr->interval_ns / 1000000));
+        print_text(w, nr_windows);
+    }
+    free(w);
+    history_close(h);
+    return 0;
+}
@@ -0,0 +1,577 @@
+// overhead_bench - what the agent costs the workloads it observes
+//
+// Runs fixed workloads with the agent off, then once per agent mode, and
+// reports the CPU time each operation took: a loopback TCP ping-pong paced
+// at a fixed rate (one ACK per round trip), a sched_yield storm between two
+// threads sharing a CPU (one switch per yield) and UDP sends to a closed
+// port (one kfree_skb drop per send). The BPF programs run in softirq and
+// scheduler context that is not always charged to the workload, so the
+// cost is the node-wide busy time from /proc/stat minus the agent's own
+// CPU time, divided by the operations. Subtracting the "off" run gives the
+// ns each hook adds per ACK, switch and drop. Agent CPU and RSS are
+// sampled from /proc/<pid>. Results go to a JSON file as well.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+
+#define MSG_SIZE 64
+#define MAX_AGENT_ARGS 16
+
+// Agent configurations to compare; "off" runs without an agent and is
+// the baseline of the others
+struct mode {
+    const char *name;
+    const char *args;   // space separated agent options
+};
+
+static const struct mode all_modes[] = {
+    { "off",            NULL },
+    { "default",        "" },
+    { "shared-maps",    "--shared-maps" },
+    { "no-mmap-stats",  "--no-mmap-stats" },
+    { "aggregate-only", "--aggregate-only" },
+    { "batch-events",   "--batch-events" },
+    { "cgroup-metrics", "--cgroup-metrics" },
+    { "udp-latency",    "--udp-latency" },
+    { "poll-coalesce",  "--poll=coalesce" },
+    { "sched-idle",     "--sched-idle" },
+    { "fentry",         "--rtt-backend=fentry" },
+    { "kprobe",         "--rtt-backend=kprobe" },
+    { "tracepoint",     "--rtt-backend=tracepoint" },
+};
+#define NR_MODES (sizeof(all_modes) / sizeof(all_modes[0]))
+
+static struct env {
+    const char *agent;
+    const char *output;
+    const char *modes;
+    int duration;
+    int settle;
+    int tcp_rate;
+} env = {
+    .agent = "./ebpf-agent",
+    .output = "bench.json",
+    .duration = 5,
+    .settle = 3,
+    .tcp_rate = 20000,
+};
+
+static atomic_bool stop;
+
+static const char usage[] =
+    "Usage: overhead_bench [OPTIONS]\n"
+    "Measure the CPU time the agent adds per ACK, context switch and drop.\n"
+    "\n"
+    "  -A, --agent=PATH          agent binary (default ./ebpf-agent)\n"
+    "  -o, --output=FILE         write the results as JSON to FILE (default bench.json)\n"
+    "  -m, --modes=LIST          comma separated modes to run (default all)\n"
+    "  -d, --duration=SEC        seconds per workload (default 5)\n"
+    "  -s, --settle=SEC          seconds to let the agent start (default 3)\n"
+    "  -R, --tcp-rate=N          TCP round trips per second (default 20000)\n"
+    "  -h, --help                show this help\n"
+    "\n"
+    "Modes: off default shared-maps no-mmap-stats aggregate-only batch-events\n"
+    "       cgroup-metrics udp-latency poll-coalesce sched-idle fentry kprobe\n"
+    "       tracepoint\n";
+
+static int parse_positive(const char *arg, const char *name) {
+    char *end;
+    long val = strtol(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || val <= 0 || val > 1000000) {
+        fprintf(stderr, "Invalid %s: %s\n", name, arg);
+        exit(1);
+    }
+    return val;
+}
+
+static void parse_args(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "agent",    required_argument, NULL, 'A' },
+        { "output",   required_argument, NULL, 'o' },
+        { "modes",    required_argument, NULL, 'm' },
+        { "duration", required_argument, NULL, 'd' },
+        { "settle",   required_argument, NULL, 's' },
+        { "tcp-rate", required_argument, NULL, 'R' },
+        { "help",     no_argument,       NULL, 'h' },
+        {},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "A:o:m:d:s:R:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'A':
+                env.agent = optarg;
+                break;
+            case 'o':
+                env.output = optarg;
+                break;
+            case 'm':
+                env.modes = optarg;
+                break;
+            case 'd':
+                env.duration = parse_positive(optarg, "duration");
+                break;
+            case 's':
+                env.settle = parse_positive(optarg, "settle time");
+                break;
+            case 'R':
+                env.tcp_rate = parse_positive(optarg, "TCP rate");
+                break;
+            case 'h':
+                printf("%s", usage);
+                exit(0);
+            default:
+                fprintf(stderr, "%s", usage);
+                exit(1);
+        }
+    }
+}
+
+static bool mode_selected(const char *name) {
+    size_t len = strlen(name);
+
+    if (!env.modes)
+        return true;
+    for (const char *p = env.modes; *p;) {
+        const char *end = strchrnul(p, ',');
+        if ((size_t)(end - p) == len && strncmp(p, name, len) == 0)
+            return true;
+        p = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+static __u64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Busy time of all CPUs in ns: everything but idle and iowait
+static __u64 node_busy_ns(void) {
+    unsigned long long v[8] = {0};
+    FILE *f = fopen("/proc/stat", "r");
+
+    if (!f)
+        return 0;
+    if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8)
+        memset(v, 0, sizeof(v));
+    fclose(f);
+    return (v[0] + v[1] + v[2] + v[5] + v[6] + v[7]) * (1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+// utime + stime of a process in ns
+static __u64 proc_cpu_ns(pid_t pid) {
+    char path[64], buf[1024], *p;
+    unsigned long long utime, stime;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    // Fields 14 and 15, counted after the parenthesized comm
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                     &utime, &stime) != 2)
+        return 0;
+    return (utime + stime) * (1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+static long proc_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long rss = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+            break;
+    }
+    fclose(f);
+    return rss;
+}
+
+// Echo server side of the TCP ping-pong
+static void *tcp_echo(void *arg) {
+    int fd = *(int *)arg;
+    char buf[MSG_SIZE];
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0 || write(fd, buf, n) != n)
+            break;
+    }
+    return NULL;
+}
+
+// Paced round trips over a loopback TCP connection; every reply is an
+// ACK. The fixed rate keeps the event rate the same across modes.
+static __u64 run_tcp(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    __u64 period = 1000000000ULL / env.tcp_rate, next, n = 0;
+    int lfd, cfd, sfd, one = 1;
+    char buf[MSG_SIZE] = {0};
+    pthread_t thread;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(lfd, 1) || getsockname(lfd, (struct sockaddr *)&addr, &len)) {
+        perror("tcp listen");
+        return 0;
+    }
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (cfd < 0 || connect(cfd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("tcp connect");
+        close(lfd);
+        return 0;
+    }
+    sfd = accept(lfd, NULL, NULL);
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_create(&thread, NULL, tcp_echo, &sfd);
+
+    next = now_ns();
+    while (!atomic_load(&stop)) {
+        if (write(cfd, buf, sizeof(buf)) != sizeof(buf) ||
+            read(cfd, buf, sizeof(buf)) <= 0)
+            break;
+        n++;
+
+        next += period;
+        __u64 now = now_ns();
+        if (now < next) {
+            struct timespec ts = { next / 1000000000ULL, next % 1000000000ULL };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } else if (now - next > 100 * period) {
+            next = now;   // far behind: do not make up for it with a burst
+        }
+    }
+
+    shutdown(cfd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(sfd);
+    close(cfd);
+    close(lfd);
+    return n;
+}
+
+static atomic_ullong yields;
+
+static void *yield_loop(void *arg) {
+    __u64 n = 0;
+
+    while (!atomic_load(&stop)) {
+        sched_yield();
+        n++;
+    }
+    atomic_fetch_add(&yields, n);
+    return NULL;
+}
+
+// Two threads on one CPU yielding to each other; every yield switches to
+// the other thread, which was waiting on the runqueue
+static __u64 run_sched(void) {
+    pthread_t threads[2];
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    atomic_store(&yields, 0);
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, yield_loop, NULL);
+        pthread_setaffinity_np(threads[i], sizeof(set), &set);
+    }
+    for (int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    return atomic_load(&yields);
+}
+
+// UDP datagrams to a port nobody listens on are freed as NO_SOCKET drops
+static __u64 run_drop(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    char buf[MSG_SIZE] = {0};
+    __u64 n = 0;
+    int fd;
+
+    // Borrow a free port, then release it so it is guaranteed closed
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        getsockname(fd, (struct sockaddr *)&addr, &len)) {
+        perror("udp bind");
+        return 0;
+    }
+    close(fd);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    while (!atomic_load(&stop)) {
+        sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr));
+        n++;
+    }
+    close(fd);
+    return n;
+}
+
+struct workload {
+    const char *name;
+    const char *unit;   // what one operation triggers
+    __u64 (*run)(void);
+};
+
+static const struct workload workloads[] = {
+    { "tcp",   "ack",    run_tcp },
+    { "sched", "switch", run_sched },
+    { "drop",  "drop",   run_drop },
+};
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+struct workload_result {
+    __u64 ops;
+    double ns_per_op;     // node busy time minus agent CPU, per operation
+    double added_ns;      // ns_per_op over the "off" run, NAN without one
+    double agent_cpu;     // agent CPU in % of one CPU during the workload
+};
+
+struct mode_result {
+    const struct mode *mode;
+    bool ok;
+    struct workload_result w[NR_WORKLOADS];
+    long agent_rss_kb;    // peak seen at the end of a workload
+};
+
+struct run_ctx {
+    const struct workload *w;
+    __u64 ops;
+};
+
+static void *workload_thread(void *arg) {
+    struct run_ctx *ctx = arg;
+
+    ctx->ops = ctx->w->run();
+    return NULL;
+}
+
+static void run_workload(const struct workload *w, pid_t agent, struct workload_result *r) {
+    struct run_ctx ctx = { .w = w };
+    __u64 start, busy, agent_cpu, elapsed;
+    pthread_t thread;
+
+    atomic_store(&stop, false);
+    start = now_ns();
+    busy = node_busy_ns();
+    agent_cpu = agent > 0 ? proc_cpu_ns(agent) : 0;
+    pthread_create(&thread, NULL, workload_thread, &ctx);
+    sleep(env.duration);
+    atomic_store(&stop, true);
+    pthread_join(thread, NULL);
+
+    elapsed = now_ns() - start;
+    busy = node_busy_ns() - busy;
+    agent_cpu = agent > 0 ? proc_cpu_ns(agent) - agent_cpu : 0;
+    r->ops = ctx.ops;
+    r->ns_per_op = ctx.ops ? (double)(busy > agent_cpu ? busy - agent_cpu : 0) / ctx.ops : 0;
+    r->agent_cpu = 100.0 * agent_cpu / elapsed;
+}
+
+// Start the agent with the mode's options, without the HTTP server so
+// runs never fight over a port
+static pid_t start_agent(const struct mode *m) {
+    char args[256], *argv[MAX_AGENT_ARGS + 4];
+    int argc = 0;
+    pid_t pid;
+
+    snprintf(args, sizeof(args), "%s", m->args);
+    argv[argc++] = (char *)env.agent;
+    argv[argc++] = "--port=0";
+    for (char *tok = strtok(args, " "); tok && argc < MAX_AGENT_ARGS + 2; tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        execv(env.agent, argv);
+        fprintf(stderr, "Failed to run %s: %s\n", env.agent, strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    sleep(env.settle);
+    if (waitpid(pid, NULL, WNOHANG) != 0) {
+        fprintf(stderr, "Agent exited during startup (mode %s)\n", m->name);
+        return -1;
+    }
+    return pid;
+}
+
+static void stop_agent(pid_t pid) {
+    kill(pid, SIGINT);
+    for (int i = 0; i < 50; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return;
+        usleep(100000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static void run_mode(struct mode_result *res) {
+    pid_t agent = 0;
+
+    if (res->mode->args) {
+        agent = start_agent(res->mode);
+        if (agent < 0)
+            return;
+    }
+    for (size_t i = 0; i < NR_WORKLOADS; i++) {
+        run_workload(&workloads[i], agent, &res->w[i]);
+        if (agent > 0) {
+            long rss = proc_rss_kb(agent);
+            if (rss > res->agent_rss_kb)
+                res->agent_rss_kb = rss;
+        }
+    }
+    if (agent > 0)
+        stop_agent(agent);
+    res->ok = true;
+}
+
+static void print_results(const struct mode_result *res, int n) {
+    printf("\n%-16s", "mode");
+    for (size_t i = 0; i < NR_WORKLOADS; i++)
+        printf(" %9s/%-6s %8s", "ns", workloads[i].unit, "+ns");
+    printf(" %7s %9s\n", "cpu%", "rss_kb");
+
+    for (int m = 0; m < n; m++) {
+        if (!res[m].ok) {
+            printf("%-16s failed\n", res[m].mode->name);
+            continue;
+        }
+        printf("%-16s", res[m].mode->name);
+        for (size_t i = 0; i < NR_WORKLOADS; i++)
+            printf(" %16.1f %8.1f", res[m].w[i].ns_per_op, res[m].w[i].added_ns);
+        double cpu = 0;
+        for (size_t i = 0; i < NR_WORKLOADS; i++)
+            cpu += res[m].w[i].agent_cpu / NR_WORKLOADS;
+        printf(" %7.2f %9ld\n", cpu, res[m].agent_rss_kb);
+    }
+}
+
+static int write_json(const struct mode_result *res, int n) {
+    struct utsname uts;
+    FILE *f = fopen(env.output, "w");
+
+    if (!f) {
+        fprintf(stderr, "Failed to write %s: %s\n", env.output, strerror(errno));
+        return -errno;
+    }
+    uname(&uts);
+    fprintf(f, "{\n  \"kernel\": \"%s\",\n  \"cpus\": %ld,\n  \"duration_s\": %d,\n"
+               "  \"tcp_rate\": %d,\n  \"modes\": [",
+            uts.release, sysconf(_SC_NPROCESSORS_ONLN), env.duration, env.tcp_rate);
+    for (int m = 0; m < n; m++) {
+        fprintf(f, "%s\n    {\n      \"mode\": \"%s\",\n      \"agent_args\": \"%s\",\n"
+                   "      \"ok\": %s",
+                m ? "," : "", res[m].mode->name, res[m].mode->args ? res[m].mode->args : "",
+                res[m].ok ? "true" : "false");
+        if (res[m].ok) {
+            fprintf(f, ",\n      \"agent_rss_kb\": %ld,\n      \"workloads\": {",
+                    res[m].agent_rss_kb);
+            for (size_t i = 0; i < NR_WORKLOADS; i++) {
+                const struct workload_result *w = &res[m].w[i];
+                char added[32] = "null";
+
+                if (!isnan(w->added_ns))
+                    snprintf(added, sizeof(added), "%.1f", w->added_ns);
+                fprintf(f, "%s\n        \"%s\": { \"unit\": \"%s\", \"ops\": %llu, "
+                           "\"ns_per_op\": %.1f, \"added_ns_per_op\": %s, "
+                           "\"agent_cpu_pct\": %.2f }",
+                        i ? "," : "", workloads[i].name, workloads[i].unit,
+                        (unsigned long long)w->ops, w->ns_per_op, added, w->agent_cpu);
+            }
+            fprintf(f, "\n      }");
+        }
+        fprintf(f, "\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (fclose(f) != 0)
+        return -errno;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct mode_result res[NR_MODES] = {};
+    const struct mode_result *base = NULL;
+    int n = 0;
+
+    parse_args(argc, argv);
+    if (access(env.agent, X_OK) != 0) {
+        fprintf(stderr, "Agent binary %s not found\n", env.agent);
+        return 1;
+    }
+    // Paced sleeps should wake on time, not up to 50us late
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    for (size_t m = 0; m < NR_MODES; m++) {
+        if (!mode_selected(all_modes[m].name))
+            continue;
+        res[n].mode = &all_modes[m];
+        printf("Running mode %s...\n", all_modes[m].name);
+        fflush(stdout);
+        run_mode(&res[n]);
+        if (res[n].ok && !all_modes[m].args)
+            base = &res[n];
+        n++;
+    }
+    if (!n) {
+        fprintf(stderr, "No modes selected\n");
+        return 1;
+    }
+
+    for (int m = 0; m < n; m++) {
+        for (size_t i = 0; res[m].ok && i < NR_WORKLOADS; i++)
+            res[m].w[i].added_ns = base ? res[m].w[i].ns_per_op - base->w[i].ns_per_op : NAN;
+    }
+    print_results(res, n);
+    return write_json(res, n) ? 1 : 0;
+}
@@ -0,0 +1,430 @@
+// Active UDP RTT probes between agents
+//
+// Every agent answers probes on its responder socket and sends its own
+// from a second, unbound socket, so passive RTT is not needed between
+// nodes that do not talk yet. A round probes only a few targets (a
+// shuffled round-robin, as in SWIM), which keeps the per-node cost O(1)
+// per round and O(N) across the cluster while every pair is still
+// measured every N / fanout rounds.
+//
+// Send and receive times are the kernel's software timestamps
+// (SO_TIMESTAMPING): transmit times come back on the error queue with a
+// copy of the sent packet, whose seq says which probe it was, receive
+// times with each datagram. Matching on the payload rather than on an
+// OPT_ID counter kept in userspace cannot drift when a send fails after
+// the kernel already took a key. The responder reports how long the
+// probe sat between its own kernel receive time and its reply, which is
+// subtracted, so neither side's scheduling latency ends up in the RTT.
+// Without kernel timestamps the userspace clock is used instead.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include "probe.h"
+
+_Static_assert(sizeof(struct probe_msg) == 32, "probe_msg is part of the wire format");
+_Static_assert((PROBE_MAX_PENDING & (PROBE_MAX_PENDING - 1)) == 0,
+               "PROBE_MAX_PENDING must be a power of two");
+
+struct probe_target {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct probe_stats stats;
+};
+
+// A probe in flight, in pending[seq % PROBE_MAX_PENDING]
+struct pending_probe {
+    __u64 seq;
+    __u64 tx_ns;           // CLOCK_REALTIME, the kernel's once its timestamp is in
+    __u64 sent_ns;         // CLOCK_MONOTONIC, for the timeout
+    int target;
+    bool live;
+    bool kernel_tx;
+};
+
+struct prober {
+    int listen_fd;         // responder, bound to the probe port
+    int probe_fd;          // sends probes and receives their replies
+    int family;            // of both sockets; AF_INET6 is dual-stack
+    __u16 port;
+    __u32 interval_ms;
+    __u32 fanout;
+    __u64 nonce;
+    __u64 rng;
+    struct probe_target targets[PROBE_MAX_TARGETS];
+    int nr_targets;
+    int order[PROBE_MAX_TARGETS];   // shuffled target indexes
+    int next;                       // position in order
+    struct pending_probe pending[PROBE_MAX_PENDING];
+    __u64 seq;             // of the next probe
+    __u64 oldest;          // probes before it are done
+    __u64 next_round_ns;
+};
+
+static __u64 realtime_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64; only jitter and shuffling depend on it
+static __u64 next_rand(struct prober *p) {
+    p->rng ^= p->rng << 13;
+    p->rng ^= p->rng >> 7;
+    p->rng ^= p->rng << 17;
+    return p->rng;
+}
+
+static int open_socket(struct prober *p, __u16 port, __u32 ts_flags) {
+    int fd = socket(p->family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int zero = 0;
+
+    if (fd < 0)
+        return -1;
+    if (p->family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    // Timestamps are best effort; the userspace clock stands in
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags));
+    if (port) {
+        struct sockaddr_storage ss = { .ss_family = p->family };
+        socklen_t len = sizeof(struct sockaddr_in);
+
+        if (p->family == AF_INET6) {
+            ((struct sockaddr_in6 *)&ss)->sin6_port = htons(port);
+            len = sizeof(struct sockaddr_in6);
+        } else {
+            ((struct sockaddr_in *)&ss)->sin_port = htons(port);
+        }
+        if (bind(fd, (struct sockaddr *)&ss, len)) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+struct prober *prober_new(int port, __u32 interval_ms, __u32 fanout) {
+    const __u32 rx_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    const __u32 tx_flags = rx_flags | SOF_TIMESTAMPING_TX_SOFTWARE;
+    struct prober *p;
+    int saved;
+
+    if (port <= 0 || port > 65535 || !interval_ms || !fanout) {
+        errno = EINVAL;
+        return NULL;
+    }
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->port = port;
+    p->interval_ms = interval_ms;
+    p->fanout = fanout;
+    p->next = PROBE_MAX_TARGETS;    // shuffle before the first round
+    p->probe_fd = -1;
+    if (getrandom(&p->nonce, sizeof(p->nonce), 0) != sizeof(p->nonce))
+        p->nonce = realtime_ns() ^ ((__u64)getpid() << 32);
+    p->rng = p->nonce | 1;
+
+    // Dual-stack where the node has IPv6, IPv4 only otherwise
+    p->family = AF_INET6;
+    p->listen_fd = open_socket(p, port, rx_flags);
+    if (p->listen_fd < 0 && errno == EAFNOSUPPORT) {
+        p->family = AF_INET;
+        p->listen_fd = open_socket(p, port, rx_flags);
+    }
+    if (p->listen_fd < 0)
+        goto fail;
+    p->probe_fd = open_socket(p, 0, tx_flags);
+    if (p->probe_fd < 0)
+        goto fail;
+    return p;
+
+fail:
+    saved = errno;
+    prober_free(p);
+    errno = saved;
+    return NULL;
+}
+
+void prober_free(struct prober *p) {
+    if (!p)
+        return;
+    if (p->listen_fd >= 0)
+        close(p->listen_fd);
+    if (p->probe_fd >= 0)
+        close(p->probe_fd);
+    free(p);
+}
+
+int prober_add_target(struct prober *p, const char *name, int family, const void *addr) {
+    struct probe_target *t = &p->targets[p->nr_targets];
+
+    if (p->nr_targets == PROBE_MAX_TARGETS || (family == AF_INET6 && p->family == AF_INET))
+        return -1;
+    memset(t, 0, sizeof(*t));
+    if (p->family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&t->addr;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(p->port);
+        if (family == AF_INET) {
+            // v4-mapped on the dual-stack socket
+            sin6->sin6_addr.s6_addr[10] = 0xff;
+            sin6->sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&sin6->sin6_addr.s6_addr[12], addr, 4);
+        } else {
+            memcpy(&sin6->sin6_addr, addr, 16);
+        }
+        t->addr_len = sizeof(*sin6);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&t->addr;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(p->port);
+        memcpy(&sin->sin_addr, addr, 4);
+        t->addr_len = sizeof(*sin);
+    }
+    snprintf(t->stats.name, sizeof(t->stats.name), "%s", name);
+    p->order[p->nr_targets] = p->nr_targets;
+    return p->nr_targets++;
+}
+
+void prober_fds(const struct prober *p, int fds[2]) {
+    fds[0] = p->listen_fd;
+    fds[1] = p->probe_fd;
+}
+
+int prober_nr_targets(const struct prober *p) {
+    return p->nr_targets;
+}
+
+const struct probe_stats *prober_stats(const struct prober *p, int target) {
+    return &p->targets[target].stats;
+}
+
+// Software timestamp of a received datagram or error queue entry, 0 if none
+static __u64 cmsg_timestamp(struct msghdr *msg) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPING) {
+            const struct scm_timestamping *tss = (const void *)CMSG_DATA(c);
+
+            return tss->ts[0].tv_sec * 1000000000ULL + tss->ts[0].tv_nsec;
+        }
+    }
+    return 0;
+}
+
+// Answer every queued probe with the time it spent here
+static void handle_requests(struct prober *p) {
+    for (;;) {
+        struct sockaddr_storage from;
+        struct probe_msg m;
+        char control[256] __attribute__((aligned(8)));
+        struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+        struct msghdr msg = {
+            .msg_name = &from, .msg_namelen = sizeof(from),
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control, .msg_controllen = sizeof(control),
+        };
+        ssize_t n = recvmsg(p->listen_fd, &msg, 0);
+
+        if (n < 0)
+            return;
+        if (n != sizeof(m) || be32toh(m.magic) != PROBE_MAGIC || m.version != PROBE_VERSION ||
+            m.type != PROBE_REQUEST)
+            continue;
+
+        __u64 rx_ns = cmsg_timestamp(&msg);
+        __u64 now = realtime_ns();
+        m.type = PROBE_REPLY;
+        m.turnaround_ns = htobe64(rx_ns && rx_ns < now ? now - rx_ns : 0);
+        sendto(p->listen_fd, &m, sizeof(m), MSG_DONTWAIT, (struct sockaddr *)&from,
+               msg.msg_namelen);
+    }
+}
+
+static void record_rtt(struct probe_stats *s, __u64 rtt_ns, __u64 now_ns) {
+    __u64 us = rtt_ns / 1000;
+
+    s->rtt.slots[hist_slot(us > UINT32_MAX ? UINT32_MAX : us)]++;
+    if (s->replies)
+        s->srtt_us = s->srtt_us - (s->srtt_us >> 3) + (us >> 3);
+    else
+        s->srtt_us = us;
+    s->replies++;
+    s->last_reply_ns = now_ns;
+}
+
+static void handle_replies(struct prober *p, __u64 now_ns) {
+    for (;;) {
+        struct probe_msg m;
+        char control[256] __attribute__((aligned(8)));
+        struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control, .msg_controllen = sizeof(control),
+        };
+        ssize_t n = recvmsg(p->probe_fd, &msg, 0);
+
+        if (n < 0)
+            return;
+        if (n != sizeof(m) || be32toh(m.magic) != PROBE_MAGIC || m.version != PROBE_VERSION ||
+            m.type != PROBE_REPLY || be64toh(m.nonce) != p->nonce)
+            continue;
+
+        __u64 seq = be64toh(m.seq);
+        struct pending_probe *pp = &p->pending[seq % PROBE_MAX_PENDING];
+        if (!pp->live || pp->seq != seq)
+            continue;   // late reply of a probe already counted as lost
+
+        __u64 rx_ns = cmsg_timestamp(&msg);
+        __u64 turnaround = be64toh(m.turnaround_ns);
+        __u64 wire = 0;
+        if (!rx_ns)
+            rx_ns = realtime_ns();
+        if (rx_ns > pp->tx_ns)
+            wire = rx_ns - pp->tx_ns;
+        record_rtt(&p->targets[pp->target].stats, wire > turnaround ? wire - turnaround : 0,
+                   now_ns);
+        pp->live = false;
+    }
+}
+
+// Find our probe in a packet looped back from the error queue and copy it
+// to m. The copy starts at the link layer header, whose length depends on
+// the device, so the payload is searched for from the end.
+static bool find_probe(const struct prober *p, const char *data, size_t len,
+                       struct probe_msg *m) {
+    for (size_t off = len; off >= sizeof(*m); off--) {
+        memcpy(m, data + off - sizeof(*m), sizeof(*m));
+        if (be32toh(m->magic) == PROBE_MAGIC && be64toh(m->nonce) == p->nonce &&
+            m->type == PROBE_REQUEST)
+            return true;
+    }
+    return false;
+}
+
+// Replace the userspace send times with the kernel's
+static void handle_tx_timestamps(struct prober *p) {
+    for (;;) {
+        char control[256] __attribute__((aligned(8)));
+        char data[256] __attribute__((aligned(8)));
+        struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control, .msg_controllen = sizeof(control),
+        };
+        const struct sock_extended_err *serr = NULL;
+        struct probe_msg m;
+        ssize_t n = recvmsg(p->probe_fd, &msg, MSG_ERRQUEUE);
+
+        if (n < 0)
+            return;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if ((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+                (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+                serr = (const void *)CMSG_DATA(c);
+        }
+        __u64 ts = cmsg_timestamp(&msg);
+        if (!serr || serr->ee_errno != ENOMSG || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || !ts)
+            continue;
+        // Without CAP_NET_RAW and net.core.tstamp_allow_data the kernel
+        // strips the packet; those probes keep the userspace send time
+        if (!find_probe(p, data, n, &m))
+            continue;
+
+        __u64 seq = be64toh(m.seq);
+        struct pending_probe *pp = &p->pending[seq % PROBE_MAX_PENDING];
+        // The kernel stamps after the userspace clock was read
+        if (pp->live && pp->seq == seq && !pp->kernel_tx && ts >= pp->tx_ns) {
+            pp->tx_ns = ts;
+            pp->kernel_tx = true;
+        }
+    }
+}
+
+static void expire_probes(struct prober *p, __u64 now_ns) {
+    while (p->oldest < p->seq) {
+        struct pending_probe *pp = &p->pending[p->oldest % PROBE_MAX_PENDING];
+
+        if (pp->live) {
+            if (now_ns - pp->sent_ns < PROBE_TIMEOUT_MS * 1000000ULL &&
+                p->seq - p->oldest < PROBE_MAX_PENDING)
+                break;
+            p->targets[pp->target].stats.lost++;
+            pp->live = false;
+        }
+        p->oldest++;
+    }
+}
+
+static void send_probe(struct prober *p, int target, __u64 now_ns) {
+    struct probe_target *t = &p->targets[target];
+    struct pending_probe *pp = &p->pending[p->seq % PROBE_MAX_PENDING];
+    struct probe_msg m = {
+        .magic = htobe32(PROBE_MAGIC),
+        .version = PROBE_VERSION,
+        .type = PROBE_REQUEST,
+        .nonce = htobe64(p->nonce),
+        .seq = htobe64(p->seq),
+    };
+
+    pp->seq = p->seq++;
+    pp->target = target;
+    pp->sent_ns = now_ns;
+    pp->tx_ns = realtime_ns();
+    pp->kernel_tx = false;
+    t->stats.sent++;
+    if (sendto(p->probe_fd, &m, sizeof(m), MSG_DONTWAIT, (struct sockaddr *)&t->addr,
+               t->addr_len) < 0) {
+        t->stats.lost++;
+        pp->live = false;
+        return;
+    }
+    pp->live = true;
+}
+
+static void run_round(struct prober *p, __u64 now_ns) {
+    for (__u32 i = 0; i < p->fanout && i < (__u32)p->nr_targets; i++) {
+        if (p->next >= p->nr_targets) {
+            // Fisher-Yates
+            for (int j = p->nr_targets - 1; j > 0; j--) {
+                int k = next_rand(p) % (j + 1);
+                int tmp = p->order[j];
+
+                p->order[j] = p->order[k];
+                p->order[k] = tmp;
+            }
+            p->next = 0;
+        }
+        // Make room for the new probe first
+        expire_probes(p, now_ns);
+        send_probe(p, p->order[p->next++], now_ns);
+    }
+}
+
+void prober_poll(struct prober *p, __u64 now_ns) {
+    handle_requests(p);
+    handle_tx_timestamps(p);
+    handle_replies(p, now_ns);
+    expire_probes(p, now_ns);
+
+    if (now_ns >= p->next_round_ns) {
+        // Jitter keeps the agents of a cluster from probing in lockstep
+        __u64 interval = p->interval_ms * 1000000ULL;
+
+        run_round(p, now_ns);
+        p->next_round_ns = now_ns + interval * 3 / 4 + next_rand(p) % (interval / 2 + 1);
+    }
+}
@@ -0,0 +1,68 @@
+// Active UDP RTT probes between agents (--probe-port)
+
+#ifndef __PROBE_H
+#define __PROBE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/types.h>
+#include "telemetry.h"
+
+#define PROBE_MAGIC 0x45504650            // "EPFP"
+#define PROBE_VERSION 1
+#define PROBE_MAX_TARGETS 256
+#define PROBE_MAX_PENDING 1024            // probes in flight, power of two
+#define PROBE_TIMEOUT_MS 1000             // no reply by then counts as lost
+
+// Probe and reply datagram, network byte order
+struct probe_msg {
+    __u32 magic;
+    __u8 version;
+    __u8 type;             // PROBE_REQUEST or PROBE_REPLY
+    __u16 pad;
+    __u64 nonce;           // prober instance, echoed back
+    __u64 seq;             // echoed back
+    __u64 turnaround_ns;   // reply only: responder receive to send
+};
+
+enum {
+    PROBE_REQUEST = 1,
+    PROBE_REPLY = 2,
+};
+
+// Cumulative results towards one target; only count up
+struct probe_stats {
+    char name[64];
+    __u64 sent;
+    __u64 replies;
+    __u64 lost;            // timed out, including failed sends
+    __u64 srtt_us;         // smoothed RTT (1/8 gain, as TCP); valid once replies > 0
+    __u64 last_reply_ns;   // CLOCK_MONOTONIC
+    struct hist rtt;       // microseconds
+};
+
+struct prober;
+
+// Open the responder socket on port and an unbound socket for probes.
+// Each round, scheduled every interval_ms +-25%, probes the next fanout
+// targets of a shuffled order that is reshuffled once every target had
+// its turn. Returns NULL with errno set on failure.
+struct prober *prober_new(int port, __u32 interval_ms, __u32 fanout);
+void prober_free(struct prober *p);
+
+// Add a target; addr is AF_INET or AF_INET6 without a port. Returns the
+// target index, or -1 when the table is full or the family is unusable.
+int prober_add_target(struct prober *p, const char *name, int family, const void *addr);
+
+// The two sockets, to be polled for POLLIN
+void prober_fds(const struct prober *p, int fds[2]);
+
+// Answer probes, collect replies and timestamps, expire lost probes and
+// run a round when one is due. Never blocks.
+void prober_poll(struct prober *p, __u64 now_ns);
+
+int prober_nr_targets(const struct prober *p);
+const struct probe_stats *prober_stats(const struct prober *p, int target);
+
+#endif /* __PROBE_H */
@@ -0,0 +1,434 @@
+// prog_bench - per-program run time of telemetry.bpf.c
+//
+// Tracepoint programs cannot be driven by BPF_PROG_TEST_RUN, so the skeleton
+// is attached for real with BPF_STATS_RUN_TIME enabled while a fixed
+// workload triggers every hook: a loopback TCP ping-pong (tcp_ack), a pipe
+// ping-pong between two threads (sched_wakeup/sched_switch), UDP sends
+// to a closed port (kfree_skb) and UDP datagrams a socket sends to itself
+// (the --udp-latency kprobes). The kernel's run_cnt/run_time_ns counters
+// then give the average cost of one invocation of each program.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "telemetry.h"
+#include "telemetry.skel.h"
+
+#define MSG_SIZE 64
+
+static const char *const rtt_backends[] = { "sockops", "fentry", "kprobe", "tracepoint" };
+#define NR_RTT_BACKENDS (sizeof(rtt_backends) / sizeof(rtt_backends[0]))
+
+static struct env {
+    int duration;
+    bool percpu_maps;
+    bool mmap_stats;
+    bool aggregate_only;
+    bool batch_events;
+    bool task_storage;
+    bool udp_latency;
+    const char *rtt_backend;
+} env = {
+    .duration = 5,
+    .percpu_maps = true,
+    .rtt_backend = "tracepoint",
+};
+
+static atomic_bool stop;
+
+static const char usage[] =
+    "Usage: prog_bench [OPTIONS]\n"
+    "Report the average run time of each telemetry.bpf.c program.\n"
+    "\n"
+    "  -d, --duration=SEC        seconds per workload (default 5)\n"
+    "  -S, --shared-maps         use shared maps with atomic updates\n"
+    "  -M, --mmap-stats          count node aggregates in the mmap-able per-CPU slots\n"
+    "  -a, --aggregate-only      load with aggregate-only event policy\n"
+    "  -b, --batch-events        stage events in per-CPU batches\n"
+    "  -r, --rtt-backend=NAME    sockops, fentry, kprobe or tracepoint (default tracepoint)\n"
+    "  -t, --task-storage        use the tp_btf runqueue hooks with task storage\n"
+    "  -u, --udp-latency         also load the UDP send and receive queue kprobes\n"
+    "  -h, --help                show this help\n";
+
+static void parse_args(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "duration",       required_argument, NULL, 'd' },
+        { "shared-maps",    no_argument,       NULL, 'S' },
+        { "mmap-stats",     no_argument,       NULL, 'M' },
+        { "aggregate-only", no_argument,       NULL, 'a' },
+        { "batch-events",   no_argument,       NULL, 'b' },
+        { "rtt-backend",    required_argument, NULL, 'r' },
+        { "task-storage",   no_argument,       NULL, 't' },
+        { "udp-latency",    no_argument,       NULL, 'u' },
+        { "help",           no_argument,       NULL, 'h' },
+        {},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:SMabr:tuh", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                env.duration = atoi(optarg);
+                if (env.duration <= 0) {
+                    fprintf(stderr, "Invalid duration: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                env.percpu_maps = false;
+                break;
+            case 'M':
+                env.mmap_stats = true;
+                break;
+            case 'a':
+                env.aggregate_only = true;
+                break;
+            case 'b':
+                env.batch_events = true;
+                break;
+            case 'r':
+                env.rtt_backend = optarg;
+                break;
+            case 't':
+                env.task_storage = true;
+                break;
+            case 'u':
+                env.udp_latency = true;
+                break;
+            case 'h':
+                printf("%s", usage);
+                exit(0);
+            default:
+                fprintf(stderr, "%s", usage);
+                exit(1);
+        }
+    }
+}
+
+// Echo server side of the TCP ping-pong
+static void *tcp_echo(void *arg) {
+    int fd = *(int *)arg;
+    char buf[MSG_SIZE];
+
+    while (!atomic_load(&stop)) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0 || write(fd, buf, n) != n)
+            break;
+    }
+    return NULL;
+}
+
+// Round trips over a loopback TCP connection; every reply is an ACK
+static __u64 run_tcp(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int lfd, cfd, sfd, one = 1;
+    char buf[MSG_SIZE] = {0};
+    pthread_t thread;
+    __u64 n = 0;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(lfd, 1) || getsockname(lfd, (struct sockaddr *)&addr, &len)) {
+        perror("tcp listen");
+        return 0;
+    }
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (cfd < 0 || connect(cfd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("tcp connect");
+        close(lfd);
+        return 0;
+    }
+    sfd = accept(lfd, NULL, NULL);
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_create(&thread, NULL, tcp_echo, &sfd);
+
+    while (!atomic_load(&stop)) {
+        if (write(cfd, buf, sizeof(buf)) != sizeof(buf) ||
+            read(cfd, buf, sizeof(buf)) <= 0)
+            break;
+        n++;
+    }
+
+    shutdown(cfd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(sfd);
+    close(cfd);
+    close(lfd);
+    return n;
+}
+
+struct pipe_pair {
+    int ping[2];
+    int pong[2];
+};
+
+static void *pipe_echo(void *arg) {
+    struct pipe_pair *p = arg;
+    char c;
+
+    while (read(p->ping[0], &c, 1) == 1) {
+        if (write(p->pong[1], &c, 1) != 1)
+            break;
+    }
+    return NULL;
+}
+
+// Blocking handoffs between two threads; each one is a wakeup and a switch
+static __u64 run_sched(void) {
+    struct pipe_pair p;
+    pthread_t thread;
+    char c = 0;
+    __u64 n = 0;
+
+    if (pipe(p.ping) || pipe(p.pong)) {
+        perror("pipe");
+        return 0;
+    }
+    pthread_create(&thread, NULL, pipe_echo, &p);
+
+    while (!atomic_load(&stop)) {
+        if (write(p.ping[1], &c, 1) != 1 || read(p.pong[0], &c, 1) != 1)
+            break;
+        n++;
+    }
+
+    close(p.ping[1]);
+    pthread_join(thread, NULL);
+    close(p.ping[0]);
+    close(p.pong[0]);
+    close(p.pong[1]);
+    return n;
+}
+
+// UDP datagrams to a port nobody listens on are freed as NO_SOCKET drops
+static __u64 run_drop(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    char buf[MSG_SIZE] = {0};
+    __u64 n = 0;
+    int fd;
+
+    // Borrow a free port, then release it so it is guaranteed closed
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        getsockname(fd, (struct sockaddr *)&addr, &len)) {
+        perror("udp bind");
+        return 0;
+    }
+    close(fd);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    while (!atomic_load(&stop)) {
+        sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr));
+        n++;
+    }
+    close(fd);
+    return n;
+}
+
+// Datagrams a bound socket sends to itself and reads back: udp_sendmsg,
+// the receive queue enqueue and skb_consume_udp once each
+static __u64 run_udp(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    char buf[MSG_SIZE] = {0};
+    __u64 n = 0;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        getsockname(fd, (struct sockaddr *)&addr, &len)) {
+        perror("udp bind");
+        return 0;
+    }
+    while (!atomic_load(&stop)) {
+        if (sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            recv(fd, buf, sizeof(buf), 0) < 0)
+            break;
+        n++;
+    }
+    close(fd);
+    return n;
+}
+
+static struct bpf_program *rtt_backend_prog(struct telemetry_bpf *skel, size_t i) {
+    struct bpf_program *progs[NR_RTT_BACKENDS] = {
+        skel->progs.sockops_rtt,
+        skel->progs.fentry_tcp_rcv_established,
+        skel->progs.kprobe_tcp_rcv_established,
+        skel->progs.trace_tcp_ack,
+    };
+    return progs[i];
+}
+
+// The sockops backend is attached to the cgroup v2 root, as the agent does
+static int attach_sockops(struct telemetry_bpf *skel) {
+    int cg_fd = open("/sys/fs/cgroup", O_RDONLY | O_DIRECTORY);
+    int err;
+
+    if (cg_fd < 0)
+        return -errno;
+    skel->links.sockops_rtt = bpf_program__attach_cgroup(skel->progs.sockops_rtt, cg_fd);
+    err = skel->links.sockops_rtt ? 0 : -errno;
+    close(cg_fd);
+    return err;
+}
+
+static int handle_event(void *ctx, void *data, size_t data_sz) {
+    return 0;
+}
+
+struct workload {
+    const char *name;
+    __u64 (*run)(void);
+    __u64 ops;
+};
+
+static void *workload_thread(void *arg) {
+    struct workload *w = arg;
+
+    w->ops = w->run();
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct workload workloads[] = {
+        { "tcp ping-pong", run_tcp },
+        { "pipe ping-pong", run_sched },
+        { "udp to closed port", run_drop },
+        { "udp to self", run_udp },
+    };
+    struct rlimit rlim = { RLIM_INFINITY, RLIM_INFINITY };
+    struct telemetry_bpf *skel;
+    struct ring_buffer *rb = NULL;
+    struct bpf_program *prog;
+    int stats_fd, err = 1;
+
+    parse_args(argc, argv);
+    setrlimit(RLIMIT_MEMLOCK, &rlim);
+
+    stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+    if (stats_fd < 0) {
+        fprintf(stderr, "Failed to enable BPF run time stats: %d\n", stats_fd);
+        return 1;
+    }
+
+    skel = telemetry_bpf__open();
+    if (!skel) {
+        fprintf(stderr, "Failed to open BPF skeleton\n");
+        close(stats_fd);
+        return 1;
+    }
+    bool found = false;
+    for (size_t i = 0; i < NR_RTT_BACKENDS; i++) {
+        bool selected = strcmp(env.rtt_backend, rtt_backends[i]) == 0;
+        bpf_program__set_autoload(rtt_backend_prog(skel, i), selected);
+        found |= selected;
+    }
+    if (!found) {
+        fprintf(stderr, "Invalid RTT backend: %s\n", env.rtt_backend);
+        goto cleanup;
+    }
+    skel->rodata->percpu_maps = env.percpu_maps;
+    skel->rodata->mmap_stats = env.mmap_stats;
+    skel->rodata->aggregate_only = env.aggregate_only;
+    skel->rodata->batch_events = env.batch_events;
+    // Batches only go out when full or by age; the periodic flush is not
+    // attached here
+    bpf_program__set_autoload(skel->progs.flush_event_batch, false);
+    bpf_map__set_autocreate(skel->maps.event_staging_map, env.batch_events);
+    // One of the two runqueue variants, as the agent picks them
+    bpf_program__set_autoload(skel->progs.tp_btf_sched_wakeup, env.task_storage);
+    bpf_program__set_autoload(skel->progs.tp_btf_sched_wakeup_new, env.task_storage);
+    bpf_program__set_autoload(skel->progs.tp_btf_sched_switch, env.task_storage);
+    bpf_program__set_autoload(skel->progs.trace_sched_wakeup, !env.task_storage);
+    bpf_program__set_autoload(skel->progs.trace_sched_wakeup_new, !env.task_storage);
+    bpf_program__set_autoload(skel->progs.trace_sched_switch, !env.task_storage);
+    bpf_map__set_autocreate(skel->maps.task_wakeup_storage, env.task_storage);
+    bpf_map__set_autocreate(skel->maps.wakeup_ts_map, !env.task_storage);
+    bpf_program__set_autoload(skel->progs.kprobe_udp_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kretprobe_udp_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kprobe_udpv6_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kretprobe_udpv6_sendmsg, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kprobe_udp_enqueue, env.udp_latency);
+    bpf_program__set_autoload(skel->progs.kprobe_udp_consume, env.udp_latency);
+    bpf_map__set_autocreate(skel->maps.udp_send_start, env.udp_latency);
+    bpf_map__set_autocreate(skel->maps.udp_enqueue_ts, env.udp_latency);
+    bpf_map__set_autocreate(skel->maps.node_stats_map, env.mmap_stats);
+    if (env.mmap_stats)
+        bpf_map__set_max_entries(skel->maps.node_stats_map, libbpf_num_possible_cpus());
+    if (!env.percpu_maps) {
+        bpf_map__set_type(skel->maps.node_metrics_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.rtt_hist_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.drop_reason_map, BPF_MAP_TYPE_HASH);
+        bpf_map__set_type(skel->maps.runqlat_hist_map, BPF_MAP_TYPE_ARRAY);
+        bpf_map__set_type(skel->maps.net_hist_map, BPF_MAP_TYPE_ARRAY);
+    }
+    if (telemetry_bpf__load(skel) || telemetry_bpf__attach(skel) ||
+        (strcmp(env.rtt_backend, "sockops") == 0 && attach_sockops(skel))) {
+        fprintf(stderr, "Failed to load and attach BPF skeleton\n");
+        goto cleanup;
+    }
+
+    // Drain events like the agent does so ringbuf reservations succeed
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.events), handle_event, NULL, NULL);
+    if (!rb) {
+        fprintf(stderr, "Failed to create ring buffer\n");
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        struct timespec start, now;
+        pthread_t thread;
+
+        atomic_store(&stop, false);
+        pthread_create(&thread, NULL, workload_thread, &workloads[i]);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            ring_buffer__poll(rb, 100);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while (now.tv_sec - start.tv_sec < env.duration);
+        atomic_store(&stop, true);
+        pthread_join(thread, NULL);
+
+        printf("%-20s %12llu ops\n", workloads[i].name, workloads[i].ops);
+    }
+
+    printf("\n%-24s %12s %14s %10s\n", "program", "runs", "run_time_ns", "ns/run");
+    bpf_object__for_each_program(prog, skel->obj) {
+        struct bpf_prog_info info = {};
+        __u32 len = sizeof(info);
+
+        if (!bpf_program__autoload(prog))
+            continue;
+        if (bpf_prog_get_info_by_fd(bpf_program__fd(prog), &info, &len) != 0)
+            continue;
+        printf("%-24s %12llu %14llu %10.1f\n", bpf_program__name(prog),
+               info.run_cnt, info.run_time_ns,
+               info.run_cnt ? (double)info.run_time_ns / info.run_cnt : 0.0);
+    }
+    err = 0;
+
+cleanup:
+    ring_buffer__free(rb);
+    telemetry_bpf__destroy(skel);
+    close(stats_fd);
+    return err;
+}
@@ -1,11 +1,15 @@
+// simple_agent - print the events of simple_telemetry.bpf.o
+//
+// Usage: simple_agent [epoll|busy|coalesce]
+
+#define _GNU_SOURCE
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/resource.h>
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
+#include "collector.h"
 
 struct rtt_event {
     unsigned int pid;
@@ -13,78 +17,67 @@ struct rtt_event {
     char comm[16];
 };
 
+static atomic_bool exiting;
+
 static int print_event(void *ctx, void *data, size_t data_sz) {
     const struct rtt_event *e = data;
-    printf("RTT Event: PID %u, Command %s, RTT %u us\n", 
+    printf("RTT Event: PID %u, Command %s, RTT %u us\n",
            e->pid, e->comm, e->rtt_us);
     return 0;
 }
 
 int main(int argc, char **argv) {
-    struct bpf_object *obj;
-    struct bpf_program *prog;
-    struct bpf_link *link = NULL;
+    struct poll_policy poll = { .mode = POLL_EPOLL, .timeout_ms = 100, .period_us = 1000,
+                                .busy_cpu = -1 };
+    struct collector_object co;
     struct ring_buffer *rb = NULL;
     int map_fd, err;
 
-    // Load BPF object
-    obj = bpf_object__open_file("simple_telemetry.bpf.o", NULL);
-    if (!obj) {
-        fprintf(stderr, "Failed to open BPF object\n");
-        return 1;
-    }
-
-    // Load BPF program
-    err = bpf_object__load(obj);
-    if (err) {
-        fprintf(stderr, "Failed to load BPF object: %d\n", err);
-        goto cleanup;
+    if (argc > 1) {
+        int mode = poll_mode_parse(argv[1]);
+        if (mode < 0) {
+            fprintf(stderr, "Usage: %s [epoll|busy|coalesce]\n", argv[0]);
+            return 1;
+        }
+        poll.mode = mode;
     }
 
-    // Find the program
-    prog = bpf_object__find_program_by_name(obj, "trace_tcp_probe");
-    if (!prog) {
-        fprintf(stderr, "Failed to find BPF program\n");
-        goto cleanup;
-    }
+    collector_handle_signals(&exiting);
+    if (collector_bump_memlock())
+        fprintf(stderr, "Failed to increase RLIMIT_MEMLOCK limit\n");
 
-    // Attach the program
-    link = bpf_program__attach(prog);
-    if (!link) {
-        fprintf(stderr, "Failed to attach BPF program\n");
-        goto cleanup;
+    // Load the BPF object and attach its program
+    err = collector_object_open(&co, "simple_telemetry.bpf.o");
+    if (err) {
+        fprintf(stderr, "Failed to load and attach BPF object: %d\n", err);
+        return 1;
     }
 
     // Set up ring buffer
-    map_fd = bpf_object__find_map_fd_by_name(obj, "events");
+    map_fd = bpf_object__find_map_fd_by_name(co.obj, "events");
     if (map_fd < 0) {
         fprintf(stderr, "Failed to find events map\n");
+        err = map_fd;
         goto cleanup;
     }
 
     rb = ring_buffer__new(map_fd, print_event, NULL, NULL);
     if (!rb) {
         fprintf(stderr, "Failed to create ring buffer\n");
+        err = -errno;
         goto cleanup;
     }
 
-    printf("eBPF RTT monitor started. Press Ctrl+C to stop.\n");
+    printf("eBPF RTT monitor started (%s polling). Press Ctrl+C to stop.\n",
+           poll_mode_names[poll.mode]);
 
-    // Poll for events
-    while (1) {
-        err = ring_buffer__poll(rb, 100);
-        if (err == -EINTR) {
-            break;
-        }
-        if (err < 0) {
-            printf("Error polling ring buffer: %d\n", err);
-            break;
-        }
-    }
+    // Poll for events until SIGINT/SIGTERM
+    err = collector_poll(rb, &poll, &exiting, NULL, NULL);
+    if (err < 0)
+        printf("Error polling ring buffer: %d\n", err);
 
 cleanup:
     ring_buffer__free(rb);
-    bpf_link__destroy(link);
-    bpf_object__close(obj);
+    collector_object_close(&co);
     return err < 0 ? -err : 0;
 }
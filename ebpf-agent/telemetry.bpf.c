@@ -1,176 +1,929 @@
 // eBPF program for collecting network telemetry
 // Collects RTT, retransmission, packet drops, and scheduling latency
 
-#include <linux/types.h>
+#include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
+#include <bpf/bpf_endian.h>
 
-// Maximum number of histogram buckets (log2 scale)
-#define MAX_SLOTS 64
-#define MAX_NODES 256
+#include "telemetry.h"
 
-// Histogram structure for RTT measurements
-struct hist {
-    __u32 slots[MAX_SLOTS];
-};
+// Address families (macros, so not part of vmlinux.h)
+#define AF_INET 2
+#define AF_INET6 10
+
+// prev_state sched:sched_switch reports for a preempted task (4.14+):
+// TASK_REPORT_MAX = TASK_REPORT_IDLE << 1, i.e. (0x7f + 1) << 1
+#define TASK_REPORT_MAX 0x100
+
+// Set by the agent before load. With per-CPU maps every CPU owns a private
+// copy of each value, so the hooks can use plain increments instead of
+// bouncing one shared cache line between all CPUs on every event.
+const volatile bool percpu_maps = true;
+
+// Event export policy, also set by the agent before load. In aggregate-only
+// mode the hooks just update maps and the ring buffer only carries
+// exceptional events (RTT outliers).
+const volatile bool aggregate_only = false;
+const volatile __u32 rtt_outlier_ms = 0;  // 0 disables outlier events
+
+// Stage events per CPU and send them as event_batch records, flushed once
+// full or batch_flush_ns after their first entry
+const volatile bool batch_events = false;
+const volatile __u64 batch_flush_ns = 100000000;
+
+// Set when the agent drains the ring buffer on its own schedule (busy or
+// coalesced polling) instead of sleeping until it is woken up
+const volatile bool ringbuf_no_wakeup = false;
 
-// Node metrics structure
-struct node_metrics {
-    __u64 rtt_sum;
-    __u64 rtt_count;
-    __u64 retrans_count;
-    __u64 drop_count;
-    __u64 runqlat_sum;
-    __u64 runqlat_count;
-    __u32 cpu_util;
-    __u64 timestamp;
+// Per event type sampling thresholds (see SAMPLE_ALWAYS). These live in
+// .data rather than .rodata: the agent's sampling controller rewrites them
+// through the memory-mapped map while the programs run.
+__u32 sample_thresh[MAX_EVENT_TYPES] = {
+    [EVENT_RTT] = SAMPLE_ALWAYS / 100,
+    [EVENT_RETRANS] = SAMPLE_ALWAYS,
+    [EVENT_DROP] = SAMPLE_ALWAYS / 10,
 };
 
+// Epoch of the node-wide histograms currently being filled (see
+// NR_HIST_EPOCHS); advanced by the agent through .data every interval
+__u32 hist_epoch = 0;
+
+// Per-socket RTT rate limit: a socket contributes a new sample only after
+// rtt_min_interval_ms, or earlier when srtt moved by more than
+// rtt_min_change_us. Both 0 records every callback.
+const volatile __u32 rtt_min_interval_ms = 100;
+const volatile __u32 rtt_min_change_us = 0;
+
 // Maps for storing metrics
+// These are switched back to BPF_MAP_TYPE_HASH/ARRAY by the agent when
+// per-CPU maps are disabled (--shared-maps).
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, MAX_NODES);
-    __type(key, __u32);  // node_id
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);  // LOCAL_NODE_ID
     __type(value, struct node_metrics);
 } node_metrics_map SEC(".maps");
 
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, MAX_NODES);
-    __type(key, __u32);  // node_id
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NR_HIST_EPOCHS);
+    __type(key, __u32);  // epoch
     __type(value, struct hist);
 } rtt_hist_map SEC(".maps");
 
+// Packet drops indexed directly by enum skb_drop_reason; the last slot
+// also counts reasons of newer kernels past MAX_DROP_REASONS
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 64);
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, MAX_DROP_REASONS);
     __type(key, __u32);  // drop_reason
     __type(value, __u64); // count
 } drop_reason_map SEC(".maps");
 
+// Packet drops by freeing call site (--drop-locations). Only created when
+// enabled; shared and LRU since the set of call sites is open-ended.
+const volatile bool drop_locations = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_DROP_LOCATIONS);
+    __type(key, __u64);   // kfree_skb caller address
+    __type(value, __u64); // count
+} drop_location_map SEC(".maps");
+
+// Node-wide runqueue latency histogram (microseconds), per epoch
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NR_HIST_EPOCHS);
+    __type(key, __u32);  // epoch
+    __type(value, struct hist);
+} runqlat_hist_map SEC(".maps");
+
+// With mmap_stats the node-wide counters and histograms go to one slot per
+// CPU of this mmap-able array instead of node_metrics_map, rtt_hist_map,
+// drop_reason_map and runqlat_hist_map, which are then not created. The
+// agent sets both, and max_entries to the number of possible CPUs, before
+// load.
+const volatile bool mmap_stats = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(max_entries, 1);
+    __type(key, __u32);  // CPU
+    __type(value, struct node_stats);
+} node_stats_map SEC(".maps");
+
+// Connection setup and UDP latency histograms, per epoch: the key is
+// epoch * NR_NET_HISTS + enum net_hist. Not created with mmap_stats,
+// node_stats.net holds them then.
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NR_HIST_EPOCHS * NR_NET_HISTS);
+    __type(key, __u32);
+    __type(value, struct hist);
+} net_hist_map SEC(".maps");
+
+// SYN_SENT time (ns) of active opens, keyed by socket address
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_SOCKETS);
+    __type(key, __u64);
+    __type(value, __u64);
+} connect_start_map SEC(".maps");
+
+// UDP send and receive queue latency (--udp-latency). These are kprobes
+// on the per-datagram paths; the agent only loads them, and creates the
+// two maps below, when enabled.
+
+// udp_sendmsg entry time (ns) per thread
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_PIDS);
+    __type(key, __u64);   // pid_tgid
+    __type(value, __u64);
+} udp_send_start SEC(".maps");
+
+// Enqueue time (ns) of datagrams in socket receive queues, keyed by skb
+// address. LRU, since datagrams freed without being read never come back.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_SOCKETS);
+    __type(key, __u64);
+    __type(value, __u64);
+} udp_enqueue_ts SEC(".maps");
+
+// Per-peer RTT and retransmits, keyed by remote address. Peers are spread
+// over many CPUs, so this map stays shared (and LRU so that it can never
+// fill up) rather than paying for per-CPU copies of thousands of entries.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_PEERS);
+    __type(key, struct peer_key);
+    __type(value, struct peer_metrics);
+} peer_metrics_map SEC(".maps");
+
+// Zeroed template for creating peer_metrics_map entries
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct peer_metrics);
+} peer_init SEC(".maps");
+
+// Per-cgroup aggregates (--cgroup-metrics), keyed by cgroup v2 id. TCP
+// events are charged to the socket's cgroup, runqueue latency to the
+// task's. Shared and LRU like peer_metrics_map: a histogram pair per CPU
+// for every cgroup would cost megabytes per CPU.
+const volatile bool cgroup_metrics = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_CGROUPS);
+    __type(key, __u64);
+    __type(value, struct cgroup_metrics);
+} cgroup_metrics_map SEC(".maps");
+
+// Zeroed template for creating cgroup_metrics_map entries
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct cgroup_metrics);
+} cgroup_init SEC(".maps");
+
+// Flow heavy hitters (--flow-topk, see FLOW_TOPK). Per CPU and per epoch
+// like the histograms, so the hooks use plain stores and the agent reads
+// whole intervals. Only created when enabled.
+const volatile bool flow_topk = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NR_HIST_EPOCHS);
+    __type(key, __u32);  // epoch
+    __type(value, struct flow_sketch);
+} flow_sketch_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NR_HIST_EPOCHS);
+    __type(key, __u32);  // epoch
+    __type(value, struct flow_topk);
+} flow_topk_map SEC(".maps");
+
+// Last recorded RTT sample of a socket
+struct rtt_sample_state {
+    __u64 last_ts;      // ns, 0 until the first sample
+    __u32 last_rtt_us;
+    __u32 pad;
+};
+
+// Rate limit state for the sockops and fentry backends, freed together
+// with the socket. The agent only creates the map those backends need.
+struct {
+    __uint(type, BPF_MAP_TYPE_SK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct rtt_sample_state);
+} sk_rtt_storage SEC(".maps");
+
+// Same for kprobe and tracepoint programs, which cannot use socket storage.
+// Keyed by socket address; a reused address at worst skips one sample.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_SOCKETS);
+    __type(key, __u64);
+    __type(value, struct rtt_sample_state);
+} sk_rtt_lru SEC(".maps");
+
+// Runqueue state of a task
+struct wakeup_state {
+    __u64 ts;          // wakeup timestamp (ns), 0 once consumed
+    __u64 cgroup_id;   // cgroup the task last ran in, with --cgroup-metrics
+};
+
+// Wakeup timestamps of runnable tasks, keyed by PID, for the classic
+// sched tracepoints
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_PIDS);
+    __type(key, __u32);   // pid
+    __type(value, struct wakeup_state);
+} wakeup_ts_map SEC(".maps");
+
+// Same state in task local storage for the tp_btf variant, which gets the
+// task pointers: no hash lookup, no LRU churn and freed with the task. The
+// agent loads one variant and creates only its map.
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct wakeup_state);
+} task_wakeup_storage SEC(".maps");
+
+// Submitted and lost ring buffer events, indexed by event type
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, MAX_EVENT_TYPES);
+    __type(key, __u32);
+    __type(value, struct event_stats);
+} event_stats_map SEC(".maps");
+
 // Ring buffer for sending events to userspace
 struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
     __uint(max_entries, 1 << 24);
 } events SEC(".maps");
 
-// Event structure for userspace communication
-struct telemetry_event {
-    __u32 node_id;
-    __u32 event_type;  // 1=RTT, 2=retrans, 3=drop, 4=runqlat
-    __u64 value;
-    __u64 timestamp;
-    __u32 extra_data;  // For drop_reason, etc.
+// Per-CPU staging buffer of --batch-events
+struct event_staging {
+    __u16 nr_by_type[MAX_EVENT_TYPES];   // for event_stats_map on flush
+    __u32 force_wakeup;                  // batch holds an exceptional event
+    struct event_batch batch;
 };
 
-// Helper function to get histogram slot for log2 distribution
-static __always_inline int value_to_slot(__u64 value) {
-    if (value == 0)
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct event_staging);
+} event_staging_map SEC(".maps");
+
+// Add to a map value; atomics are only needed when the map is shared
+#define metric_add(ptr, val)                        \
+    do {                                            \
+        if (percpu_maps)                            \
+            *(ptr) += (val);                        \
+        else                                        \
+            __sync_fetch_and_add((ptr), (val));     \
+    } while (0)
+
+// Open this CPU's node_stats slot for an update. Each slot has a single
+// writer, so plain increments do; the compiler barriers keep the stores in
+// program order, which x86 preserves for the reader.
+static __always_inline struct node_stats *node_stats_begin(void) {
+    __u32 cpu = bpf_get_smp_processor_id();
+    struct node_stats *stats = bpf_map_lookup_elem(&node_stats_map, &cpu);
+    
+    if (stats) {
+        stats->seq++;
+        asm volatile("" ::: "memory");
+    }
+    return stats;
+}
+
+static __always_inline void node_stats_end(struct node_stats *stats) {
+    asm volatile("" ::: "memory");
+    stats->seq++;
+}
+
+// Look up a map value, creating it from init if the key is not present yet.
+// BPF_NOEXIST keeps a concurrent creator from wiping an entry that another
+// CPU has already started counting into.
+static __always_inline void *lookup_or_init(void *map, const void *key,
+                                            const void *init) {
+    void *val = bpf_map_lookup_elem(map, key);
+    if (val)
+        return val;
+
+    bpf_map_update_elem(map, key, init, BPF_NOEXIST);
+    return bpf_map_lookup_elem(map, key);
+}
+
+// Decide whether a regular (non-exceptional) event should be exported.
+// Returns the threshold it passed, or 0 when the event is not sampled.
+static __always_inline __u32 sample_event(__u32 event_type) {
+    if (aggregate_only || event_type >= MAX_EVENT_TYPES)
         return 0;
     
-    int slot = 0;
-    while (value > 1 && slot < MAX_SLOTS - 1) {
-        value >>= 1;
-        slot++;
+    __u32 thresh = sample_thresh[event_type];
+    if (thresh == SAMPLE_ALWAYS || (thresh && bpf_get_prandom_u32() < thresh))
+        return thresh;
+    return 0;
+}
+
+// Write a staged batch as one ring buffer record. The consumer is only
+// woken up for exceptional events or once the ring buffer is half full;
+// otherwise it collects the batch on its next poll timeout, so wakeups
+// stay coalesced no matter how many CPUs flush.
+static __always_inline void flush_batch(struct event_staging *st) {
+    __u32 count = st->batch.count;
+    __u64 flags = BPF_RB_NO_WAKEUP;
+    
+    if (count == 0)
+        return;
+    if (count > EVENT_BATCH_SIZE)
+        count = EVENT_BATCH_SIZE;
+    if (!ringbuf_no_wakeup &&
+        (st->force_wakeup ||
+         bpf_ringbuf_query(&events, BPF_RB_AVAIL_DATA) >
+             bpf_ringbuf_query(&events, BPF_RB_RING_SIZE) / 2))
+        flags = BPF_RB_FORCE_WAKEUP;
+    
+    long err = bpf_ringbuf_output(&events, &st->batch,
+                                  offsetof(struct event_batch, entries) +
+                                      count * sizeof(struct event_entry),
+                                  flags);
+    
+    for (__u32 type = 0; type < MAX_EVENT_TYPES; type++) {
+        __u32 n = st->nr_by_type[type];
+        if (!n)
+            continue;
+        struct event_stats *stats = bpf_map_lookup_elem(&event_stats_map, &type);
+        if (stats) {
+            if (err)
+                metric_add(&stats->reserve_failed, n);
+            else
+                metric_add(&stats->submitted, n);
+        }
+        st->nr_by_type[type] = 0;
     }
-    return slot;
+    st->batch.count = 0;
+    st->force_wakeup = 0;
 }
 
-// Helper to get current node ID (simplified - in practice use proper node identification)
-static __always_inline __u32 get_node_id() {
-    // For demo purposes, use a simple hash of the current CPU
-    return bpf_get_smp_processor_id() % 8;  // Assuming max 8 nodes
+// Append an event to this CPU's batch. Like the per-CPU counters this is
+// not protected against a nested program on the same CPU; at worst such a
+// race overwrites one entry.
+static __always_inline void stage_event(__u32 event_type, __u64 value,
+                                        __u32 extra_data, __u32 thresh) {
+    __u32 zero = 0;
+    struct event_staging *st = bpf_map_lookup_elem(&event_staging_map, &zero);
+    if (!st)
+        return;
+    
+    __u64 now = bpf_ktime_get_ns();
+    if (st->batch.count && now - st->batch.base_ts >= batch_flush_ns)
+        flush_batch(st);
+    
+    __u32 idx = st->batch.count;
+    if (idx >= EVENT_BATCH_SIZE)
+        return;
+    if (idx == 0)
+        st->batch.base_ts = now;
+    
+    struct event_entry *ent = &st->batch.entries[idx];
+    ent->ts_delta = now - st->batch.base_ts;
+    ent->value = value;
+    ent->sample_thresh = thresh;
+    ent->extra_data = extra_data;
+    ent->event_type = event_type;
+    st->batch.count = idx + 1;
+    st->nr_by_type[event_type & (MAX_EVENT_TYPES - 1)]++;
+    if (event_type == EVENT_RTT && (extra_data & EVENT_F_OUTLIER))
+        st->force_wakeup = 1;
+    
+    if (idx + 1 == EVENT_BATCH_SIZE)
+        flush_batch(st);
 }
 
-// Tracepoint for TCP ACK to measure RTT
-SEC("tracepoint/tcp/tcp_ack")
-int trace_tcp_ack(struct trace_event_raw_tcp_ack *ctx) {
-    struct tcp_sock *tp = (struct tcp_sock *)ctx->sk;
-    if (!tp)
+// Send an event to userspace
+static __always_inline void emit_event(__u32 node_id, __u32 event_type,
+                                       __u64 value, __u32 extra_data,
+                                       __u32 thresh) {
+    if (batch_events) {
+        stage_event(event_type, value, extra_data, thresh);
+        return;
+    }
+    
+    struct event_stats *stats = bpf_map_lookup_elem(&event_stats_map, &event_type);
+    struct telemetry_event *event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
+    if (!event) {
+        if (stats)
+            metric_add(&stats->reserve_failed, 1);
+        return;
+    }
+    if (stats)
+        metric_add(&stats->submitted, 1);
+
+    event->node_id = node_id;
+    event->event_type = event_type;
+    event->value = value;
+    event->timestamp = bpf_ktime_get_ns();
+    event->extra_data = extra_data;
+    event->sample_thresh = thresh;
+    bpf_ringbuf_submit(event, ringbuf_no_wakeup ? BPF_RB_NO_WAKEUP : 0);
+}
+
+// cgroup_metrics_map entry of a cgroup, or NULL when cgroup metrics are off
+static __always_inline struct cgroup_metrics *lookup_cgroup(__u64 cgroup_id) {
+    if (!cgroup_metrics || cgroup_id == 0)
+        return NULL;
+    
+    struct cgroup_metrics *m = bpf_map_lookup_elem(&cgroup_metrics_map, &cgroup_id);
+    if (m)
+        return m;
+    
+    __u32 zero = 0;
+    struct cgroup_metrics *init = bpf_map_lookup_elem(&cgroup_init, &zero);
+    if (!init)
+        return NULL;
+    bpf_map_update_elem(&cgroup_metrics_map, &cgroup_id, init, BPF_NOEXIST);
+    return bpf_map_lookup_elem(&cgroup_metrics_map, &cgroup_id);
+}
+
+// cgroup v2 id of the socket's owner. sk_cgrp_data.cgroup exists since
+// 5.15; older kernels report no cgroup.
+static __always_inline __u64 sk_cgroup_id(const struct sock *sk) {
+    if (!cgroup_metrics || !sk || !bpf_core_field_exists(sk->sk_cgrp_data.cgroup))
+        return 0;
+    return BPF_CORE_READ(sk, sk_cgrp_data.cgroup, kn, id);
+}
+
+// Same for sock_ops, which cannot use bpf_probe_read_kernel() but may
+// walk the BTF pointer bpf_skc_to_tcp_sock() returns
+static __always_inline __u64 sockops_cgroup_id(struct bpf_sock_ops *skops) {
+    if (!cgroup_metrics || !skops->sk)
         return 0;
     
-    __u32 srtt_us;
-    if (bpf_core_read(&srtt_us, sizeof(srtt_us), &tp->srtt_us) != 0)
+    struct sock *sk = (struct sock *)bpf_skc_to_tcp_sock(skops->sk);
+    if (!sk || !bpf_core_field_exists(sk->sk_cgrp_data.cgroup))
         return 0;
+    struct cgroup *cgrp = sk->sk_cgrp_data.cgroup;
+    return cgrp ? cgrp->kn->id : 0;
+}
+
+// IPv4-mapped IPv6 addresses are folded into plain IPv4 so both match the
+// same CIDRs
+static __always_inline void peer_key_fold_v4(struct peer_key *key) {
+    __u32 *w = (__u32 *)key->addr;
     
-    // Convert from microseconds to milliseconds
-    __u32 rtt_ms = srtt_us >> 3;  // srtt_us is in 1/8 microseconds
-    rtt_ms /= 1000;
+    if (w[0] == 0 && w[1] == 0 && w[2] == bpf_htonl(0x0000ffff)) {
+        key->family = AF_INET;
+        w[0] = w[3];
+        w[3] = 0;
+        w[2] = 0;
+    } else {
+        key->family = AF_INET6;
+    }
+}
+
+// Build the peer key for a socket's remote address
+static __always_inline int peer_key_from_sk(const struct sock *sk,
+                                            struct peer_key *key) {
+    __u16 family = BPF_CORE_READ(sk, __sk_common.skc_family);
     
-    __u32 node_id = get_node_id();
+    __builtin_memset(key, 0, sizeof(*key));
+    if (family == AF_INET) {
+        key->family = AF_INET;
+        BPF_CORE_READ_INTO((__be32 *)key->addr, sk, __sk_common.skc_daddr);
+        return 0;
+    }
+    if (family != AF_INET6)
+        return -1;
     
-    // Update histogram
-    struct hist *hist = bpf_map_lookup_elem(&rtt_hist_map, &node_id);
-    if (!hist) {
-        struct hist new_hist = {};
-        bpf_map_update_elem(&rtt_hist_map, &node_id, &new_hist, BPF_ANY);
-        hist = bpf_map_lookup_elem(&rtt_hist_map, &node_id);
-        if (!hist)
-            return 0;
+    BPF_CORE_READ_INTO(&key->addr, sk, __sk_common.skc_v6_daddr.in6_u.u6_addr8);
+    peer_key_fold_v4(key);
+    return 0;
+}
+
+// Same for sock_ops programs, which see the addresses in their context
+static __always_inline int peer_key_from_sockops(const struct bpf_sock_ops *skops,
+                                                 struct peer_key *key) {
+    __u32 *w = (__u32 *)key->addr;
+    
+    __builtin_memset(key, 0, sizeof(*key));
+    if (skops->family == AF_INET) {
+        key->family = AF_INET;
+        w[0] = skops->remote_ip4;
+        return 0;
     }
+    if (skops->family != AF_INET6)
+        return -1;
     
-    int slot = value_to_slot(rtt_ms);
-    if (slot >= 0 && slot < MAX_SLOTS)
-        __sync_fetch_and_add(&hist->slots[slot], 1);
+    w[0] = skops->remote_ip6[0];
+    w[1] = skops->remote_ip6[1];
+    w[2] = skops->remote_ip6[2];
+    w[3] = skops->remote_ip6[3];
+    peer_key_fold_v4(key);
+    return 0;
+}
+
+static __always_inline struct peer_metrics *lookup_peer_key(const struct peer_key *key) {
+    struct peer_metrics *peer = bpf_map_lookup_elem(&peer_metrics_map, key);
+    if (peer)
+        return peer;
     
-    // Update node metrics
-    struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-    if (!metrics) {
-        struct node_metrics new_metrics = {};
-        bpf_map_update_elem(&node_metrics_map, &node_id, &new_metrics, BPF_ANY);
-        metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-        if (!metrics)
-            return 0;
+    // Too large for the BPF stack; start from the zeroed slot per CPU
+    __u32 zero = 0;
+    struct peer_metrics *init = bpf_map_lookup_elem(&peer_init, &zero);
+    if (!init)
+        return NULL;
+    bpf_map_update_elem(&peer_metrics_map, key, init, BPF_NOEXIST);
+    return bpf_map_lookup_elem(&peer_metrics_map, key);
+}
+
+static __always_inline struct peer_metrics *lookup_peer(const struct sock *sk) {
+    struct peer_key key;
+    
+    if (!sk || peer_key_from_sk(sk, &key) != 0)
+        return NULL;
+    return lookup_peer_key(&key);
+}
+
+// v4-mapped IPv6 flows are folded into IPv4 like peer keys
+static __always_inline void flow_key_fold_v4(struct flow_key *key) {
+    if (key->daddr[0] == 0 && key->daddr[1] == 0 && key->daddr[2] == bpf_htonl(0x0000ffff)) {
+        key->family = AF_INET;
+        key->saddr[0] = key->saddr[3];
+        key->daddr[0] = key->daddr[3];
+        key->saddr[1] = key->saddr[2] = key->saddr[3] = 0;
+        key->daddr[2] = key->daddr[3] = 0;
+    } else {
+        key->family = AF_INET6;
+    }
+}
+
+static __always_inline int flow_key_from_sk(const struct sock *sk, struct flow_key *key) {
+    __u16 family = BPF_CORE_READ(sk, __sk_common.skc_family);
+    
+    __builtin_memset(key, 0, sizeof(*key));
+    key->sport = BPF_CORE_READ(sk, __sk_common.skc_num);
+    key->dport = bpf_ntohs(BPF_CORE_READ(sk, __sk_common.skc_dport));
+    if (family == AF_INET) {
+        key->family = AF_INET;
+        key->saddr[0] = BPF_CORE_READ(sk, __sk_common.skc_rcv_saddr);
+        key->daddr[0] = BPF_CORE_READ(sk, __sk_common.skc_daddr);
+        return 0;
+    }
+    if (family != AF_INET6)
+        return -1;
+    
+    BPF_CORE_READ_INTO(&key->saddr, sk, __sk_common.skc_v6_rcv_saddr.in6_u.u6_addr32);
+    BPF_CORE_READ_INTO(&key->daddr, sk, __sk_common.skc_v6_daddr.in6_u.u6_addr32);
+    flow_key_fold_v4(key);
+    return 0;
+}
+
+// sock_ops keeps remote_port in network byte order in the upper half
+static __always_inline int flow_key_from_sockops(const struct bpf_sock_ops *skops,
+                                                 struct flow_key *key) {
+    __builtin_memset(key, 0, sizeof(*key));
+    key->sport = skops->local_port;
+    key->dport = bpf_ntohl(skops->remote_port);
+    if (skops->family == AF_INET) {
+        key->family = AF_INET;
+        key->saddr[0] = skops->local_ip4;
+        key->daddr[0] = skops->remote_ip4;
+        return 0;
+    }
+    if (skops->family != AF_INET6)
+        return -1;
+    
+    for (int i = 0; i < 4; i++) {
+        key->saddr[i] = skops->local_ip6[i];
+        key->daddr[i] = skops->remote_ip6[i];
     }
+    flow_key_fold_v4(key);
+    return 0;
+}
+
+static __always_inline __u64 flow_hash(const struct flow_key *key) {
+    const __u32 *w = (const __u32 *)key;
+    __u64 h = 0x9e3779b97f4a7c15ULL;
+    
+    for (int i = 0; i < sizeof(*key) / 4; i++) {
+        h = (h ^ w[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static __always_inline bool flow_key_equal(const struct flow_key *a, const struct flow_key *b) {
+    const __u32 *x = (const __u32 *)a, *y = (const __u32 *)b;
+    
+    for (int i = 0; i < sizeof(*a) / 4; i++) {
+        if (x[i] != y[i])
+            return false;
+    }
+    return true;
+}
+
+// Raise a flow's value in a top-K table. A flow not in the table replaces
+// the smallest entry if it beats it; free slots count as 0. Per-CPU like
+// the event staging, so a nested program can at worst clobber one slot.
+static __always_inline void flow_topk_offer(struct flow_slot *slots, const struct flow_key *key,
+                                            __u32 hash, __u32 value) {
+    __u32 min = 0, min_value = 0xffffffff;
     
-    __sync_fetch_and_add(&metrics->rtt_sum, rtt_ms);
-    __sync_fetch_and_add(&metrics->rtt_count, 1);
-    metrics->timestamp = bpf_ktime_get_ns();
-    
-    // Send event to userspace (sampling 1/100)
-    if ((bpf_get_prandom_u32() % 100) == 0) {
-        struct telemetry_event *event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
-        if (event) {
-            event->node_id = node_id;
-            event->event_type = 1;  // RTT event
-            event->value = rtt_ms;
-            event->timestamp = bpf_ktime_get_ns();
-            event->extra_data = 0;
-            bpf_ringbuf_submit(event, 0);
+    for (__u32 i = 0; i < FLOW_TOPK; i++) {
+        struct flow_slot *slot = &slots[i];
+        
+        if (slot->hash == hash && flow_key_equal(&slot->key, key)) {
+            if (value > slot->value)
+                slot->value = value;
+            return;
+        }
+        if (slot->value < min_value) {
+            min_value = slot->value;
+            min = i;
         }
     }
+    if (value <= min_value)
+        return;
+    
+    struct flow_slot *slot = &slots[min & (FLOW_TOPK - 1)];
+    __builtin_memcpy(&slot->key, key, sizeof(*key));
+    slot->hash = hash;
+    slot->value = value;
+}
+
+// Count a retransmit in the sketch and offer the flow's estimate, the
+// minimum over the rows its hash picks, to the retransmit top-K
+static __always_inline void record_flow_retrans(const struct flow_key *key) {
+    __u32 epoch = hist_epoch & (NR_HIST_EPOCHS - 1);
+    struct flow_sketch *sketch = bpf_map_lookup_elem(&flow_sketch_map, &epoch);
+    struct flow_topk *topk = bpf_map_lookup_elem(&flow_topk_map, &epoch);
+    if (!sketch || !topk)
+        return;
+    
+    __u64 h = flow_hash(key);
+    __u32 h1 = h, h2 = (h >> 32) | 1;
+    __u32 estimate = 0xffffffff;
+    
+    for (__u32 d = 0; d < FLOW_SKETCH_DEPTH; d++) {
+        __u32 *count = &sketch->counts[d][(h1 + d * h2) & (FLOW_SKETCH_WIDTH - 1)];
+        
+        *count += 1;
+        if (*count < estimate)
+            estimate = *count;
+    }
+    flow_topk_offer(topk->retrans, key, h1 | 1, estimate);
+}
+
+static __always_inline void record_flow_rtt(const struct flow_key *key, __u32 srtt_us) {
+    __u32 epoch = hist_epoch & (NR_HIST_EPOCHS - 1);
+    struct flow_topk *topk = bpf_map_lookup_elem(&flow_topk_map, &epoch);
     
+    if (topk)
+        flow_topk_offer(topk->rtt, key, (__u32)flow_hash(key) | 1, srtt_us >> 3);
+}
+
+static __always_inline bool rtt_rate_limited(void) {
+    return rtt_min_interval_ms || rtt_min_change_us;
+}
+
+// Decide whether a socket's current srtt is worth a new sample, and
+// remember it if so. Sockets without state are always sampled.
+static __always_inline bool rtt_sample_due(struct rtt_sample_state *st, __u32 srtt_us) {
+    __u32 rtt_us = srtt_us >> 3;
+    __u64 now = bpf_ktime_get_ns();
+    
+    if (!st)
+        return true;
+    if (st->last_ts) {
+        __u32 delta = rtt_us > st->last_rtt_us ? rtt_us - st->last_rtt_us :
+                                                 st->last_rtt_us - rtt_us;
+        bool elapsed = rtt_min_interval_ms &&
+                       now - st->last_ts >= rtt_min_interval_ms * 1000000ULL;
+        bool changed = rtt_min_change_us && delta > rtt_min_change_us;
+        
+        if (!elapsed && !changed)
+            return false;
+    }
+    st->last_ts = now;
+    st->last_rtt_us = rtt_us;
+    return true;
+}
+
+static __always_inline struct rtt_sample_state *sk_rtt_state_lru(const void *sk) {
+    struct rtt_sample_state init = {};
+    __u64 key = (__u64)sk;
+    
+    return lookup_or_init(&sk_rtt_lru, &key, &init);
+}
+
+// Record one smoothed RTT sample; shared by all RTT backends below
+static __always_inline void record_rtt(struct peer_metrics *peer, __u64 cgroup_id,
+                                       __u32 srtt_us) {
+    __u32 rtt_us = srtt_us >> 3;  // srtt_us is in 1/8 microseconds
+    __u32 node_id = LOCAL_NODE_ID;
+    __u32 slot = hist_slot(rtt_us);
+    
+    // Update per-peer histogram
+    if (peer) {
+        if (slot < MAX_SLOTS)
+            __sync_fetch_and_add(&peer->rtt.slots[slot], 1);
+        __sync_fetch_and_add(&peer->rtt_sum, rtt_us);
+        __sync_fetch_and_add(&peer->rtt_count, 1);
+    }
+    
+    struct cgroup_metrics *cg = lookup_cgroup(cgroup_id);
+    if (cg) {
+        if (slot < MAX_SLOTS)
+            __sync_fetch_and_add(&cg->rtt.slots[slot], 1);
+        __sync_fetch_and_add(&cg->rtt_count, 1);
+    }
+    
+    if (mmap_stats) {
+        struct node_stats *stats = node_stats_begin();
+        if (!stats)
+            return;
+        if (slot < MAX_SLOTS)
+            stats->rtt.slots[slot]++;
+        node_stats_end(stats);
+    } else {
+        // Update node-wide histogram of the current epoch
+        __u32 epoch = hist_epoch & (NR_HIST_EPOCHS - 1);
+        struct hist *hist = bpf_map_lookup_elem(&rtt_hist_map, &epoch);
+        if (!hist)
+            return;
+        
+        if (slot < MAX_SLOTS)
+            metric_add(&hist->slots[slot], 1);
+        
+        // Update node metrics
+        struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
+        if (!metrics)
+            return;
+        
+        metric_add(&metrics->rtt_sum, rtt_us);
+        metric_add(&metrics->rtt_count, 1);
+        metrics->timestamp = bpf_ktime_get_ns();
+    }
+    
+    // Send event to userspace: outliers always, everything else sampled
+    __u32 thresh;
+    if (rtt_outlier_ms && rtt_us >= rtt_outlier_ms * 1000)
+        emit_event(node_id, EVENT_RTT, rtt_us, EVENT_F_OUTLIER, SAMPLE_ALWAYS);
+    else if ((thresh = sample_event(EVENT_RTT)))
+        emit_event(node_id, EVENT_RTT, rtt_us, 0, thresh);
+}
+
+// Record a sample of a full socket, for the backends that have one
+static __always_inline void record_sk_rtt(const struct sock *sk, __u32 srtt_us) {
+    struct flow_key flow;
+    
+    record_rtt(lookup_peer(sk), sk_cgroup_id(sk), srtt_us);
+    if (flow_topk && flow_key_from_sk(sk, &flow) == 0)
+        record_flow_rtt(&flow, srtt_us);
+}
+
+// RTT backends. Exactly one of the four programs below is loaded; the agent
+// picks it with --rtt-backend and falls back down this list (sockops,
+// fentry, kprobe, tracepoint) when a kernel cannot load or attach one.
+
+// sock_ops: the kernel calls us only when it updates the RTT estimate,
+// instead of on every received segment. The callback is enabled per socket
+// once the connection is established.
+SEC("sockops")
+int sockops_rtt(struct bpf_sock_ops *skops) {
+    struct flow_key flow;
+    struct peer_key key;
+    
+    switch (skops->op) {
+        case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+        case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB:
+            bpf_sock_ops_cb_flags_set(skops, skops->bpf_sock_ops_cb_flags |
+                                             BPF_SOCK_OPS_RTT_CB_FLAG);
+            break;
+        case BPF_SOCK_OPS_RTT_CB:
+            if (rtt_rate_limited() && skops->sk) {
+                struct rtt_sample_state *st;
+                
+                st = bpf_sk_storage_get(&sk_rtt_storage, skops->sk, NULL,
+                                        BPF_SK_STORAGE_GET_F_CREATE);
+                if (!rtt_sample_due(st, skops->srtt_us))
+                    break;
+            }
+            if (peer_key_from_sockops(skops, &key) == 0)
+                record_rtt(lookup_peer_key(&key), sockops_cgroup_id(skops),
+                           skops->srtt_us);
+            if (flow_topk && flow_key_from_sockops(skops, &flow) == 0)
+                record_flow_rtt(&flow, skops->srtt_us);
+            break;
+    }
+    return 1;
+}
+
+// fentry: BTF trampoline on the established-state receive path; the socket
+// can be dereferenced directly
+SEC("fentry/tcp_rcv_established")
+int BPF_PROG(fentry_tcp_rcv_established, struct sock *sk, struct sk_buff *skb) {
+    const struct tcp_sock *tp = (const struct tcp_sock *)sk;
+    __u32 srtt_us = tp->srtt_us;
+    
+    if (rtt_rate_limited()) {
+        struct rtt_sample_state *st;
+        
+        st = bpf_sk_storage_get(&sk_rtt_storage, sk, NULL, BPF_SK_STORAGE_GET_F_CREATE);
+        if (!rtt_sample_due(st, srtt_us))
+            return 0;
+    }
+    record_sk_rtt(sk, srtt_us);
+    return 0;
+}
+
+// kprobe: same hook for kernels without BTF trampolines
+SEC("kprobe/tcp_rcv_established")
+int BPF_KPROBE(kprobe_tcp_rcv_established, struct sock *sk) {
+    const struct tcp_sock *tp = (const struct tcp_sock *)sk;
+    __u32 srtt_us;
+    
+    if (!sk || bpf_core_read(&srtt_us, sizeof(srtt_us), &tp->srtt_us) != 0)
+        return 0;
+    if (rtt_rate_limited() && !rtt_sample_due(sk_rtt_state_lru(sk), srtt_us))
+        return 0;
+    record_sk_rtt(sk, srtt_us);
+    return 0;
+}
+
+// Tracepoint for TCP ACK to measure RTT
+SEC("tracepoint/tcp/tcp_ack")
+int trace_tcp_ack(struct trace_event_raw_tcp_ack *ctx) {
+    struct tcp_sock *tp = (struct tcp_sock *)ctx->sk;
+    if (!tp)
+        return 0;
+    
+    __u32 srtt_us;
+    if (bpf_core_read(&srtt_us, sizeof(srtt_us), &tp->srtt_us) != 0)
+        return 0;
+    if (rtt_rate_limited() && !rtt_sample_due(sk_rtt_state_lru(tp), srtt_us))
+        return 0;
+    
+    record_sk_rtt((const struct sock *)tp, srtt_us);
     return 0;
 }
 
 // Tracepoint for TCP retransmission
 SEC("tracepoint/tcp/tcp_retransmit_skb")
 int trace_tcp_retrans(struct trace_event_raw_tcp_retransmit_skb *ctx) {
-    __u32 node_id = get_node_id();
+    const struct sock *sk = (const struct sock *)ctx->skaddr;
+    __u32 node_id = LOCAL_NODE_ID;
+    struct flow_key flow;
     
-    struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-    if (!metrics) {
-        struct node_metrics new_metrics = {};
-        bpf_map_update_elem(&node_metrics_map, &node_id, &new_metrics, BPF_ANY);
-        metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
+    struct peer_metrics *peer = lookup_peer(sk);
+    if (peer)
+        __sync_fetch_and_add(&peer->retrans_count, 1);
+    
+    if (flow_topk && sk && flow_key_from_sk(sk, &flow) == 0)
+        record_flow_retrans(&flow);
+    
+    struct cgroup_metrics *cg = lookup_cgroup(sk_cgroup_id(sk));
+    if (cg)
+        __sync_fetch_and_add(&cg->retrans_count, 1);
+    
+    if (mmap_stats) {
+        struct node_stats *stats = node_stats_begin();
+        if (!stats)
+            return 0;
+        stats->retrans_count++;
+        node_stats_end(stats);
+    } else {
+        struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
         if (!metrics)
             return 0;
+        
+        metric_add(&metrics->retrans_count, 1);
+        metrics->timestamp = bpf_ktime_get_ns();
     }
     
-    __sync_fetch_and_add(&metrics->retrans_count, 1);
-    metrics->timestamp = bpf_ktime_get_ns();
-    
-    // Send event to userspace
-    struct telemetry_event *event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
-    if (event) {
-        event->node_id = node_id;
-        event->event_type = 2;  // Retrans event
-        event->value = 1;
-        event->timestamp = bpf_ktime_get_ns();
-        event->extra_data = 0;
-        bpf_ringbuf_submit(event, 0);
-    }
+    // Send event to userspace (sampling)
+    __u32 thresh = sample_event(EVENT_RETRANS);
+    if (thresh)
+        emit_event(node_id, EVENT_RETRANS, 1, 0, thresh);
     
     return 0;
 }
@@ -180,60 +933,257 @@ SEC("tracepoint/skb/kfree_skb")
 int trace_skb_drop(struct trace_event_raw_kfree_skb *ctx) {
     __u32 reason = 0;
     
-    // Try to read drop reason (available in newer kernels)
+    // Drop reasons exist since 5.17. Since 6.0 kfree_skb also reports
+    // frees that are not drops (SKB_NOT_DROPPED_YET, SKB_CONSUMED); leave
+    // before touching any map, this is the hottest hook on busy nodes.
     if (bpf_core_field_exists(ctx->reason)) {
         bpf_core_read(&reason, sizeof(reason), &ctx->reason);
+        if (bpf_core_enum_value_exists(enum skb_drop_reason, SKB_NOT_DROPPED_YET) &&
+            reason == bpf_core_enum_value(enum skb_drop_reason, SKB_NOT_DROPPED_YET))
+            return 0;
+        if (bpf_core_enum_value_exists(enum skb_drop_reason, SKB_CONSUMED) &&
+            reason == bpf_core_enum_value(enum skb_drop_reason, SKB_CONSUMED))
+            return 0;
     }
     
-    __u32 node_id = get_node_id();
-    
-    // Update drop reason counter
-    __u64 *count = bpf_map_lookup_elem(&drop_reason_map, &reason);
-    if (!count) {
-        __u64 new_count = 1;
-        bpf_map_update_elem(&drop_reason_map, &reason, &new_count, BPF_ANY);
+    __u32 slot = reason < MAX_DROP_REASONS ? reason : MAX_DROP_REASONS - 1;
+    if (mmap_stats) {
+        struct node_stats *stats = node_stats_begin();
+        if (stats) {
+            stats->drops[slot]++;
+            node_stats_end(stats);
+        }
     } else {
-        __sync_fetch_and_add(count, 1);
+        __u64 *count = bpf_map_lookup_elem(&drop_reason_map, &slot);
+        if (count)
+            metric_add(count, 1);
     }
     
-    // Update node metrics
-    struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-    if (!metrics) {
-        struct node_metrics new_metrics = {};
-        bpf_map_update_elem(&node_metrics_map, &node_id, &new_metrics, BPF_ANY);
-        metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-        if (!metrics)
-            return 0;
+    if (drop_locations) {
+        __u64 location = (__u64)ctx->location;
+        __u64 zero = 0;
+        __u64 *loc_count = lookup_or_init(&drop_location_map, &location, &zero);
+        if (loc_count)
+            __sync_fetch_and_add(loc_count, 1);
     }
     
-    __sync_fetch_and_add(&metrics->drop_count, 1);
-    metrics->timestamp = bpf_ktime_get_ns();
-    
     // Send event to userspace (sampling)
-    if ((bpf_get_prandom_u32() % 10) == 0) {
-        struct telemetry_event *event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
-        if (event) {
-            event->node_id = node_id;
-            event->event_type = 3;  // Drop event
-            event->value = 1;
-            event->timestamp = bpf_ktime_get_ns();
-            event->extra_data = reason;
-            bpf_ringbuf_submit(event, 0);
+    __u32 thresh = sample_event(EVENT_DROP);
+    if (thresh)
+        emit_event(LOCAL_NODE_ID, EVENT_DROP, 1, reason, thresh);
+    
+    return 0;
+}
+
+// Add one connection setup or UDP latency to the node histograms
+static __always_inline void record_net_latency(__u32 kind, __u64 latency_us) {
+    if (latency_us > 0xffffffff)
+        latency_us = 0xffffffff;
+    __u32 slot = hist_slot(latency_us);
+    
+    if (kind >= NR_NET_HISTS || slot >= MAX_SLOTS)
+        return;
+    if (mmap_stats) {
+        struct node_stats *stats = node_stats_begin();
+        if (!stats)
+            return;
+        stats->net[kind].slots[slot]++;
+        node_stats_end(stats);
+    } else {
+        __u32 key = (hist_epoch & (NR_HIST_EPOCHS - 1)) * NR_NET_HISTS + kind;
+        struct hist *hist = bpf_map_lookup_elem(&net_hist_map, &key);
+        if (hist)
+            metric_add(&hist->slots[slot], 1);
+    }
+}
+
+static __always_inline void count_connect_failed(void) {
+    __u32 node_id = LOCAL_NODE_ID;
+    
+    if (mmap_stats) {
+        struct node_stats *stats = node_stats_begin();
+        if (stats) {
+            stats->connect_failed++;
+            node_stats_end(stats);
         }
+    } else {
+        struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
+        if (metrics)
+            metric_add(&metrics->connect_failed, 1);
     }
+}
+
+// TCP state changes, for the connection setup latency of every socket on
+// the node whatever the RTT backend. Active opens are timed from SYN_SENT
+// to ESTABLISHED, including SYN retransmits. A passive open becomes a
+// full socket only once the handshake ACK arrives; the kernel has just
+// measured the SYN-ACK round trip into its srtt then.
+SEC("tracepoint/sock/inet_sock_set_state")
+int trace_inet_sock_set_state(struct trace_event_raw_inet_sock_set_state *ctx) {
+    __u64 sk = (__u64)ctx->skaddr;
+    __u64 now;
+    
+    if (ctx->protocol != IPPROTO_TCP)
+        return 0;
     
+    if (ctx->newstate == TCP_SYN_SENT) {
+        now = bpf_ktime_get_ns();
+        bpf_map_update_elem(&connect_start_map, &sk, &now, BPF_ANY);
+    } else if (ctx->oldstate == TCP_SYN_SENT) {
+        __u64 *start = bpf_map_lookup_elem(&connect_start_map, &sk);
+        if (!start)
+            return 0;
+        if (ctx->newstate == TCP_ESTABLISHED)
+            record_net_latency(NET_HIST_CONNECT, (bpf_ktime_get_ns() - *start) / 1000);
+        else
+            count_connect_failed();
+        bpf_map_delete_elem(&connect_start_map, &sk);
+    } else if (ctx->oldstate == TCP_SYN_RECV && ctx->newstate == TCP_ESTABLISHED) {
+        const struct tcp_sock *tp = ctx->skaddr;
+        __u32 srtt_us = 0;
+        
+        if (bpf_core_read(&srtt_us, sizeof(srtt_us), &tp->srtt_us) == 0 && srtt_us)
+            record_net_latency(NET_HIST_ACCEPT, srtt_us >> 3);
+    }
     return 0;
 }
 
-// Tracepoint for scheduler wakeup (runqueue latency measurement)
-SEC("tracepoint/sched/sched_wakeup")
-int trace_sched_wakeup(struct trace_event_raw_sched_wakeup *ctx) {
-    __u64 ts = bpf_ktime_get_ns();
-    __u32 pid = ctx->pid;
+static __always_inline int udp_send_enter(void) {
+    __u64 id = bpf_get_current_pid_tgid();
+    __u64 now = bpf_ktime_get_ns();
     
-    // Store wakeup timestamp (simplified - use proper PID map in production)
-    bpf_map_update_elem(&node_metrics_map, &pid, &ts, BPF_ANY);
+    bpf_map_update_elem(&udp_send_start, &id, &now, BPF_ANY);
+    return 0;
+}
+
+// An IPv6 socket sending to a v4-mapped address nests udp_sendmsg inside
+// udpv6_sendmsg; the inner call is the one recorded
+static __always_inline int udp_send_exit(void) {
+    __u64 id = bpf_get_current_pid_tgid();
+    __u64 *start = bpf_map_lookup_elem(&udp_send_start, &id);
     
+    if (!start)
+        return 0;
+    record_net_latency(NET_HIST_UDP_SEND, (bpf_ktime_get_ns() - *start) / 1000);
+    bpf_map_delete_elem(&udp_send_start, &id);
+    return 0;
+}
+
+SEC("kprobe/udp_sendmsg")
+int BPF_KPROBE(kprobe_udp_sendmsg) {
+    return udp_send_enter();
+}
+
+SEC("kretprobe/udp_sendmsg")
+int BPF_KRETPROBE(kretprobe_udp_sendmsg) {
+    return udp_send_exit();
+}
+
+SEC("kprobe/udpv6_sendmsg")
+int BPF_KPROBE(kprobe_udpv6_sendmsg) {
+    return udp_send_enter();
+}
+
+SEC("kretprobe/udpv6_sendmsg")
+int BPF_KRETPROBE(kretprobe_udpv6_sendmsg) {
+    return udp_send_exit();
+}
+
+// A datagram joins a socket receive queue (IPv4 and IPv6)...
+SEC("kprobe/__udp_enqueue_schedule_skb")
+int BPF_KPROBE(kprobe_udp_enqueue, struct sock *sk, struct sk_buff *skb) {
+    __u64 key = (__u64)skb;
+    __u64 now = bpf_ktime_get_ns();
+    
+    bpf_map_update_elem(&udp_enqueue_ts, &key, &now, BPF_ANY);
+    return 0;
+}
+
+// ...and leaves it once recvmsg has copied it out
+SEC("kprobe/skb_consume_udp")
+int BPF_KPROBE(kprobe_udp_consume, struct sock *sk, struct sk_buff *skb) {
+    __u64 key = (__u64)skb;
+    __u64 *ts = bpf_map_lookup_elem(&udp_enqueue_ts, &key);
+    
+    if (!ts)
+        return 0;
+    record_net_latency(NET_HIST_UDP_RECV, (bpf_ktime_get_ns() - *ts) / 1000);
+    bpf_map_delete_elem(&udp_enqueue_ts, &key);
+    return 0;
+}
+
+// Record when a task becomes runnable, updating in place when the PID
+// already has a slot so the wakeup path does not churn LRU nodes
+static __always_inline void record_enqueue(__u32 pid, __u64 ts) {
+    if (pid == 0)
+        return;
+
+    struct wakeup_state *st = bpf_map_lookup_elem(&wakeup_ts_map, &pid);
+    if (st) {
+        st->ts = ts;
+    } else {
+        struct wakeup_state new_st = { .ts = ts };
+        bpf_map_update_elem(&wakeup_ts_map, &pid, &new_st, BPF_ANY);
+    }
+}
+
+// The wakeup tracepoints run in the waker's context, so the cgroup of a
+// task is remembered whenever it is switched out and used for its next
+// runqueue wait
+static __always_inline void record_task_cgroup(__u32 pid) {
+    if (!cgroup_metrics || pid == 0)
+        return;
+    
+    __u64 cgroup_id = bpf_get_current_cgroup_id();
+    struct wakeup_state *st = bpf_map_lookup_elem(&wakeup_ts_map, &pid);
+    if (st) {
+        st->cgroup_id = cgroup_id;
+    } else {
+        struct wakeup_state new_st = { .cgroup_id = cgroup_id };
+        bpf_map_update_elem(&wakeup_ts_map, &pid, &new_st, BPF_NOEXIST);
+    }
+}
+
+// Add one runqueue wait to the node and cgroup histograms
+static __always_inline void record_runqlat(__u64 latency_us, __u64 cgroup_id) {
+    if (latency_us > 0xffffffff)
+        latency_us = 0xffffffff;
+    __u32 slot = hist_slot(latency_us);
+    
+    if (mmap_stats) {
+        struct node_stats *stats = node_stats_begin();
+        if (!stats)
+            return;
+        if (slot < MAX_SLOTS)
+            stats->runqlat.slots[slot]++;
+        node_stats_end(stats);
+    } else {
+        __u32 epoch = hist_epoch & (NR_HIST_EPOCHS - 1);
+        struct hist *hist = bpf_map_lookup_elem(&runqlat_hist_map, &epoch);
+        if (!hist)
+            return;
+        if (slot < MAX_SLOTS)
+            metric_add(&hist->slots[slot], 1);
+    }
+    
+    struct cgroup_metrics *cg = lookup_cgroup(cgroup_id);
+    if (cg) {
+        if (slot < MAX_SLOTS)
+            __sync_fetch_and_add(&cg->runqlat.slots[slot], 1);
+        __sync_fetch_and_add(&cg->runqlat_count, 1);
+    }
+}
+
+// Tracepoints for scheduler wakeup (runqueue latency measurement)
+SEC("tracepoint/sched/sched_wakeup")
+int trace_sched_wakeup(struct trace_event_raw_sched_wakeup_template *ctx) {
+    record_enqueue(ctx->pid, bpf_ktime_get_ns());
+    return 0;
+}
+
+SEC("tracepoint/sched/sched_wakeup_new")
+int trace_sched_wakeup_new(struct trace_event_raw_sched_wakeup_template *ctx) {
+    record_enqueue(ctx->pid, bpf_ktime_get_ns());
     return 0;
 }
 
@@ -242,32 +1192,98 @@ int trace_sched_switch(struct trace_event_raw_sched_switch *ctx) {
     __u64 ts = bpf_ktime_get_ns();
     __u32 next_pid = ctx->next_pid;
     
+    // prev is still current here
+    record_task_cgroup(ctx->prev_pid);
+    
+    // A preempted task goes straight back onto the runqueue, and so does
+    // one that switched out still runnable (TASK_RUNNING)
+    if (ctx->prev_state == TASK_REPORT_MAX || ctx->prev_state == 0)
+        record_enqueue(ctx->prev_pid, ts);
+    
     // Calculate runqueue latency
-    __u64 *wakeup_ts = bpf_map_lookup_elem(&node_metrics_map, &next_pid);
-    if (!wakeup_ts)
+    struct wakeup_state *st = bpf_map_lookup_elem(&wakeup_ts_map, &next_pid);
+    if (!st || st->ts == 0)
         return 0;
     
-    __u64 latency_ns = ts - *wakeup_ts;
-    __u32 latency_ms = latency_ns / 1000000;  // Convert to milliseconds
+    __u64 latency_us = (ts - st->ts) / 1000;
     
-    __u32 node_id = get_node_id();
+    // Consume the timestamp in place rather than deleting the entry; stale
+    // PIDs age out of the LRU map on their own
+    st->ts = 0;
     
-    struct node_metrics *metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-    if (!metrics) {
-        struct node_metrics new_metrics = {};
-        bpf_map_update_elem(&node_metrics_map, &node_id, &new_metrics, BPF_ANY);
-        metrics = bpf_map_lookup_elem(&node_metrics_map, &node_id);
-        if (!metrics)
-            return 0;
+    record_runqlat(latency_us, st->cgroup_id);
+    return 0;
+}
+
+// tp_btf variant of the three hooks above for kernels with task storage
+// (5.11+). The kernel idle tasks share pid 0 and are skipped like there.
+static __always_inline void record_enqueue_task(struct task_struct *p, __u64 ts) {
+    if (p->pid == 0)
+        return;
+    
+    struct wakeup_state *st = bpf_task_storage_get(&task_wakeup_storage, p, NULL,
+                                                   BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (st)
+        st->ts = ts;
+}
+
+// task_struct.state became __state in 5.14
+struct task_struct___pre514 {
+    long state;
+} __attribute__((preserve_access_index));
+
+static __always_inline bool task_running(struct task_struct *p) {
+    if (bpf_core_field_exists(p->__state))
+        return BPF_CORE_READ(p, __state) == 0;
+    return BPF_CORE_READ((struct task_struct___pre514 *)p, state) == 0;
+}
+
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(tp_btf_sched_wakeup, struct task_struct *p) {
+    record_enqueue_task(p, bpf_ktime_get_ns());
+    return 0;
+}
+
+SEC("tp_btf/sched_wakeup_new")
+int BPF_PROG(tp_btf_sched_wakeup_new, struct task_struct *p) {
+    record_enqueue_task(p, bpf_ktime_get_ns());
+    return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(tp_btf_sched_switch, bool preempt, struct task_struct *prev,
+             struct task_struct *next) {
+    __u64 ts = bpf_ktime_get_ns();
+    
+    if (cgroup_metrics && prev->pid != 0) {
+        struct wakeup_state *st = bpf_task_storage_get(&task_wakeup_storage, prev, NULL,
+                                                       BPF_LOCAL_STORAGE_GET_F_CREATE);
+        if (st)
+            st->cgroup_id = bpf_get_current_cgroup_id();
     }
+    if (preempt || task_running(prev))
+        record_enqueue_task(prev, ts);
     
-    __sync_fetch_and_add(&metrics->runqlat_sum, latency_ms);
-    __sync_fetch_and_add(&metrics->runqlat_count, 1);
-    metrics->timestamp = ts;
+    // Look up without creating: a task that never waited has no state
+    struct wakeup_state *st = bpf_task_storage_get(&task_wakeup_storage, next, NULL, 0);
+    if (!st || st->ts == 0)
+        return 0;
     
-    // Clean up wakeup timestamp
-    bpf_map_delete_elem(&node_metrics_map, &next_pid);
+    __u64 latency_us = (ts - st->ts) / 1000;
+    st->ts = 0;
+    record_runqlat(latency_us, st->cgroup_id);
+    return 0;
+}
+
+// Flush batches that no new event pushed out. The agent attaches this to
+// a clock event on every CPU when --batch-events is set.
+SEC("perf_event")
+int flush_event_batch(struct bpf_perf_event_data *ctx) {
+    __u32 zero = 0;
+    struct event_staging *st = bpf_map_lookup_elem(&event_staging_map, &zero);
     
+    if (st)
+        flush_batch(st);
     return 0;
 }
 
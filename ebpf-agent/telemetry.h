@@ -0,0 +1,192 @@
+// Definitions shared between the eBPF program and the userspace agent
+
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+// Log-linear (HDR-style) histogram: every power of two is split into
+// HIST_SUB_BUCKETS linear sub-buckets, so values below HIST_SUB_BUCKETS * 2
+// get one slot each and the relative bucket width stays under 1/8 above.
+// 256 slots cover any __u32 value (up to ~71 minutes in microseconds).
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define MAX_SLOTS 256
+#define MAX_PEERS 4096
+#define MAX_PIDS 10240
+#define MAX_SOCKETS 16384
+#define MAX_DROP_REASONS 128
+#define MAX_DROP_LOCATIONS 1024
+#define MAX_CGROUPS 1024
+
+// Histogram of RTT and runqueue latency in microseconds
+struct hist {
+    __u32 slots[MAX_SLOTS];
+};
+
+// Key of the node-wide entries in node_metrics_map
+#define LOCAL_NODE_ID 0
+
+// rtt_hist_map, runqlat_hist_map and the flow maps hold one value per
+// epoch. The BPF programs add to the epoch in hist_epoch; each interval
+// the agent moves hist_epoch on, then reads and zeroes the epoch it retired.
+#define NR_HIST_EPOCHS 2
+
+// Remote peer address; IPv4 (including v4-mapped v6) uses addr[0..3]
+struct peer_key {
+    __u8 addr[16];
+    __u16 family;  // AF_INET or AF_INET6
+    __u16 pad;
+};
+
+// Per-peer RTT (microseconds) and retransmission counters
+struct peer_metrics {
+    struct hist rtt;
+    __u64 rtt_sum;
+    __u64 rtt_count;
+    __u64 retrans_count;
+};
+
+// Per-cgroup RTT (microseconds), retransmits and runqueue latency
+struct cgroup_metrics {
+    struct hist rtt;
+    struct hist runqlat;
+    __u64 rtt_count;
+    __u64 retrans_count;
+    __u64 runqlat_count;
+};
+
+// Flow heavy hitters (--flow-topk). Each CPU keeps a count-min sketch of
+// retransmits per flow and two small top-K tables, one ranked by the
+// sketch's retransmit estimate and one by worst srtt; the agent merges the
+// per-CPU candidates. Memory stays fixed however many flows there are.
+#define FLOW_SKETCH_DEPTH 4
+#define FLOW_SKETCH_WIDTH 1024   // power of two
+#define FLOW_TOPK 16             // power of two
+
+// 5-tuple of a TCP socket; IPv4 (including v4-mapped v6) uses the first
+// word of each address
+struct flow_key {
+    __u32 saddr[4];
+    __u32 daddr[4];
+    __u16 sport;    // host byte order
+    __u16 dport;    // host byte order
+    __u16 family;   // AF_INET or AF_INET6
+    __u16 pad;
+};
+
+struct flow_slot {
+    struct flow_key key;
+    __u32 hash;     // of key; 0 marks a free slot
+    __u32 value;    // retransmit estimate, or worst srtt in microseconds
+};
+
+struct flow_sketch {
+    __u32 counts[FLOW_SKETCH_DEPTH][FLOW_SKETCH_WIDTH];
+};
+
+struct flow_topk {
+    struct flow_slot retrans[FLOW_TOPK];
+    struct flow_slot rtt[FLOW_TOPK];
+};
+
+// Connection setup and UDP latency histograms (microseconds); the index of
+// a histogram within an epoch of net_hist_map and in node_stats.net
+enum net_hist {
+    NET_HIST_CONNECT,    // active open: SYN sent until ESTABLISHED
+    NET_HIST_ACCEPT,     // passive open: SYN-ACK sent until the handshake ACK
+    NET_HIST_UDP_SEND,   // time in udp_sendmsg/udpv6_sendmsg (--udp-latency)
+    NET_HIST_UDP_RECV,   // datagram wait in a socket receive queue (--udp-latency)
+    NR_NET_HISTS,
+};
+
+// Node-wide aggregates of one CPU in node_stats_map. The agent maps the
+// array and reads every CPU's slot with plain loads; seq follows the
+// seqcount protocol (odd while the CPU is updating the slot) so a reader
+// can retry a copy that raced an update. Everything only counts up.
+struct node_stats {
+    __u64 seq;
+    __u64 retrans_count;
+    __u64 connect_failed;
+    __u64 drops[MAX_DROP_REASONS];   // by enum skb_drop_reason
+    struct hist rtt;                 // microseconds
+    struct hist runqlat;             // microseconds
+    struct hist net[NR_NET_HISTS];
+};
+
+// Node metrics structure
+struct node_metrics {
+    __u64 rtt_sum;         // microseconds
+    __u64 rtt_count;
+    __u64 retrans_count;
+    __u64 connect_failed;  // active opens that never got ESTABLISHED
+    __u64 timestamp;
+};
+
+// Event types carried in telemetry_event.event_type
+enum event_type {
+    EVENT_RTT = 1,
+    EVENT_RETRANS = 2,
+    EVENT_DROP = 3,
+    EVENT_RUNQLAT = 4,
+};
+
+// Size of event_stats_map, indexed by enum event_type
+#define MAX_EVENT_TYPES 8
+
+// Ring buffer accounting per event type
+struct event_stats {
+    __u64 submitted;       // events written to the ring buffer
+    __u64 reserve_failed;  // events lost because the ring buffer was full
+};
+
+// extra_data flag on RTT events that crossed the outlier threshold
+#define EVENT_F_OUTLIER 1
+
+// Sampling thresholds: an event is exported with probability
+// threshold / 2^32. SAMPLE_ALWAYS exports every event, 0 none.
+#define SAMPLE_ALWAYS 0xffffffffU
+
+// Event structure for userspace communication
+struct telemetry_event {
+    __u32 node_id;
+    __u32 event_type;  // enum event_type
+    __u64 value;
+    __u64 timestamp;
+    __u32 extra_data;  // For drop_reason, etc.
+    __u32 sample_thresh;  // threshold the event was sampled with
+};
+
+// Batched event records (--batch-events). Each CPU stages up to
+// EVENT_BATCH_SIZE compact entries and writes them as one ring buffer
+// record, so the per-record header, reserve and wakeup are paid once per
+// batch instead of once per event. Only LOCAL_NODE_ID events are produced,
+// so entries carry no node_id.
+#define EVENT_BATCH_SIZE 32
+
+struct event_entry {
+    __u32 ts_delta;       // ns after event_batch.base_ts
+    __u32 value;          // truncated telemetry_event.value
+    __u32 sample_thresh;
+    __u16 extra_data;
+    __u8 event_type;
+    __u8 pad;
+};
+
+// Ring buffer record of a batch; only the first count entries are sent
+struct event_batch {
+    __u64 base_ts;
+    __u32 count;
+    __u32 pad;
+    struct event_entry entries[EVENT_BATCH_SIZE];
+};
+
+// Histogram slot of a value. The top set bit of (value | 8) gives the
+// power of two, the next HIST_SUB_BITS bits give the linear sub-bucket;
+// values below 8 land in slots 0-7 as is. No loops and no branches.
+static inline __u32 hist_slot(__u32 value) {
+    __u32 exp = 31 - __builtin_clz(value | HIST_SUB_BUCKETS);
+    __u32 shift = exp - HIST_SUB_BITS;
+    
+    return (shift << HIST_SUB_BITS) + (value >> shift);
+}
+
+#endif /* __TELEMETRY_H */
@@ -198,7 +198,7 @@ collect_metrics() {
         "ebpf_rtt_p50_milliseconds"
         "ebpf_rtt_p99_milliseconds"
         "ebpf_tcp_retrans_rate"
-        "ebpf_drop_rate"
+        "sum by (node) (rate(ebpf_packet_drops_total[1m]))"
         "ebpf_runqlat_p95_milliseconds"
         "ebpf_cpu_utilization"
         "scheduler_framework_score"
@@ -214,8 +214,9 @@ collect_metrics() {
         log "Collecting metric: $query"
         
         # Query Prometheus (simplified - would need proper API calls)
-        curl -s "${PROMETHEUS_URL}/api/v1/query_range?query=${query}&start=${start_time}&end=${end_time}&step=5s" \
-            | jq -r '.data.result[]? | .metric.node as $node | .values[]? | [.[0], "'$query'", ($node // "unknown"), .[1]] | @csv' \
+        curl -s -G "${PROMETHEUS_URL}/api/v1/query_range" --data-urlencode "query=${query}" \
+            -d "start=${start_time}" -d "end=${end_time}" -d "step=5s" \
+            | jq -r '.data.result[]? | .metric.node as $node | .values[]? | [.[0], "'"$query"'", ($node // "unknown"), .[1]] | @csv' \
             >> $metrics_file || warn "Failed to collect $query"
     done
     
@@ -293,7 +294,7 @@ def create_summary_report(results_dir):
             # Calculate average eBPF metrics during test
             avg_rtt_p99 = metrics_df[metrics_df['metric'] == 'ebpf_rtt_p99_milliseconds']['value'].astype(float).mean() if not metrics_df.empty else 0
             avg_retrans = metrics_df[metrics_df['metric'] == 'ebpf_tcp_retrans_rate']['value'].astype(float).mean() if not metrics_df.empty else 0
-            avg_drops = metrics_df[metrics_df['metric'] == 'ebpf_drop_rate']['value'].astype(float).mean() if not metrics_df.empty else 0
+            avg_drops = metrics_df[metrics_df['metric'].str.contains('ebpf_packet_drops_total', regex=False)]['value'].astype(float).mean() if not metrics_df.empty else 0
             avg_cpu = metrics_df[metrics_df['metric'] == 'ebpf_cpu_utilization']['value'].astype(float).mean() if not metrics_df.empty else 0
             
             summary.append({
@@ -183,7 +183,7 @@ data:
             "type": "graph",
             "targets": [
               {
-                "expr": "rate(ebpf_drop_rate[1m])",
+                "expr": "sum by (node) (rate(ebpf_packet_drops_total[1m]))",
                 "legendFormat": "{{node}}"
               }
             ],
@@ -1,13 +1,18 @@
 package main
 
 import (
+	"bytes"
 	"context"
+	"encoding/binary"
 	"encoding/json"
 	"fmt"
 	"log"
+	"math"
+	"net"
 	"net/http"
 	"os"
 	"strconv"
+	"sync/atomic"
 	"time"
 
 	"github.com/prometheus/client_golang/api"
@@ -20,6 +25,7 @@ type SchedulerExtender struct {
 	config       *ExtenderConfig
 	metricsCache map[string]*NodeMetrics
 	lastUpdate   time.Time
+	pushed       pushTable
 }
 
 type ExtenderConfig struct {
@@ -28,6 +34,8 @@ type ExtenderConfig struct {
 	Port          int          `json:"port"`
 	Debug         bool         `json:"debug"`
 	CacheTTL      int          `json:"cache_ttl_seconds"`
+	PushPort      int          `json:"push_port"`
+	PushTTL       int          `json:"push_ttl_ms"`
 }
 
 type ScoreWeights struct {
@@ -55,6 +63,8 @@ func NewSchedulerExtender() (*SchedulerExtender, error) {
 		Port:          getEnvInt("PORT", 8080),
 		Debug:         getEnvBool("DEBUG", true),
 		CacheTTL:      getEnvInt("CACHE_TTL", 10),
+		PushPort:      getEnvInt("PUSH_PORT", 0),
+		PushTTL:       getEnvInt("PUSH_TTL_MS", 3000),
 		Weights: ScoreWeights{
 			RTTp99:      0.3,
 			RetransRate: 0.2,
@@ -154,6 +164,12 @@ func (se *SchedulerExtender) filter(w http.ResponseWriter, r *http.Request) {
 }
 
 func (se *SchedulerExtender) calculateNodeScore(nodeName string) float64 {
+	// Prefer a recent snapshot pushed by the node's agent over Prometheus
+	if node := se.pushed.lookup(nodeName); node != nil &&
+		time.Since(node.received) < time.Duration(se.config.PushTTL)*time.Millisecond {
+		return se.scoreMetrics(&node.metrics)
+	}
+
 	metrics, exists := se.metricsCache[nodeName]
 	if !exists {
 		if se.config.Debug {
@@ -162,6 +178,15 @@ func (se *SchedulerExtender) calculateNodeScore(nodeName string) float64 {
 		return 50.0 // Neutral score
 	}
 
+	finalScore := se.scoreMetrics(metrics)
+
+	// Store calculated score for debugging
+	metrics.Score = finalScore
+
+	return finalScore
+}
+
+func (se *SchedulerExtender) scoreMetrics(metrics *NodeMetrics) float64 {
 	// Normalize metrics and calculate weighted score
 	normalizedRTT := se.normalizeMetric(metrics.RTTp99, 0, 1000, true)
 	normalizedRetrans := se.normalizeMetric(metrics.RetransRate, 0, 100, true)
@@ -176,12 +201,7 @@ func (se *SchedulerExtender) calculateNodeScore(nodeName string) float64 {
 		se.config.Weights.CPUUtil*normalizedCPU
 
 	// Convert to 0-100 range
-	finalScore := score * 100.0
-	
-	// Store calculated score for debugging
-	metrics.Score = finalScore
-
-	return finalScore
+	return score * 100.0
 }
 
 func (se *SchedulerExtender) normalizeMetric(value, min, max float64, lowerIsBetter bool) float64 {
@@ -212,7 +232,7 @@ func (se *SchedulerExtender) updateMetrics(ctx context.Context) error {
 	queries := map[string]string{
 		"rtt_p99":      "ebpf_rtt_p99_milliseconds",
 		"retrans_rate": "ebpf_tcp_retrans_rate",
-		"drop_rate":    "ebpf_drop_rate",
+		"drop_rate":    "sum by (node) (rate(ebpf_packet_drops_total[1m]))",
 		"runqlat_p95":  "ebpf_runqlat_p95_milliseconds",
 		"cpu_util":     "ebpf_cpu_utilization",
 	}
@@ -285,6 +305,125 @@ func (se *SchedulerExtender) updateMetrics(ctx context.Context) error {
 	return nil
 }
 
+// Node snapshots pushed by the agents (ebpf-agent --push=HOST:PORT), one
+// UDP datagram per node and interval. The layout matches struct
+// push_snapshot in ebpf-agent/agent.c: big-endian, 120 bytes.
+const (
+	pushMagic   = 0x45425046 // "EBPF"
+	pushVersion = 1
+	pushSize    = 120
+)
+
+type pushedNode struct {
+	metrics     NodeMetrics
+	timestampNs uint64
+	received    time.Time
+}
+
+// pushTable maps node names to their latest pushed snapshot. The UDP
+// listener is its only writer: it swaps in a new per-node snapshot for
+// every datagram and copies the name map only when a node first appears,
+// so prioritize reads the table without locks.
+type pushTable struct {
+	nodes atomic.Pointer[map[string]*atomic.Pointer[pushedNode]]
+}
+
+func (t *pushTable) lookup(nodeName string) *pushedNode {
+	nodes := t.nodes.Load()
+	if nodes == nil {
+		return nil
+	}
+	if slot, ok := (*nodes)[nodeName]; ok {
+		return slot.Load()
+	}
+	return nil
+}
+
+func (t *pushTable) store(node *pushedNode) {
+	var nodes map[string]*atomic.Pointer[pushedNode]
+	if cur := t.nodes.Load(); cur != nil {
+		nodes = *cur
+	}
+
+	slot, ok := nodes[node.metrics.NodeName]
+	if !ok {
+		grown := make(map[string]*atomic.Pointer[pushedNode], len(nodes)+1)
+		for name, s := range nodes {
+			grown[name] = s
+		}
+		slot = &atomic.Pointer[pushedNode]{}
+		grown[node.metrics.NodeName] = slot
+		t.nodes.Store(&grown)
+	}
+
+	// Datagrams can arrive out of order; keep the newest snapshot
+	if prev := slot.Load(); prev != nil && prev.timestampNs > node.timestampNs {
+		return
+	}
+	slot.Store(node)
+}
+
+func decodePushSnapshot(buf []byte) (*pushedNode, error) {
+	if len(buf) < pushSize {
+		return nil, fmt.Errorf("short snapshot: %d bytes", len(buf))
+	}
+	be := binary.BigEndian
+	if be.Uint32(buf[0:]) != pushMagic || be.Uint16(buf[4:]) != pushVersion ||
+		int(be.Uint16(buf[6:])) != len(buf) {
+		return nil, fmt.Errorf("unknown snapshot format")
+	}
+
+	f := func(off int) float64 { return math.Float64frombits(be.Uint64(buf[off:])) }
+	name := buf[56:120]
+	if i := bytes.IndexByte(name, 0); i >= 0 {
+		name = name[:i]
+	}
+	if len(name) == 0 {
+		return nil, fmt.Errorf("snapshot without node name")
+	}
+
+	node := &pushedNode{
+		timestampNs: be.Uint64(buf[8:]),
+		received:    time.Now(),
+	}
+	node.metrics = NodeMetrics{
+		NodeName:    string(name),
+		RTTp99:      f(16),
+		RetransRate: f(24),
+		DropRate:    f(32),
+		RunqlatP95:  f(40),
+		CPUUtil:     f(48),
+		Timestamp:   int64(node.timestampNs / 1e9),
+	}
+	return node, nil
+}
+
+func (se *SchedulerExtender) listenPush() {
+	conn, err := net.ListenUDP("udp", &net.UDPAddr{Port: se.config.PushPort})
+	if err != nil {
+		log.Printf("Failed to listen for pushed metrics on :%d: %v", se.config.PushPort, err)
+		return
+	}
+	log.Printf("Receiving pushed node metrics on udp :%d", se.config.PushPort)
+
+	buf := make([]byte, 2048)
+	for {
+		n, from, err := conn.ReadFromUDP(buf)
+		if err != nil {
+			log.Printf("Failed to read pushed metrics: %v", err)
+			continue
+		}
+		node, err := decodePushSnapshot(buf[:n])
+		if err != nil {
+			if se.config.Debug {
+				log.Printf("Dropped snapshot from %s: %v", from, err)
+			}
+			continue
+		}
+		se.pushed.store(node)
+	}
+}
+
 func (se *SchedulerExtender) metricsHandler(w http.ResponseWriter, r *http.Request) {
 	w.Header().Set("Content-Type", "application/json")
 	json.NewEncoder(w).Encode(se.metricsCache)
@@ -326,6 +465,10 @@ func main() {
 		log.Fatalf("Failed to create scheduler extender: %v", err)
 	}
 
+	if extender.config.PushPort > 0 {
+		go extender.listenPush()
+	}
+
 	// Setup HTTP routes
 	http.HandleFunc("/filter", extender.filter)
 	http.HandleFunc("/prioritize", extender.prioritize)